@@ -0,0 +1,211 @@
+#include "bench.hpp"
+#include <json>
+
+#include <ctime>
+#include <regex>
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+
+using namespace nodecxx;
+using namespace nodecxx::bench;
+
+namespace {
+
+struct Benchmark {
+    std::string name;
+    Function function;
+};
+
+std::vector<Benchmark>& registry() {
+    static std::vector<Benchmark> res;
+    return res;
+}
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t cpuNow() {
+    ::timespec ts;
+    ::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct Result {
+    std::string name;
+    unsigned repetition;
+    uint64_t iterations;
+    // per iteration
+    double realTime;
+    double cpuTime;
+    double bytesPerSecond;
+    double itemsPerSecond;
+};
+
+Result measure(const Benchmark& b, double minTime, unsigned repetition) {
+    uint64_t iterations = 1;
+    for (;;) {
+        State state(iterations);
+        auto start = now();
+        auto cpuStart = cpuNow();
+        b.function(state);
+        auto cpu = cpuNow() - cpuStart - state.pausedNanoseconds();
+        auto elapsed = now() - start - state.pausedNanoseconds();
+        double seconds = elapsed / 1e9;
+        if (seconds >= minTime || iterations >= 1000000000) {
+            Result res;
+            res.name = b.name;
+            res.repetition = repetition;
+            res.iterations = iterations;
+            res.realTime = double(elapsed) / iterations;
+            res.cpuTime = double(cpu) / iterations;
+            res.bytesPerSecond = seconds > 0 ? state.bytesProcessed() / seconds : 0;
+            res.itemsPerSecond = seconds > 0 ? state.itemsProcessed() / seconds : 0;
+            return res;
+        }
+        // aim a bit above minTime, but grow at most 10x per round
+        double factor = seconds > 0 ? minTime * 1.4 / seconds : 10.0;
+        factor = std::min(std::max(factor, 1.5), 10.0);
+        iterations = uint64_t(iterations * factor) + 1;
+    }
+}
+
+Json context(const char* executable) {
+    char host[256] = {};
+    ::gethostname(host, sizeof(host) - 1);
+    char date[64];
+    auto t = std::time(nullptr);
+    ::tm local;
+    ::localtime_r(&t, &local);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &local);
+    return Json::object {
+        { "date", date },
+        { "host_name", host },
+        { "executable", executable },
+        { "num_cpus", int(::sysconf(_SC_NPROCESSORS_ONLN)) },
+#ifdef NDEBUG
+        { "library_build_type", "release" },
+#else
+        { "library_build_type", "debug" },
+#endif
+    };
+}
+
+Json toJson(const Result& r, unsigned repetitions) {
+    Json::object res {
+        { "name", r.name },
+        { "run_name", r.name },
+        { "run_type", "iteration" },
+        { "repetitions", int(repetitions) },
+        { "repetition_index", int(r.repetition) },
+        { "threads", 1 },
+        { "iterations", double(r.iterations) },
+        { "real_time", r.realTime },
+        { "cpu_time", r.cpuTime },
+        { "time_unit", "ns" },
+    };
+    if (r.bytesPerSecond > 0) res["bytes_per_second"] = r.bytesPerSecond;
+    if (r.itemsPerSecond > 0) res["items_per_second"] = r.itemsPerSecond;
+    return res;
+}
+
+void usage(const char* name) {
+    std::cerr << "usage: " << name << " [--filter=<regex>] [--min-time=<seconds>] [--repetitions=<n>]\n"
+              << "       [--format=console|json] [--out=<file>] [--list]\n";
+}
+
+} // anonymous namespace
+
+namespace nodecxx {
+namespace bench {
+
+void State::pauseTiming() {
+    pausedAt = now();
+}
+
+void State::resumeTiming() {
+    pausedFor += now() - pausedAt;
+}
+
+int registerBenchmark(const char* name, Function function) {
+    registry().push_back(Benchmark{ name, function });
+    return int(registry().size());
+}
+
+} // namespace bench
+} // namespace nodecxx
+
+int main(int argc, char* argv[]) {
+    std::string filter = ".";
+    double minTime = 0.5;
+    unsigned repetitions = 1;
+    bool json = false;
+    bool list = false;
+    std::string outPath;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&arg](const char* option) -> const char* {
+            auto len = std::strlen(option);
+            return arg.compare(0, len, option) == 0 ? arg.c_str() + len : nullptr;
+        };
+        if (auto v = value("--filter=")) filter = v;
+        else if (auto v = value("--min-time=")) minTime = std::atof(v);
+        else if (auto v = value("--repetitions=")) repetitions = std::max(1, std::atoi(v));
+        else if (auto v = value("--format=")) json = std::strcmp(v, "json") == 0;
+        else if (auto v = value("--out=")) outPath = v;
+        else if (arg == "--list") list = true;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    std::regex pattern(filter);
+    std::vector<Result> results;
+    for (const auto& b : registry()) {
+        if (!std::regex_search(b.name, pattern)) continue;
+        if (list) {
+            std::cout << b.name << '\n';
+            continue;
+        }
+        for (unsigned r = 0; r < repetitions; ++r) {
+            results.push_back(measure(b, minTime, r));
+            const auto& res = results.back();
+            if (!json) {
+                std::fprintf(stdout, "%-48s %12.1f ns %12.1f ns %12llu", res.name.c_str(), res.realTime,
+                             res.cpuTime, static_cast<unsigned long long>(res.iterations));
+                if (res.bytesPerSecond > 0) std::fprintf(stdout, "  %.1f MB/s", res.bytesPerSecond / 1e6);
+                if (res.itemsPerSecond > 0) std::fprintf(stdout, "  %.1f k items/s", res.itemsPerSecond / 1e3);
+                std::fprintf(stdout, "\n");
+                std::fflush(stdout);
+            }
+        }
+    }
+    if (list) return 0;
+    if (json || !outPath.empty()) {
+        Json::array benchmarks;
+        for (const auto& r : results) {
+            benchmarks.push_back(toJson(r, repetitions));
+        }
+        auto text = Json(Json::object {
+            { "context", context(argv[0]) },
+            { "benchmarks", benchmarks },
+        }).dump();
+        if (outPath.empty()) {
+            std::cout << text << '\n';
+        } else {
+            std::ofstream out(outPath);
+            out << text << '\n';
+            if (!out) {
+                std::cerr << "cannot write " << outPath << '\n';
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
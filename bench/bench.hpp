@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// A small harness in the spirit of Google Benchmark. Every benchmark runs
+// with a growing number of iterations until it takes long enough, the
+// results can be written as JSON in the format of Google Benchmark, so its
+// tools/compare.py works on them.
+
+namespace nodecxx {
+namespace bench {
+
+class State {
+    uint64_t mIterations;
+    uint64_t remaining;
+    uint64_t mBytes = 0;
+    uint64_t mItems = 0;
+    int64_t pausedAt = 0;
+    int64_t pausedFor = 0;
+public:
+    explicit State(uint64_t iterations)
+        : mIterations(iterations)
+        , remaining(iterations)
+    {}
+    // the loop around the measured code
+    bool keepRunning() {
+        if (remaining == 0) return false;
+        --remaining;
+        return true;
+    }
+    uint64_t iterations() const { return mIterations; }
+    // work done by all iterations, reported per second
+    void setBytesProcessed(uint64_t bytes) { mBytes = bytes; }
+    void setItemsProcessed(uint64_t items) { mItems = items; }
+    uint64_t bytesProcessed() const { return mBytes; }
+    uint64_t itemsProcessed() const { return mItems; }
+    // excludes setup work inside the loop from the measurement
+    void pauseTiming();
+    void resumeTiming();
+    int64_t pausedNanoseconds() const { return pausedFor; }
+};
+
+using Function = void (*)(State&);
+
+int registerBenchmark(const char* name, Function function);
+
+// keeps the compiler from optimizing value away
+template<class T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void clobberMemory() {
+    asm volatile("" : : : "memory");
+}
+
+} // namespace bench
+} // namespace nodecxx
+
+#define NODECXX_BENCHMARK_NAMED(function, name) \
+    static int function##Registered = ::nodecxx::bench::registerBenchmark(name, &function)
+
+#define NODECXX_BENCHMARK(function) NODECXX_BENCHMARK_NAMED(function, #function)
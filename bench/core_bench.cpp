@@ -0,0 +1,110 @@
+#include "bench.hpp"
+#include <events.hpp>
+#include <net/net.hpp>
+#include <net/events.hpp>
+
+#include <string>
+
+using namespace nodecxx;
+using namespace nodecxx::bench;
+
+namespace {
+
+Json smallResponse() {
+    return Json::object {
+        { "key1", "value1" },
+        { "key2", "value2" },
+        { "arr", Json::array { 12.5, 2.0 } },
+    };
+}
+
+// a page of a listing, about 4K of JSON
+Json largeResponse() {
+    Json::array items;
+    for (int i = 0; i < 32; ++i) {
+        items.push_back(Json::object {
+            { "id", i },
+            { "name", "item number " + std::to_string(i) },
+            { "price", 9.99 + i },
+            { "tags", Json::array { "new", "sale", "popular" } },
+            { "available", i % 3 != 0 },
+        });
+    }
+    return Json::object {
+        { "page", 1 },
+        { "pageSize", 32 },
+        { "total", 4711 },
+        { "items", items },
+    };
+}
+
+void serialize(State& state, const Json& json) {
+    serializer<Json> ser;
+    size_t bytes = 0;
+    while (state.keepRunning()) {
+        auto str = ser(json);
+        bytes += str.size();
+        doNotOptimize(str);
+    }
+    state.setBytesProcessed(bytes);
+}
+
+void Json_SerializeSmall(State& state) { serialize(state, smallResponse()); }
+void Json_SerializeLarge(State& state) { serialize(state, largeResponse()); }
+
+NODECXX_BENCHMARK(Json_SerializeSmall);
+NODECXX_BENCHMARK(Json_SerializeLarge);
+
+void Json_ParseLarge(State& state) {
+    auto text = largeResponse().dump();
+    while (state.keepRunning()) {
+        std::string err;
+        auto json = Json::parse(text, err);
+        doNotOptimize(json);
+    }
+    state.setBytesProcessed(state.iterations() * text.size());
+}
+
+NODECXX_BENCHMARK(Json_ParseLarge);
+
+struct Emitter : EmittingEvents<close_t, data_t, drain_t> {
+    template<class T, class... Args>
+    bool emit(T t, Args&&... args) {
+        return fireEvent(t, std::forward<Args>(args)...);
+    }
+};
+
+void fire(State& state, int listeners) {
+    Emitter emitter;
+    size_t total = 0;
+    for (int i = 0; i < listeners; ++i) {
+        emitter.on(data, [&total](const char*, size_t size) { total += size; });
+    }
+    const char chunk[64] = {};
+    while (state.keepRunning()) {
+        emitter.emit(data, chunk, sizeof(chunk));
+    }
+    doNotOptimize(total);
+    state.setItemsProcessed(state.iterations() * listeners);
+}
+
+void Events_FireOneListener(State& state) { fire(state, 1); }
+void Events_FireFourListeners(State& state) { fire(state, 4); }
+
+NODECXX_BENCHMARK(Events_FireOneListener);
+NODECXX_BENCHMARK(Events_FireFourListeners);
+
+// the event is the last of the list, so the lookup walks all bases
+void Events_FireLastEvent(State& state) {
+    Emitter emitter;
+    int count = 0;
+    emitter.on(drain, [&count]() { ++count; });
+    while (state.keepRunning()) {
+        emitter.emit(drain);
+    }
+    doNotOptimize(count);
+}
+
+NODECXX_BENCHMARK(Events_FireLastEvent);
+
+} // anonymous namespace
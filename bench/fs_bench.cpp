@@ -0,0 +1,92 @@
+#include "bench.hpp"
+#include <core.hpp>
+#include <fs/fs.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace boost::asio;
+using namespace nodecxx;
+using namespace nodecxx::bench;
+
+namespace {
+
+constexpr size_t fileSize = 16 * 1024 * 1024;
+constexpr size_t blockSize = 4096;
+
+// a file in the page cache, removed at exit
+const std::string& testFile() {
+    static std::string path = []() {
+        char name[] = "/tmp/nodecxx_bench_XXXXXX";
+        int fd = ::mkstemp(name);
+        std::vector<char> data(1024 * 1024, 'x');
+        for (size_t written = 0; written < fileSize; written += data.size()) {
+            if (::write(fd, data.data(), data.size()) < 0) break;
+        }
+        ::close(fd);
+        std::atexit([]() { ::unlink(testFile().c_str()); });
+        return std::string(name);
+    }();
+    return path;
+}
+
+uint64_t offsetOf(uint64_t n) {
+    // spread over the file, aligned to blocks
+    return (n * 7919 % (fileSize / blockSize)) * blockSize;
+}
+
+// one read at a time, the latency of a round trip to the pool
+void FileService_ReadLatency(State& state) {
+    impl::File file(core::service());
+    file.open(testFile().c_str(), "r");
+    std::vector<char> buf(blockSize);
+    uint64_t n = 0;
+    while (state.keepRunning()) {
+        file.async_read_some_at(offsetOf(n++), buffer(buf), [](const boost::system::error_code&, size_t) {});
+        core::service().run();
+        core::service().restart();
+    }
+    state.setBytesProcessed(state.iterations() * blockSize);
+}
+
+NODECXX_BENCHMARK(FileService_ReadLatency);
+
+// 64 reads in flight, the throughput of the pool
+void FileService_ReadBatch64(State& state) {
+    constexpr int batch = 64;
+    impl::File file(core::service());
+    file.open(testFile().c_str(), "r");
+    std::vector<std::vector<char>> bufs(batch, std::vector<char>(blockSize));
+    uint64_t n = 0;
+    while (state.keepRunning()) {
+        for (int i = 0; i < batch; ++i) {
+            file.async_read_some_at(offsetOf(n++), buffer(bufs[i]), [](const boost::system::error_code&, size_t) {});
+        }
+        core::service().run();
+        core::service().restart();
+    }
+    state.setBytesProcessed(state.iterations() * batch * blockSize);
+    state.setItemsProcessed(state.iterations() * batch);
+}
+
+NODECXX_BENCHMARK(FileService_ReadBatch64);
+
+// pread on the calling thread, the baseline for the two above
+void FileService_ReadSync(State& state) {
+    impl::File file(core::service());
+    file.open(testFile().c_str(), "r");
+    std::vector<char> buf(blockSize);
+    uint64_t n = 0;
+    while (state.keepRunning()) {
+        boost::system::error_code ec;
+        auto res = file.read_some_at(offsetOf(n++), buffer(buf), ec);
+        doNotOptimize(res);
+    }
+    state.setBytesProcessed(state.iterations() * blockSize);
+}
+
+NODECXX_BENCHMARK(FileService_ReadSync);
+
+} // anonymous namespace
@@ -1,8 +1,12 @@
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <memory>
 #include <thread>
-#include <iostream>
+#include <csignal>
 
 #include "core.hpp"
+#include "loop.hpp"
+#include <metrics/loop_monitor.hpp>
 
 namespace nodecxx {
 namespace core {
@@ -12,19 +16,70 @@ boost::asio::io_service& service() {
     return res;
 }
 
+namespace {
+
+std::vector<Loop*>& currentLoops() {
+    static std::vector<Loop*> res{&Loop::main()};
+    return res;
+}
+
+} // anonymous namespace
+
+boost::asio::io_service& currentService() {
+    auto loop = Loop::current();
+    return loop ? loop->service() : service();
+}
+
+const std::vector<Loop*>& loops() {
+    return currentLoops();
+}
+
 } // namespace core
 
 void run(unsigned numThreads) {
+    // like node, writes to connections the peer closed fail with EPIPE
+    // instead of killing the process. asio passes MSG_NOSIGNAL, but
+    // sendfile and io_uring sends raise SIGPIPE.
+    ::signal(SIGPIPE, SIG_IGN);
+    numThreads = std::max(numThreads, 1u);
+    auto& main = Loop::main();
+    // set up before any thread starts, servers read it from all loops
+    std::vector<std::unique_ptr<Loop>> shards;
+    auto& loops = core::currentLoops();
+    loops.assign(1, &main);
+    for (unsigned i = 1; i < numThreads; ++i) {
+        shards.emplace_back(new Loop());
+        loops.push_back(shards.back().get());
+    }
+    auto& monitor = metrics::LoopMonitor::instance();
+    bool monitored = monitor.enabled();
+    if (monitored) {
+        std::vector<boost::asio::io_service*> services;
+        for (auto loop : loops) services.push_back(&loop->service());
+        monitor.start(services);
+    }
     std::vector<std::thread> threads;
-    threads.reserve(numThreads);
-    for (unsigned i = 0; i < numThreads - 1; ++i) {
-        threads.emplace_back([]() { core::service().run(); });
+    threads.reserve(shards.size());
+    for (unsigned i = 1; i < numThreads; ++i) {
+        threads.emplace_back([&monitor, loop = loops[i], monitored, i]() {
+            impl::CurrentLoop scope(loop);
+            // kept running while there is nothing to do, until main is done
+            auto work = boost::asio::make_work_guard(loop->service());
+            if (monitored) monitor.runThread(i);
+            else loop->service().run();
+        });
     }
-    std::cout << "io_service run\n";
-    core::service().run();
+    {
+        impl::CurrentLoop scope(&main);
+        if (monitored) monitor.runThread(0);
+        else core::service().run();
+    }
+    for (auto& shard : shards) shard->stop();
     for (auto& t : threads) t.join();
-    std::cout << "done\n";
+    if (monitored) {
+        monitor.stop();
+    }
+    loops.assign(1, &main);
 }
 
 } // namespace nodecxx
-
@@ -1,12 +1,28 @@
 #pragma once
+#include <vector>
 #include <boost/asio.hpp>
 
 namespace nodecxx {
+
+class Loop;
+
 namespace core {
 boost::asio::io_service& service();
+// The io_service of the loop the calling thread runs, service() outside of
+// loop threads. Asynchronous calls that take no io_service complete there.
+boost::asio::io_service& currentService();
+// The loops of the current run(), Loop::main() first. Just Loop::main()
+// outside of run().
+const std::vector<Loop*>& loops();
 } // namespace core
 
+// Runs Loop::main() on the calling thread until core::service() runs out of
+// work or is stopped, and numThreads - 1 further loops on threads of their
+// own meanwhile, which are stopped then. Open sockets of the other loops
+// count as work of core::service(). Every loop is single-threaded:
+// servers hand their connections to the loops in turn, and a connection
+// stays on its loop. The threads are watched if metrics::LoopMonitor got
+// enabled.
 void run(unsigned numThreads = 1);
 
 } // namespace nodecxx
-
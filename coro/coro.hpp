@@ -0,0 +1,356 @@
+#pragma once
+// Awaitable versions of the callback interfaces, for code built as C++20.
+// The library itself stays C++17, this header adds nothing to it.
+#if !defined(__cpp_impl_coroutine)
+#error "coro/coro.hpp needs C++20 coroutines (-std=c++20)"
+#endif
+
+// Before any Boost header: the awaitable.hpp of Boost 1.74, which asio.hpp
+// includes in C++20 mode, uses std::exchange without including <utility>.
+// Include this header before the other nodecxx headers.
+#include <utility>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <boost/asio.hpp>
+#include <loop.hpp>
+#include <net/net.hpp>
+#include <http/http.hpp>
+#include <fs/fs.hpp>
+
+namespace nodecxx {
+namespace coro {
+
+namespace impl {
+
+// Keeps the frames of finished coroutines for reuse, by size in steps of
+// 64 bytes. Coroutines are resumed on the loop that started them, so every
+// loop thread has a pool of its own and takes no lock. Larger frames, and
+// frames beyond maxFree of a size, go to the global heap.
+class FramePool {
+    static constexpr size_t granule = 64;
+    static constexpr size_t classes = 32;
+    static constexpr unsigned maxFree = 64;
+    struct Free {
+        Free* next;
+    };
+    Free* lists[classes] = {};
+    unsigned counts[classes] = {};
+    static size_t classOf(size_t size) { return (size + granule - 1) / granule - 1; }
+public:
+    FramePool() = default;
+    FramePool(const FramePool&) = delete;
+    FramePool& operator= (const FramePool&) = delete;
+    ~FramePool() {
+        for (auto free : lists) {
+            while (free) {
+                ::operator delete(std::exchange(free, free->next));
+            }
+        }
+    }
+    static FramePool& local() {
+        static thread_local FramePool pool;
+        return pool;
+    }
+    void* allocate(size_t size) {
+        auto c = classOf(size);
+        if (c >= classes) return ::operator new(size);
+        if (auto free = lists[c]) {
+            lists[c] = free->next;
+            --counts[c];
+            return free;
+        }
+        return ::operator new((c + 1) * granule);
+    }
+    void deallocate(void* p, size_t size) {
+        auto c = classOf(size);
+        if (c >= classes || counts[c] == maxFree) {
+            ::operator delete(p);
+            return;
+        }
+        lists[c] = new (p) Free{lists[c]};
+        ++counts[c];
+    }
+};
+
+struct PromiseBase {
+    // resumed when the coroutine finished, unless it is detached
+    std::coroutine_handle<> continuation;
+    // set by spawn(), the frame frees itself when the coroutine finished
+    bool detached = false;
+    std::exception_ptr exception;
+
+    static void* operator new(size_t size) {
+        return FramePool::local().allocate(size);
+    }
+    static void operator delete(void* p, size_t size) {
+        FramePool::local().deallocate(p, size);
+    }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            auto& promise = h.promise();
+            if (promise.detached) {
+                h.destroy();
+                return std::noop_coroutine();
+            }
+            if (promise.continuation) return promise.continuation;
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    // Nothing awaits a detached coroutine, what it throws is rethrown on
+    // the loop like an exception thrown by a callback
+    void unhandled_exception() {
+        if (!detached) {
+            exception = std::current_exception();
+            return;
+        }
+        auto loop = Loop::current();
+        (loop ? *loop : Loop::main()).post([e = std::current_exception()]() {
+            std::rethrow_exception(e);
+        });
+    }
+};
+
+template<class T>
+struct Returns {
+    std::optional<T> value;
+    template<class U>
+    void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+    T take() { return std::move(*value); }
+};
+
+template<>
+struct Returns<void> {
+    void return_void() {}
+    void take() {}
+};
+
+} // namespace impl
+
+// A coroutine that starts when it is awaited, or when it is handed to
+// spawn(). Awaiting it resumes the awaiting coroutine right when it
+// finished, without a trip through the loop.
+template<class T = void>
+class [[nodiscard]] Task {
+public:
+    struct promise_type : impl::PromiseBase, impl::Returns<T> {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+private:
+    std::coroutine_handle<promise_type> handle;
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+public:
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator= (Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() {
+                auto& promise = handle.promise();
+                if (promise.exception) std::rethrow_exception(promise.exception);
+                return promise.take();
+            }
+        };
+        return Awaiter{handle};
+    }
+    // for spawn()
+    std::coroutine_handle<promise_type> release() { return std::exchange(handle, nullptr); }
+};
+
+// Starts task on the calling thread, it runs until its first suspension
+// and frees itself when it finished. Request handlers start their
+// coroutine with it:
+//
+//   server.on(request, [](IncomingMessage& req, HttpServerResponse& resp) {
+//       coro::spawn(handle(req, resp));
+//   });
+template<class T>
+void spawn(Task<T> task) {
+    auto handle = task.release();
+    handle.promise().detached = true;
+    handle.resume();
+}
+
+// what a file operation completed with
+struct IoResult {
+    boost::system::error_code ec;
+    size_t bytes = 0;
+};
+
+namespace impl {
+
+// resumes the coroutine from the completion handler, which runs on the
+// loop of the file
+template<class Start>
+struct IoAwaiter {
+    Start start;
+    IoResult result;
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        start([this, h](const boost::system::error_code& ec, size_t bytes) {
+            result.ec = ec;
+            result.bytes = bytes;
+            h.resume();
+        });
+    }
+    IoResult await_resume() { return result; }
+};
+
+template<class Start>
+IoAwaiter<Start> ioAwaiter(Start start) {
+    return IoAwaiter<Start>{std::move(start), {}};
+}
+
+} // namespace impl
+
+// co_await file.async_read_some_at(offset, buffer, ...)
+template<class Buffer>
+auto read_at(nodecxx::impl::File& file, uint64_t offset, Buffer buffer) {
+    return impl::ioAwaiter([&file, offset, buffer](auto handler) {
+        file.async_read_some_at(offset, buffer, std::move(handler));
+    });
+}
+
+// co_await file.async_write_some_at(offset, buffer, ...)
+template<class Buffer>
+auto write_at(nodecxx::impl::File& file, uint64_t offset, Buffer buffer) {
+    return impl::ioAwaiter([&file, offset, buffer](auto handler) {
+        file.async_write_some_at(offset, buffer, std::move(handler));
+    });
+}
+
+// Reads a socket into buffers of the caller. Sockets push their data to
+// listeners, so a reader listens once per socket and keeps what arrives
+// while no read() is awaited. Create one per socket, right after it got
+// accepted or connected.
+template<class Protocol>
+class Reader {
+    struct State {
+        std::string pending;
+        bool ended = false;
+        std::coroutine_handle<> waiter;
+        boost::asio::mutable_buffer target;
+        size_t got = 0;
+        size_t take(boost::asio::mutable_buffer into) {
+            auto n = std::min(into.size(), pending.size());
+            pending.copy(static_cast<char*>(into.data()), n);
+            pending.erase(0, n);
+            return n;
+        }
+    };
+    // shared with the listeners, which outlive the reader if the socket does
+    std::shared_ptr<State> state;
+public:
+    explicit Reader(Socket<Protocol>& socket)
+        : state(std::make_shared<State>())
+    {
+        socket.on(::nodecxx::data, [state = state](const char* bytes, size_t size) {
+            state->pending.append(bytes, size);
+            if (state->waiter) {
+                state->got = state->take(state->target);
+                std::exchange(state->waiter, nullptr).resume();
+            }
+        });
+        socket.on(::nodecxx::close, [state = state](bool) {
+            state->ended = true;
+            if (state->waiter) {
+                state->got = 0;
+                std::exchange(state->waiter, nullptr).resume();
+            }
+        });
+    }
+    // co_await read(buffer) gives the number of bytes read into buffer, 0
+    // once the socket closed and everything got read
+    auto read(boost::asio::mutable_buffer buffer) {
+        struct Awaiter {
+            State& state;
+            boost::asio::mutable_buffer buffer;
+            bool await_ready() noexcept {
+                return !state.pending.empty() || state.ended || buffer.size() == 0;
+            }
+            void await_suspend(std::coroutine_handle<> h) noexcept {
+                state.target = buffer;
+                state.waiter = h;
+            }
+            size_t await_resume() {
+                if (state.waiter == nullptr && state.got) return std::exchange(state.got, 0);
+                return state.take(buffer);
+            }
+        };
+        return Awaiter{*state, buffer};
+    }
+};
+
+namespace impl {
+
+template<class Body>
+struct EndAwaiter : nodecxx::impl::FlushWaiter {
+    HttpServerResponse& resp;
+    Body body;
+    std::coroutine_handle<> waiter;
+    bool done = false;
+    EndAwaiter(HttpServerResponse& resp, Body body)
+        : resp(resp)
+        , body(std::move(body))
+    {}
+    EndAwaiter(const EndAwaiter&) = delete;
+    // the response is ended here, once the awaiter has its final address
+    bool await_ready() {
+        resp.onFlushed(this);
+        resp.end(std::move(body));
+        // a failed send may have closed the connection and freed resp
+        if (done) return true;
+        if (resp.bufferSize() == 0) {
+            resp.onFlushed(nullptr);
+            return true;
+        }
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) noexcept { waiter = h; }
+    void await_resume() noexcept {}
+    void flushed(bool) override {
+        done = true;
+        if (waiter) waiter.resume();
+    }
+};
+
+} // namespace impl
+
+// co_await end(resp, body) ends the response and resumes once it is sent,
+// the connection closed or the next request on the connection began. resp
+// must not be used afterwards.
+template<class Body>
+impl::EndAwaiter<typename std::decay<Body>::type> end(HttpServerResponse& resp, Body&& body) {
+    return {resp, std::forward<Body>(body)};
+}
+
+} // namespace coro
+} // namespace nodecxx
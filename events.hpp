@@ -1,6 +1,7 @@
 #pragma once
 #include <vector>
 #include <type_traits>
+#include <metrics/handler_timing.hpp>
 
 namespace nodecxx {
 
@@ -28,7 +29,12 @@ protected:
     template<class T, class... Args>
     typename std::enable_if<std::is_same<T, H>::value, bool>::type fireEvent(T, Args&&... args) {
         for (auto& callback : callbacks) {
-            callback(std::forward<Args>(args)...);
+            if (__builtin_expect(metrics::impl::handlerTiming.load(std::memory_order_relaxed), 0)) {
+                metrics::impl::HandlerScope scope(typeid(T), callback.target_type());
+                callback(std::forward<Args>(args)...);
+            } else {
+                callback(std::forward<Args>(args)...);
+            }
         }
         return callbacks.size() > 0;
     }
@@ -1,5 +1,19 @@
 #include "express.hpp"
 
 namespace nodecxx {
-} // namespace nodecxx
 
+express::express()
+{
+    server.on(request, [this](IncomingMessage& req, HttpServerResponse& resp) {
+        dispatch(req, resp);
+    });
+}
+
+void express::listen(const std::string& port, const std::string& host)
+{
+    // before any loop dispatches
+    compile();
+    server.listen(port, host);
+}
+
+} // namespace nodecxx
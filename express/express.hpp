@@ -1,9 +1,14 @@
 #pragma once
 #include <http/http.hpp>
+#include "router.hpp"
 
 namespace nodecxx {
 
-class express {
+class express : public Router {
+    HttpServer server;
+public:
+    express();
+    void listen(const std::string& port, const std::string& host);
 };
 
 } // namespace nodecxx
@@ -0,0 +1,304 @@
+#include "router.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+namespace nodecxx {
+
+struct RadixTree::Node {
+    enum Kind { Static, Param, Wildcard };
+    Kind kind;
+    // the label of a static node, the parameter name otherwise
+    std::string label;
+    // first character of every static child, parallel to children
+    std::string indices;
+    std::vector<std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> param;
+    std::unique_ptr<Node> wildcard;
+    int value = -1;
+
+    Node(Kind kind, boost::string_ref label)
+        : kind(kind)
+        , label(label.begin(), label.end())
+    {}
+};
+
+namespace {
+
+using Node = RadixTree::Node;
+
+bool isNameChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+boost::string_ref parseName(boost::string_ref pattern) {
+    // pattern starts with ':' or '*'
+    size_t len = 1;
+    while (len < pattern.size() && pattern[len] != '/') {
+        if (!isNameChar(pattern[len])) {
+            throw std::invalid_argument("Invalid parameter name in route " + pattern.to_string());
+        }
+        ++len;
+    }
+    if (len == 1) {
+        throw std::invalid_argument("Unnamed parameter in route " + pattern.to_string());
+    }
+    return pattern.substr(1, len - 1);
+}
+
+Node* paramChild(std::unique_ptr<Node>& slot, Node::Kind kind, boost::string_ref name) {
+    if (!slot) {
+        slot.reset(new Node(kind, name));
+    } else if (slot->label != name) {
+        throw std::invalid_argument("Conflicting parameter names :" + slot->label + " and :" + name.to_string());
+    }
+    return slot.get();
+}
+
+Node* staticChild(Node* node, boost::string_ref& pattern) {
+    auto len = std::min(pattern.find_first_of(":*"), pattern.size());
+    auto segment = pattern.substr(0, len);
+    auto i = node->indices.find(segment[0]);
+    if (i == std::string::npos) {
+        node->indices.push_back(segment[0]);
+        node->children.emplace_back(new Node(Node::Static, segment));
+        pattern.remove_prefix(len);
+        return node->children.back().get();
+    }
+    auto& child = node->children[i];
+    auto& label = child->label;
+    size_t common = 0;
+    while (common < label.size() && common < segment.size() && label[common] == segment[common]) {
+        ++common;
+    }
+    if (common < label.size()) {
+        // split the edge: the common prefix becomes a new node that owns
+        // the old child under the remainder of its label
+        std::unique_ptr<Node> mid(new Node(Node::Static, boost::string_ref(label).substr(0, common)));
+        label.erase(0, common);
+        mid->indices.push_back(label[0]);
+        mid->children.emplace_back(std::move(child));
+        child = std::move(mid);
+    }
+    pattern.remove_prefix(common);
+    return child.get();
+}
+
+bool match(const Node* node, const char* p, const char* end, RouteParams& params, int& value) {
+    if (p == end) {
+        if (node->value >= 0) {
+            value = node->value;
+            return true;
+        }
+        if (node->wildcard && node->wildcard->value >= 0 && params.push(node->wildcard->label, boost::string_ref(p, 0))) {
+            value = node->wildcard->value;
+            return true;
+        }
+        return false;
+    }
+    auto i = node->indices.find(*p);
+    if (i != std::string::npos) {
+        const Node* child = node->children[i].get();
+        auto len = child->label.size();
+        if (size_t(end - p) >= len
+                && std::memcmp(p, child->label.data(), len) == 0
+                && match(child, p + len, end, params, value)) {
+            return true;
+        }
+    }
+    if (node->param) {
+        const char* segmentEnd = std::find(p, end, '/');
+        if (segmentEnd != p) {
+            auto mark = params.size();
+            if (params.push(node->param->label, boost::string_ref(p, segmentEnd - p))
+                    && match(node->param.get(), segmentEnd, end, params, value)) {
+                return true;
+            }
+            params.truncate(mark);
+        }
+    }
+    if (node->wildcard && node->wildcard->value >= 0 && params.push(node->wildcard->label, boost::string_ref(p, end - p))) {
+        value = node->wildcard->value;
+        return true;
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+RadixTree::RadixTree()
+    : root(new Node(Node::Static, boost::string_ref()))
+{}
+
+RadixTree::RadixTree(RadixTree&&) = default;
+RadixTree& RadixTree::operator= (RadixTree&&) = default;
+RadixTree::~RadixTree() {}
+
+void RadixTree::insert(boost::string_ref pattern, int value) {
+    const std::string full = pattern.to_string();
+    size_t numParams = 0;
+    Node* node = root.get();
+    while (!pattern.empty()) {
+        if (pattern[0] == ':') {
+            auto name = parseName(pattern);
+            node = paramChild(node->param, Node::Param, name);
+            pattern.remove_prefix(name.size() + 1);
+            ++numParams;
+        } else if (pattern[0] == '*') {
+            auto name = parseName(pattern);
+            if (name.size() + 1 != pattern.size()) {
+                throw std::invalid_argument("Wildcard must be at the end of route " + full);
+            }
+            node = paramChild(node->wildcard, Node::Wildcard, name);
+            pattern.clear();
+            ++numParams;
+        } else {
+            node = staticChild(node, pattern);
+        }
+    }
+    if (numParams > RouteParams::capacity) {
+        throw std::invalid_argument("Too many parameters in route " + full);
+    }
+    if (node->value >= 0) {
+        throw std::invalid_argument("Duplicate route " + full);
+    }
+    node->value = value;
+}
+
+int RadixTree::lookup(boost::string_ref path, RouteParams& params) const {
+    int value = -1;
+    params.clear();
+    if (!match(root.get(), path.begin(), path.end(), params, value)) {
+        params.clear();
+        return -1;
+    }
+    return value;
+}
+
+namespace {
+
+// strips the trailing slash, so "/" mounts on everything
+std::string normalizeMountPath(const std::string& mountPath) {
+    if (mountPath.find_first_of(":*") != std::string::npos) {
+        throw std::invalid_argument("Mount path must be static: " + mountPath);
+    }
+    std::string res = mountPath;
+    while (!res.empty() && res.back() == '/') {
+        res.pop_back();
+    }
+    return res;
+}
+
+bool mountMatches(boost::string_ref mountPath, boost::string_ref path) {
+    return path.starts_with(mountPath)
+        && (path.size() == mountPath.size() || path[mountPath.size()] == '/');
+}
+
+enum class MountMatch { never, always, maybe };
+
+// whether a mount path matches the paths a route pattern matches
+MountMatch mountMatchesRoute(boost::string_ref mountPath, boost::string_ref pattern) {
+    auto dynamic = pattern.find_first_of(":*");
+    if (dynamic == boost::string_ref::npos) {
+        return mountMatches(mountPath, pattern) ? MountMatch::always : MountMatch::never;
+    }
+    // the static part decides if it covers the mount path and the
+    // character after it
+    auto prefix = pattern.substr(0, dynamic);
+    if (mountPath.size() < prefix.size()) {
+        return mountMatches(mountPath, prefix) ? MountMatch::always : MountMatch::never;
+    }
+    return mountPath.starts_with(prefix) ? MountMatch::maybe : MountMatch::never;
+}
+
+void notFound(IncomingMessage& req, HttpServerResponse& resp) {
+    resp.statusCode = 404;
+    resp.setHeader("Content-Type", "text/plain");
+    resp.end("Cannot " + req.method() + ' ' + req.url());
+}
+
+} // anonymous namespace
+
+void Next::operator() () {
+    while (current != last) {
+        const auto& link = *current++;
+        const auto& layer = *link.layer;
+        if (link.checkMount && !mountMatches(layer.mountPath, mPath)) {
+            continue;
+        }
+        mMountLength = layer.mountPath.size();
+        layer.fn(*req, *resp, *this);
+        return;
+    }
+    notFound(*req, *resp);
+}
+
+Router& Router::addRoute(int method, const std::string& path, std::vector<middleware_type> handlers) {
+    auto idx = int(routes.size());
+    if (method < 0) {
+        for (auto& tree : trees) {
+            tree.insert(path, idx);
+        }
+    } else {
+        trees[method].insert(path, idx);
+    }
+    std::vector<MiddlewareLayer> routeLayers;
+    routeLayers.reserve(handlers.size());
+    for (auto& handler : handlers) {
+        routeLayers.push_back(MiddlewareLayer{std::move(handler), std::string()});
+    }
+    routes.push_back(Route{method, path, layers.size(), std::move(routeLayers)});
+    compileOnce.reset(new std::once_flag);
+    return *this;
+}
+
+Router& Router::addLayer(const std::string& mountPath, middleware_type middleware) {
+    layers.push_back(MiddlewareLayer{std::move(middleware), normalizeMountPath(mountPath)});
+    compileOnce.reset(new std::once_flag);
+    return *this;
+}
+
+void Router::compile() {
+    std::call_once(*compileOnce, [this]() { build(); });
+}
+
+void Router::build() {
+    stack.clear();
+    chains.clear();
+    for (const auto& route : routes) {
+        auto begin = uint32_t(stack.size());
+        for (size_t i = 0; i <= layers.size(); ++i) {
+            if (i == route.position) {
+                for (const auto& handler : route.handlers) {
+                    stack.push_back(ChainLink{&handler, false});
+                }
+            }
+            if (i == layers.size()) break;
+            auto match = mountMatchesRoute(layers[i].mountPath, route.path);
+            if (match != MountMatch::never) {
+                stack.push_back(ChainLink{&layers[i], match == MountMatch::maybe});
+            }
+        }
+        chains.emplace_back(begin, uint32_t(stack.size()));
+    }
+    auto begin = uint32_t(stack.size());
+    for (const auto& layer : layers) {
+        stack.push_back(ChainLink{&layer, true});
+    }
+    chains.emplace_back(begin, uint32_t(stack.size()));
+}
+
+void Router::dispatch(IncomingMessage& req, HttpServerResponse& resp) {
+    compile();
+    boost::string_ref path(req.url());
+    path = path.substr(0, path.find('?'));
+    Next next(nullptr, nullptr, req, resp, path);
+    auto idx = trees[req.methodId()].lookup(path, next.mParams);
+    const auto& chain = chains[idx < 0 ? routes.size() : size_t(idx)];
+    next.current = stack.data() + chain.first;
+    next.last = stack.data() + chain.second;
+    next();
+}
+
+} // namespace nodecxx
@@ -0,0 +1,235 @@
+#pragma once
+#include <http/http.hpp>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <type_traits>
+#include <boost/utility/string_ref.hpp>
+
+namespace nodecxx {
+
+// Number of methods known to http_parser, used to size the per-method
+// routing tables.
+#define XX(num, name, string) + 1
+constexpr size_t httpMethodCount = 0 HTTP_METHOD_MAP(XX);
+#undef XX
+
+// The parameters matched by a route. Names point into the router and
+// values are slices of IncomingMessage::url(), so nothing is copied. They
+// are valid as long as the request (and the router) are alive.
+class RouteParams {
+public:
+    static constexpr size_t capacity = 8;
+    struct Param {
+        boost::string_ref name;
+        boost::string_ref value;
+    };
+private:
+    std::array<Param, capacity> mParams;
+    size_t mSize = 0;
+public:
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    const Param* begin() const { return mParams.data(); }
+    const Param* end() const { return mParams.data() + mSize; }
+    bool get(boost::string_ref name, boost::string_ref& result) const {
+        for (size_t i = 0; i < mSize; ++i) {
+            if (mParams[i].name == name) {
+                result = mParams[i].value;
+                return true;
+            }
+        }
+        return false;
+    }
+    boost::string_ref operator[] (boost::string_ref name) const {
+        boost::string_ref res;
+        get(name, res);
+        return res;
+    }
+public: // used while matching
+    bool push(boost::string_ref name, boost::string_ref value) {
+        if (mSize == capacity) return false;
+        mParams[mSize++] = Param{name, value};
+        return true;
+    }
+    void truncate(size_t size) { mSize = size; }
+    void clear() { mSize = 0; }
+};
+
+// A compressed radix tree mapping path patterns to integer values. A
+// pattern consists of static parts, `:name` parameters, which match a
+// non-empty run of characters up to the next '/', and an optional trailing
+// `*name` wildcard, which matches the rest of the path. Static edges are
+// preferred over parameters, which are preferred over wildcards, so the
+// cost of a lookup depends on the length of the path and not on the number
+// of registered patterns.
+class RadixTree {
+public:
+    struct Node;
+private:
+    std::unique_ptr<Node> root;
+public:
+    RadixTree();
+    RadixTree(RadixTree&&);
+    RadixTree& operator= (RadixTree&&);
+    ~RadixTree();
+    // Throws std::invalid_argument on malformed or conflicting patterns
+    void insert(boost::string_ref pattern, int value);
+    // Returns the value of the matching pattern or -1
+    int lookup(boost::string_ref path, RouteParams& params) const;
+};
+
+class Next;
+
+struct MiddlewareLayer {
+    std::function<void(IncomingMessage&, HttpServerResponse&, Next&)> fn;
+    std::string mountPath;
+};
+
+// A layer in a compiled chain. Chains refer to the layers of the router,
+// every middleware exists once however many chains it is part of.
+struct ChainLink {
+    const MiddlewareLayer* layer;
+    // Whether the mount path has to be matched at dispatch time. Route
+    // chains are filtered when they are compiled, except for mounts a
+    // parameter or wildcard of the route may or may not match.
+    bool checkMount;
+};
+
+// The cursor into a compiled middleware chain that is handed to every
+// middleware. Calling it runs the next layer. It lives on the stack of the
+// dispatching thread, so a middleware that continues asynchronously has to
+// copy it into its callback.
+class Next {
+    friend class Router;
+    const ChainLink* current;
+    const ChainLink* last;
+    IncomingMessage* req;
+    HttpServerResponse* resp;
+    boost::string_ref mPath;
+    size_t mMountLength = 0;
+    RouteParams mParams;
+private:
+    Next(const ChainLink* first, const ChainLink* last,
+         IncomingMessage& req, HttpServerResponse& resp, boost::string_ref path)
+        : current(first)
+        , last(last)
+        , req(&req)
+        , resp(&resp)
+        , mPath(path)
+    {}
+public:
+    void operator() ();
+    const RouteParams& params() const { return mParams; }
+    // the request path without the query string and the mount path of the
+    // running middleware
+    boost::string_ref path() const {
+        auto res = mPath.substr(mMountLength);
+        return res.empty() ? boost::string_ref("/") : res;
+    }
+    boost::string_ref originalPath() const { return mPath; }
+};
+
+class Router {
+public:
+    using middleware_type = std::function<void(IncomingMessage&, HttpServerResponse&, Next&)>;
+private:
+    struct Route {
+        int method; // -1 for all methods
+        std::string path;
+        size_t position; // number of use() layers registered before
+        std::vector<MiddlewareLayer> handlers;
+    };
+    std::array<RadixTree, httpMethodCount> trees;
+    std::vector<MiddlewareLayer> layers;
+    std::vector<Route> routes;
+    // compiled chains, chains[routes.size()] is the chain for requests
+    // no route matches. Built once after the last registration, requests
+    // are dispatched on several loops.
+    std::unique_ptr<std::once_flag> compileOnce{new std::once_flag};
+    std::vector<ChainLink> stack;
+    std::vector<std::pair<uint32_t, uint32_t>> chains;
+private:
+    // Accepts f(req, resp, next), f(req, resp, params) and f(req, resp)
+    template<class F>
+    static middleware_type wrap(F&& f) {
+        using Fn = typename std::decay<F>::type;
+        if constexpr (std::is_invocable<Fn&, IncomingMessage&, HttpServerResponse&, Next&>::value) {
+            return middleware_type(std::forward<F>(f));
+        } else if constexpr (std::is_invocable<Fn&, IncomingMessage&, HttpServerResponse&, const RouteParams&>::value) {
+            return [f = Fn(std::forward<F>(f))](IncomingMessage& req, HttpServerResponse& resp, Next& next) mutable {
+                f(req, resp, next.params());
+            };
+        } else {
+            return [f = Fn(std::forward<F>(f))](IncomingMessage& req, HttpServerResponse& resp, Next&) mutable {
+                f(req, resp);
+            };
+        }
+    }
+    Router& addRoute(int method, const std::string& path, std::vector<middleware_type> handlers);
+    void build();
+public:
+    template<class... F>
+    Router& route(::http_method method, const std::string& path, F&&... handlers) {
+        return addRoute(method, path, {wrap(std::forward<F>(handlers))...});
+    }
+    template<class... F>
+    Router& all(const std::string& path, F&&... handlers) {
+        return addRoute(-1, path, {wrap(std::forward<F>(handlers))...});
+    }
+    template<class... F>
+    Router& get(const std::string& path, F&&... handlers) {
+        return route(HTTP_GET, path, std::forward<F>(handlers)...);
+    }
+    template<class... F>
+    Router& post(const std::string& path, F&&... handlers) {
+        return route(HTTP_POST, path, std::forward<F>(handlers)...);
+    }
+    template<class... F>
+    Router& put(const std::string& path, F&&... handlers) {
+        return route(HTTP_PUT, path, std::forward<F>(handlers)...);
+    }
+    template<class... F>
+    Router& patch(const std::string& path, F&&... handlers) {
+        return route(HTTP_PATCH, path, std::forward<F>(handlers)...);
+    }
+    template<class... F>
+    Router& del(const std::string& path, F&&... handlers) {
+        return route(HTTP_DELETE, path, std::forward<F>(handlers)...);
+    }
+    template<class... F>
+    Router& head(const std::string& path, F&&... handlers) {
+        return route(HTTP_HEAD, path, std::forward<F>(handlers)...);
+    }
+    template<class... F>
+    Router& options(const std::string& path, F&&... handlers) {
+        return route(HTTP_OPTIONS, path, std::forward<F>(handlers)...);
+    }
+    // Mounts a middleware on every path that starts with mountPath. The
+    // mount path has to be static.
+    template<class F>
+    Router& use(const std::string& mountPath, F&& middleware) {
+        return addLayer(mountPath, wrap(std::forward<F>(middleware)));
+    }
+    template<class F>
+    Router& use(F&& middleware) {
+        return addLayer("/", wrap(std::forward<F>(middleware)));
+    }
+    Router& addLayer(const std::string& mountPath, middleware_type middleware);
+public:
+    // Builds the middleware chains, once. Routes and middlewares are
+    // registered before requests are dispatched; dispatch() compiles on
+    // first use, express::listen() before the server runs.
+    void compile();
+    // Runs the middleware chain of the matching route, or the chain of
+    // mounted middlewares if there is none. Requests that fall off the end
+    // of a chain get a 404.
+    void dispatch(IncomingMessage& req, HttpServerResponse& resp);
+};
+
+} // namespace nodecxx
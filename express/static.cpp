@@ -0,0 +1,370 @@
+#include "static.hpp"
+#include <core.hpp>
+#include <loop.hpp>
+#include <ref.hpp>
+#include <fs/fs.hpp>
+#include <fs/lru_cache.hpp>
+
+#include <mutex>
+#include <ctime>
+#include <cstdio>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unordered_map>
+
+namespace nodecxx {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using fs::FileCache;
+
+struct CachedFile {
+    // Content-Type, ETag, Last-Modified and Cache-Control lines
+    std::string headers;
+    std::string contentLength;
+    std::string etag;
+    std::string lastModified;
+    // the mtime Last-Modified shows, in seconds
+    time_t modified = 0;
+    std::string body;
+    Clock::time_point loaded = Clock::now();
+    // invalidated through the file cache instead of maxStale
+    bool watched = false;
+};
+
+const char* contentType(const std::string& path) {
+    static const std::unordered_map<std::string, const char*> types = {
+        { "html", "text/html; charset=UTF-8" },
+        { "htm", "text/html; charset=UTF-8" },
+        { "css", "text/css; charset=UTF-8" },
+        { "js", "application/javascript; charset=UTF-8" },
+        { "json", "application/json; charset=UTF-8" },
+        { "txt", "text/plain; charset=UTF-8" },
+        { "xml", "application/xml" },
+        { "svg", "image/svg+xml" },
+        { "png", "image/png" },
+        { "jpg", "image/jpeg" },
+        { "jpeg", "image/jpeg" },
+        { "gif", "image/gif" },
+        { "ico", "image/x-icon" },
+        { "webp", "image/webp" },
+        { "woff", "font/woff" },
+        { "woff2", "font/woff2" },
+        { "pdf", "application/pdf" },
+        { "wasm", "application/wasm" },
+    };
+    auto dot = path.rfind('.');
+    if (dot != std::string::npos && path.find('/', dot) == std::string::npos) {
+        auto i = types.find(path.substr(dot + 1));
+        if (i != types.end()) return i->second;
+    }
+    return "application/octet-stream";
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes the request path and rejects anything that could escape root
+bool resolvePath(boost::string_ref path, std::string& result) {
+    result.clear();
+    for (size_t i = 0; i < path.size(); ++i) {
+        char c = path[i];
+        if (c == '%') {
+            if (i + 2 >= path.size()) return false;
+            int hi = hexValue(path[i + 1]);
+            int lo = hexValue(path[i + 2]);
+            if (hi < 0 || lo < 0) return false;
+            c = char(hi * 16 + lo);
+            i += 2;
+        }
+        if (c == '\0' || c == '\\') return false;
+        result.push_back(c);
+    }
+    for (size_t pos = 0; pos != std::string::npos; pos = result.find('/', pos + 1)) {
+        if (result.compare(pos, 3, "/..") == 0 && (pos + 3 == result.size() || result[pos + 3] == '/')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const std::string* findHeader(const IncomingMessage& req, const char* name) {
+    for (const auto& h : req.headers()) {
+        if (::strcasecmp(h.first.c_str(), name) == 0) return &h.second;
+    }
+    return nullptr;
+}
+
+std::string httpDate(time_t t) {
+    ::tm gtime;
+    ::gmtime_r(&t, &gtime);
+    char buf[64];
+    static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    std::snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                  days[gtime.tm_wday], gtime.tm_mday, months[gtime.tm_mon],
+                  gtime.tm_year + 1900, gtime.tm_hour, gtime.tm_min, gtime.tm_sec);
+    return buf;
+}
+
+// Parses the three date formats of RFC 7231 section 7.1.1.1
+bool parseHttpDate(const std::string& str, time_t& result) {
+    static const char* formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",  // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT",  // RFC 850
+        "%a %b %e %H:%M:%S %Y",       // asctime
+    };
+    for (auto format : formats) {
+        ::tm gtime{};
+        auto end = ::strptime(str.c_str(), format, &gtime);
+        if (end && *end == '\0') {
+            result = ::timegm(&gtime);
+            return true;
+        }
+    }
+    return false;
+}
+
+// the opaque part of an entity tag, without W/ since If-None-Match compares
+// weakly
+boost::string_ref opaqueTag(boost::string_ref tag) {
+    if (tag.starts_with("W/")) tag.remove_prefix(2);
+    return tag;
+}
+
+// Whether the If-None-Match list matches etag, "*" matches every file
+bool etagMatches(boost::string_ref list, const std::string& etag) {
+    auto own = opaqueTag(etag);
+    size_t pos = 0;
+    while (pos < list.size()) {
+        char c = list[pos];
+        if (c == ' ' || c == '\t' || c == ',') {
+            ++pos;
+            continue;
+        }
+        if (c == '*') return true;
+        size_t begin = pos;
+        if (list.substr(pos).starts_with("W/")) pos += 2;
+        if (pos >= list.size() || list[pos] != '"') return false;
+        // a quoted tag may contain commas
+        auto close = list.substr(pos + 1).find('"');
+        if (close == boost::string_ref::npos) return false;
+        pos += close + 2;
+        if (opaqueTag(list.substr(begin, pos - begin)) == own) return true;
+    }
+    return false;
+}
+
+std::string etag(const struct ::stat& st) {
+    char buf[64];
+    auto mtime = uint64_t(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+    std::snprintf(buf, sizeof(buf), "W/\"%llx-%llx\"",
+                  (unsigned long long)st.st_size, (unsigned long long)mtime);
+    return buf;
+}
+
+class StaticServer : public std::enable_shared_from_this<StaticServer> {
+    std::string root;
+    StaticOptions options;
+    std::shared_ptr<FileCache> files;
+    std::mutex mutex;
+    impl::LruCache<std::shared_ptr<CachedFile>> hotFiles;
+public:
+    StaticServer(const std::string& root, StaticOptions options)
+        : root(root)
+        , options(std::move(options))
+        , files(this->options.fileCache)
+        , hotFiles(this->options.cacheSize)
+    {
+        while (!this->root.empty() && this->root.back() == '/') {
+            this->root.pop_back();
+        }
+        if (!files) {
+            fs::FileCacheOptions cacheOptions;
+            cacheOptions.maxEntries = this->options.maxOpenFiles;
+            cacheOptions.maxUnwatchedAge = this->options.maxStale;
+            files = std::make_shared<FileCache>(cacheOptions);
+        }
+    }
+
+    // drops contents whose file changed, called after construction since
+    // the listener needs a weak reference
+    void watch() {
+        std::weak_ptr<StaticServer> weak = shared_from_this();
+        files->onInvalidate([weak](const std::string& path) {
+            auto self = weak.lock();
+            if (!self) return;
+            std::lock_guard<std::mutex> lock(self->mutex);
+            if (path.empty()) {
+                self->hotFiles.clear();
+            } else if (path.back() == '/') {
+                self->hotFiles.eraseIf([&](const std::string& key) {
+                    return key.compare(0, path.size(), path) == 0;
+                });
+            } else {
+                self->hotFiles.erase(path);
+            }
+        });
+    }
+
+    void serve(IncomingMessage& req, HttpServerResponse& resp, Next& next) {
+        if (req.methodId() != HTTP_GET && req.methodId() != HTTP_HEAD) {
+            next();
+            return;
+        }
+        std::string path;
+        if (!resolvePath(next.path(), path)) {
+            resp.statusCode = 403;
+            resp.end(std::string("Forbidden"));
+            return;
+        }
+        if (path.back() == '/') {
+            path += options.index;
+        }
+        // the key invalidations of the file cache refer to
+        path = FileCache::normalize(root + path);
+        std::shared_ptr<CachedFile> cached;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (hotFiles.get(path, cached) && !cached->watched
+                    && Clock::now() - cached->loaded > options.maxStale) {
+                hotFiles.erase(path);
+                cached.reset();
+            }
+        }
+        if (cached) {
+            sendCached(req, resp, cached);
+            return;
+        }
+        // large files are sent straight from a cached descriptor
+        auto open = files->lookup(path);
+        if (open && S_ISREG(open->st.st_mode) && size_t(open->st.st_size) > options.maxCachedFileSize) {
+            sendOpen(req, resp, open, contentType(path));
+        } else {
+            load(req, resp, next, std::move(path));
+        }
+    }
+private:
+    bool notModified(IncomingMessage& req, HttpServerResponse& resp, const CachedFile& file) {
+        // If-Modified-Since only counts without If-None-Match
+        auto ifNoneMatch = findHeader(req, "If-None-Match");
+        auto ifModifiedSince = ifNoneMatch ? nullptr : findHeader(req, "If-Modified-Since");
+        time_t since;
+        if ((ifNoneMatch && etagMatches(*ifNoneMatch, file.etag))
+                || (ifModifiedSince && parseHttpDate(*ifModifiedSince, since) && file.modified <= since)) {
+            resp.statusCode = 304;
+            resp.setHeader("Content-Length", file.contentLength);
+            resp.addRawHeaders(file.headers);
+            resp.end(std::string());
+            return true;
+        }
+        return false;
+    }
+
+    void sendCached(IncomingMessage& req, HttpServerResponse& resp, const std::shared_ptr<CachedFile>& file) {
+        if (notModified(req, resp, *file)) return;
+        resp.setHeader("Content-Length", file->contentLength);
+        resp.addRawHeaders(file->headers);
+        if (req.methodId() == HTTP_HEAD) {
+            resp.end(std::string());
+        } else {
+            // the body is not copied, the entry lives until it is sent
+            resp.end(Buffer(file->body.data(), file->body.size(), file));
+        }
+    }
+
+    void sendOpen(IncomingMessage& req, HttpServerResponse& resp, const FileCache::EntryPtr& open, const char* type) {
+        CachedFile head;
+        renderHeaders(open->st, type, head);
+        if (notModified(req, resp, head)) return;
+        resp.addRawHeaders(head.headers);
+        if (req.methodId() == HTTP_HEAD) {
+            resp.setHeader("Content-Length", head.contentLength);
+            resp.end(std::string());
+        } else {
+            resp.sendFile(open->fd, 0, open->st.st_size, open);
+        }
+    }
+
+    void renderHeaders(const struct ::stat& st, const char* type, CachedFile& file) {
+        file.etag = etag(st);
+        file.modified = st.st_mtim.tv_sec;
+        file.lastModified = httpDate(file.modified);
+        file.contentLength = std::to_string(st.st_size);
+        file.headers = std::string("Content-Type: ") + type + "\r\n"
+            + "ETag: " + file.etag + "\r\n"
+            + "Last-Modified: " + file.lastModified + "\r\n"
+            + "Cache-Control: " + options.cacheControl + "\r\n";
+    }
+
+    // Opens and stats the file through the file cache and, if it is small,
+    // reads it on the file service pool. Serves it from the loop of the
+    // connection afterwards, unless it closed meanwhile. The references
+    // keep request and response alive until then.
+    void load(IncomingMessage& req, HttpServerResponse& resp, Next& next, std::string path) {
+        auto self = shared_from_this();
+        auto cached = std::make_shared<CachedFile>();
+        auto& loop = Loop::current() ? *Loop::current() : Loop::main();
+        auto& service = boost::asio::use_service<impl::FileService>(core::service());
+        service.post([self, cached, path, &loop, req = makeRef(req), resp = makeRef(resp), next]() mutable {
+            // contents read from a file that changed meanwhile are not kept
+            auto generation = self->files->generation(path);
+            boost::system::error_code ec;
+            auto open = self->files->get(path, ec);
+            bool regular = !ec && S_ISREG(open->st.st_mode);
+            bool small = regular && size_t(open->st.st_size) <= self->options.maxCachedFileSize;
+            auto type = contentType(path);
+            if (small) {
+                self->renderHeaders(open->st, type, *cached);
+                cached->watched = open->watched;
+                cached->body.resize(open->st.st_size);
+                size_t pos = 0;
+                while (pos < cached->body.size()) {
+                    auto res = ::pread(open->fd, &cached->body[pos], cached->body.size() - pos, pos);
+                    if (res < 0 && errno == EINTR) continue;
+                    if (res < 0) ec = impl::currerror();
+                    if (res <= 0) break;
+                    pos += res;
+                }
+                cached->body.resize(pos);
+            }
+            // the references only change on the loop of the connection
+            loop.post([self, open, cached, path, req = std::move(req), resp = std::move(resp), next, ec, regular, small, type, generation]() mutable {
+                if (resp->destroyed()) return;
+                if (ec || !regular) {
+                    next();
+                    return;
+                }
+                if (small) {
+                    {
+                        std::lock_guard<std::mutex> lock(self->mutex);
+                        if (self->files->generation(path) == generation) {
+                            self->hotFiles.put(path, cached, cached->body.size() + cached->headers.size());
+                        }
+                    }
+                    self->sendCached(*req, *resp, cached);
+                } else {
+                    self->sendOpen(*req, *resp, open, type);
+                }
+            });
+        });
+    }
+};
+
+} // anonymous namespace
+
+Router::middleware_type serveStatic(const std::string& root, StaticOptions options) {
+    auto server = std::make_shared<StaticServer>(root, std::move(options));
+    server->watch();
+    return [server](IncomingMessage& req, HttpServerResponse& resp, Next& next) {
+        server->serve(req, resp, next);
+    };
+}
+
+} // namespace nodecxx
@@ -0,0 +1,33 @@
+#pragma once
+#include "router.hpp"
+#include <fs/file_cache.hpp>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace nodecxx {
+
+struct StaticOptions {
+    // files up to this size are kept in memory, larger ones are sent
+    // with sendfile
+    size_t maxCachedFileSize = 64 * 1024;
+    // total bytes of file contents kept in memory
+    size_t cacheSize = 16 * 1024 * 1024;
+    // number of open file descriptors kept, unless fileCache is set
+    size_t maxOpenFiles = 256;
+    // Cached contents and descriptors are dropped when inotify reports a
+    // change. If the directory cannot be watched they are reloaded after
+    // this time instead.
+    std::chrono::milliseconds maxStale = std::chrono::seconds(1);
+    // descriptors and stat results, shared with other users if set
+    std::shared_ptr<fs::FileCache> fileCache;
+    std::string index = "index.html";
+    std::string cacheControl = "public, max-age=0";
+};
+
+// Middleware serving the files below root, like express.static. Requests
+// for missing files are passed on to the next layer.
+Router::middleware_type serveStatic(const std::string& root, StaticOptions options = StaticOptions());
+
+} // namespace nodecxx
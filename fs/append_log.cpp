@@ -0,0 +1,191 @@
+#include "append_log.hpp"
+#include "fs.hpp"
+
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+using namespace boost::asio;
+
+namespace nodecxx {
+namespace fs {
+
+AppendLog::AppendLog() {}
+
+AppendLog::~AppendLog() {
+    close();
+}
+
+boost::system::error_code AppendLog::open(const std::string& path, AppendLogOptions options) {
+    if (fd != -1) {
+        return boost::asio::error::already_open;
+    }
+    int res;
+    do {
+        res = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, options.mode);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
+        return impl::currerror();
+    }
+    fd = res;
+    this->options = options;
+    stopping = false;
+    writer = std::thread([this]() { run(); });
+    return impl::noerror();
+}
+
+void AppendLog::close() {
+    if (!writer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_one();
+    // the writer finishes everything that is queued before it exits
+    writer.join();
+    ::close(fd);
+    fd = -1;
+}
+
+void AppendLog::append(io_service& ios, Buffer data, Callback callback) {
+    auto record = new Record;
+    record->data = std::move(data);
+    if (callback) {
+        record->callback = std::move(callback);
+        record->ios = &ios;
+        record->work.emplace(ios);
+    }
+    if (fd == -1 || stopping.load(std::memory_order_relaxed)) {
+        if (record->callback) {
+            ios.post([record]() {
+                record->callback(boost::asio::error::bad_descriptor);
+                delete record;
+            });
+        } else {
+            delete record;
+        }
+        return;
+    }
+    auto prev = head.load(std::memory_order_relaxed);
+    do {
+        record->next = prev;
+    } while (!head.compare_exchange_weak(prev, record, std::memory_order_release, std::memory_order_relaxed));
+    // the writer only sleeps on an empty list
+    if (prev == nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup.notify_one();
+    }
+}
+
+auto AppendLog::takeAll() -> Record* {
+    auto list = head.exchange(nullptr, std::memory_order_acquire);
+    Record* res = nullptr;
+    while (list) {
+        auto next = list->next;
+        list->next = res;
+        res = list;
+        list = next;
+    }
+    return res;
+}
+
+void AppendLog::run() {
+    for (;;) {
+        auto batch = takeAll();
+        if (batch == nullptr) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [this]() {
+                return head.load(std::memory_order_acquire) != nullptr || stopping;
+            });
+            if (head.load(std::memory_order_acquire) == nullptr) return;
+            continue;
+        }
+        if (options.commitWindow.count() > 0) {
+            auto deadline = std::chrono::steady_clock::now() + options.commitWindow;
+            auto tail = batch;
+            size_t bytes = tail->data.size();
+            for (;;) {
+                for (; tail->next; tail = tail->next) {
+                    bytes += tail->next->data.size();
+                }
+                if (bytes >= options.maxBatchBytes || stopping) break;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (!wakeup.wait_until(lock, deadline, [this]() {
+                        return head.load(std::memory_order_acquire) != nullptr || stopping;
+                    })) break;
+                }
+                tail->next = takeAll();
+            }
+        }
+        writeBatch(batch);
+    }
+}
+
+boost::system::error_code AppendLog::writeAll(Record* batch) {
+    ::iovec iov[IOV_MAX];
+    auto record = batch;
+    while (record) {
+        int n = 0;
+        for (; record && n < IOV_MAX; record = record->next) {
+            if (record->data.empty()) continue;
+            iov[n].iov_base = const_cast<char*>(record->data.data());
+            iov[n].iov_len = record->data.size();
+            ++n;
+        }
+        auto pos = iov;
+        while (n > 0) {
+            auto res = ::writev(fd, pos, n);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                return impl::currerror();
+            }
+            mBytesWritten.fetch_add(res, std::memory_order_relaxed);
+            // skips what got written, a short write continues mid-record
+            for (; n > 0 && size_t(res) >= pos->iov_len; ++pos, --n) {
+                res -= pos->iov_len;
+            }
+            if (n > 0) {
+                pos->iov_base = static_cast<char*>(pos->iov_base) + res;
+                pos->iov_len -= res;
+            }
+        }
+    }
+    return impl::noerror();
+}
+
+void AppendLog::writeBatch(Record* batch) {
+    auto ec = writeAll(batch);
+    if (!ec && options.sync && ::fdatasync(fd) != 0) {
+        ec = impl::currerror();
+    }
+    // one post per io_service for the whole batch
+    std::vector<std::pair<io_service*, std::vector<Record*>>> done;
+    for (auto record = batch; record; ) {
+        auto next = record->next;
+        if (!record->callback) {
+            delete record;
+        } else {
+            auto i = done.begin();
+            while (i != done.end() && i->first != record->ios) ++i;
+            if (i == done.end()) {
+                done.emplace_back(record->ios, std::vector<Record*>());
+                i = done.end() - 1;
+            }
+            i->second.push_back(record);
+        }
+        record = next;
+    }
+    for (auto& d : done) {
+        d.first->post([records = std::move(d.second), ec]() {
+            for (auto record : records) {
+                record->callback(ec);
+                delete record;
+            }
+        });
+    }
+}
+
+} // namespace fs
+} // namespace nodecxx
@@ -0,0 +1,87 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <optional>
+#include <functional>
+#include <condition_variable>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <net/buffer.hpp>
+#include <core.hpp>
+
+namespace nodecxx {
+namespace fs {
+
+struct AppendLogOptions {
+    // After the first record of a batch arrived the writer waits this long
+    // for more before it writes. Zero writes right away, records arriving
+    // while a batch is written and synced still form the next batch.
+    std::chrono::microseconds commitWindow{0};
+    // the window ends early once this much is queued
+    size_t maxBatchBytes = 4 * 1024 * 1024;
+    // fdatasync every batch before its callbacks run
+    bool sync = true;
+    ::mode_t mode = 0644;
+};
+
+// An append-only file that many threads can write records to. Records are
+// pushed onto a lock-free list and written by a thread of their own with
+// writev to the O_APPEND file, followed by one fdatasync for the whole
+// batch.
+// A record's callback runs on the io_service it was appended from, once
+// the record is durable.
+class AppendLog {
+public:
+    using Callback = std::function<void(const boost::system::error_code&)>;
+private:
+    struct Record {
+        Record* next = nullptr;
+        Buffer data;
+        Callback callback;
+        boost::asio::io_service* ios = nullptr;
+        // keeps the loop running until the callback got posted
+        std::optional<boost::asio::io_service::work> work;
+    };
+    AppendLogOptions options;
+    int fd = -1;
+    // records in reverse order of arrival
+    std::atomic<Record*> head{nullptr};
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> mBytesWritten{0};
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread writer;
+public:
+    AppendLog();
+    AppendLog(const AppendLog&) = delete;
+    AppendLog& operator= (const AppendLog&) = delete;
+    // closes the log, records appended so far are written
+    ~AppendLog();
+    boost::system::error_code open(const std::string& path, AppendLogOptions options = AppendLogOptions());
+    // Writes everything appended so far and stops the writer thread. Must
+    // not run concurrently with append().
+    void close();
+    bool is_open() const { return fd != -1; }
+    // Can be called from any thread. callback may be empty.
+    void append(boost::asio::io_service& ios, Buffer record, Callback callback);
+    void append(Buffer record, Callback callback = Callback()) {
+        append(core::currentService(), std::move(record), std::move(callback));
+    }
+    void append(std::string record, Callback callback = Callback()) {
+        append(core::currentService(), Buffer(std::move(record)), std::move(callback));
+    }
+    // bytes that made it to the file, synced or not
+    uint64_t bytesWritten() const { return mBytesWritten.load(std::memory_order_relaxed); }
+private:
+    void run();
+    // takes all queued records, oldest first
+    Record* takeAll();
+    void writeBatch(Record* batch);
+    boost::system::error_code writeAll(Record* batch);
+};
+
+} // namespace fs
+} // namespace nodecxx
@@ -0,0 +1,268 @@
+#include "file_cache.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace boost::asio;
+
+namespace nodecxx {
+namespace fs {
+
+namespace {
+
+constexpr uint32_t directoryEvents = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+std::string directoryOf(const std::string& key) {
+    auto slash = key.rfind('/');
+    if (slash == std::string::npos) return ".";
+    if (slash == 0) return "/";
+    return key.substr(0, slash);
+}
+
+std::string join(const std::string& directory, boost::string_ref name) {
+    if (directory == ".") return name.to_string();
+    std::string res = directory;
+    if (res.back() != '/') res += '/';
+    res.append(name.data(), name.size());
+    return res;
+}
+
+bool hasPrefix(const std::string& str, const std::string& prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+} // anonymous namespace
+
+FileCache::Entry::~Entry() {
+    if (fd != -1) ::close(fd);
+}
+
+FileCache::FileCache(FileCacheOptions options, io_service& ios)
+    : ios(ios)
+    , inotify(use_service<impl::InotifyService>(ios))
+    , options(options)
+    , entries(options.maxEntries)
+{}
+
+FileCache::~FileCache() {
+    for (const auto& d : directories) {
+        if (d.second.watch) inotify.removeWatch(d.second.watch);
+    }
+}
+
+std::string FileCache::normalize(const std::string& path) {
+    bool absolute = !path.empty() && path[0] == '/';
+    std::string res;
+    res.reserve(path.size());
+    size_t pos = 0;
+    while (pos < path.size()) {
+        if (path[pos] == '/') {
+            ++pos;
+            continue;
+        }
+        auto end = path.find('/', pos);
+        if (end == std::string::npos) end = path.size();
+        auto length = end - pos;
+        if (length == 2 && path[pos] == '.' && path[pos + 1] == '.') {
+            auto slash = res.rfind('/');
+            auto last = slash == std::string::npos ? 0 : slash + 1;
+            if (res.size() > last && res.compare(last, std::string::npos, "..") != 0) {
+                res.resize(slash == std::string::npos ? 0 : slash);
+            } else if (!absolute) {
+                // a relative path can go above its start
+                if (!res.empty()) res += '/';
+                res += "..";
+            }
+        } else if (length != 1 || path[pos] != '.') {
+            if (absolute || !res.empty()) res += '/';
+            res.append(path, pos, length);
+        }
+        pos = end;
+    }
+    if (res.empty()) {
+        res = absolute ? "/" : ".";
+    }
+    return res;
+}
+
+auto FileCache::find(const std::string& key) -> EntryPtr {
+    EntryPtr res;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.get(key, res) && !res->watched
+            && Clock::now() - res->loaded > options.maxUnwatchedAge) {
+        entries.erase(key);
+        res.reset();
+    }
+    return res;
+}
+
+auto FileCache::lookup(const std::string& path) -> EntryPtr {
+    auto res = find(normalize(path));
+    if (res) {
+        mHits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        mMisses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return res;
+}
+
+auto FileCache::get(const std::string& path, boost::system::error_code& ec) -> EntryPtr {
+    auto key = normalize(path);
+    if (auto res = find(key)) {
+        mHits.fetch_add(1, std::memory_order_relaxed);
+        ec = impl::noerror();
+        return res;
+    }
+    mMisses.fetch_add(1, std::memory_order_relaxed);
+    // the watch has to be in place before the file is opened, a change in
+    // between would go unnoticed otherwise
+    bool watched = watchDirectory(key);
+    uint64_t startGeneration;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        startGeneration = generationLocked(key);
+    }
+    auto res = std::make_shared<Entry>();
+    do {
+        // O_NONBLOCK, so a fifo does not block the caller
+        res->fd = ::open(key.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    } while (res->fd < 0 && errno == EINTR);
+    if (res->fd < 0 || ::fstat(res->fd, &res->st) != 0) {
+        ec = impl::currerror();
+        return nullptr;
+    }
+    res->watched = watched;
+    res->loaded = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // a change next to the file does not keep it out
+        if (generationLocked(key) == startGeneration) {
+            entries.put(key, res, 1);
+        }
+    }
+    ec = impl::noerror();
+    return res;
+}
+
+void FileCache::async_get(io_service& loop, const std::string& path, Callback callback) {
+    if (auto res = find(normalize(path))) {
+        mHits.fetch_add(1, std::memory_order_relaxed);
+        loop.post([callback = std::move(callback), res]() {
+            callback(impl::noerror(), res);
+        });
+        return;
+    }
+    io_service::work work(loop);
+    use_service<impl::FileService>(ios).post([this, work, &loop, path, callback = std::move(callback)]() {
+        boost::system::error_code ec;
+        auto res = get(path, ec);
+        loop.post([callback = std::move(callback), ec, res]() {
+            callback(ec, res);
+        });
+    });
+}
+
+uint64_t FileCache::generation(const std::string& path) {
+    auto key = normalize(path);
+    std::lock_guard<std::mutex> lock(mutex);
+    return generationLocked(key);
+}
+
+uint64_t FileCache::generationLocked(const std::string& key) {
+    // both only grow, so the sum changes with either
+    auto i = directories.find(directoryOf(key));
+    return mGeneration + (i != directories.end() ? i->second.generation : 0);
+}
+
+void FileCache::invalidate(const std::string& path) {
+    invalidateKey(normalize(path), false);
+}
+
+void FileCache::clear() {
+    invalidateKey(std::string(), true);
+}
+
+void FileCache::onInvalidate(Listener listener) {
+    std::lock_guard<std::mutex> lock(mutex);
+    listeners.push_back(std::move(listener));
+}
+
+bool FileCache::watchDirectory(const std::string& key) {
+    auto directory = directoryOf(key);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto i = directories.find(directory);
+        if (i != directories.end()) return i->second.watch != 0;
+    }
+    boost::system::error_code ec;
+    auto id = inotify.addWatch(directory, directoryEvents, [this, directory](const impl::InotifyEvent& event) {
+        onEvent(directory, event);
+    }, ec);
+    bool added;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        added = directories.emplace(directory, Directory{id, 0}).second;
+    }
+    if (!added && id) {
+        // another thread was faster
+        inotify.removeWatch(id);
+    }
+    return id != 0;
+}
+
+void FileCache::onEvent(const std::string& directory, const impl::InotifyEvent& event) {
+    if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+        // paths below the directory do not name the same files anymore,
+        // the next get watches it again
+        unsigned id = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto i = directories.find(directory);
+            if (i != directories.end()) {
+                id = i->second.watch;
+                // generations keep growing when it is watched again
+                mGeneration += i->second.generation;
+                directories.erase(i);
+            }
+        }
+        if (id) inotify.removeWatch(id);
+        invalidateKey(directory, true);
+    } else if (event.mask & IN_Q_OVERFLOW) {
+        invalidateKey(directory, true);
+    } else if (!event.name.empty()) {
+        invalidateKey(join(directory, event.name), (event.mask & IN_ISDIR) != 0);
+    }
+}
+
+void FileCache::invalidateKey(const std::string& key, bool prefix) {
+    std::vector<Listener> toCall;
+    std::string path = key;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto directory = prefix ? directories.end() : directories.find(directoryOf(key));
+        if (directory != directories.end()) {
+            ++directory->second.generation;
+        } else {
+            ++mGeneration;
+        }
+        if (!prefix) {
+            entries.erase(key);
+        } else if (key.empty() || key == ".") {
+            path.clear();
+            entries.clear();
+        } else {
+            if (path.back() != '/') path += '/';
+            entries.eraseIf([&](const std::string& k) {
+                return k == key || hasPrefix(k, path);
+            });
+        }
+        toCall = listeners;
+    }
+    for (const auto& listener : toCall) {
+        listener(path);
+    }
+}
+
+} // namespace fs
+} // namespace nodecxx
@@ -0,0 +1,113 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <core.hpp>
+#include "fs.hpp"
+#include "inotify.hpp"
+#include "lru_cache.hpp"
+
+namespace nodecxx {
+namespace fs {
+
+struct FileCacheOptions {
+    // number of open descriptors kept
+    size_t maxEntries = 1024;
+    // Entries in directories inotify cannot watch are reopened after this
+    // time. Watched entries stay until they change.
+    std::chrono::milliseconds maxUnwatchedAge = std::chrono::seconds(1);
+};
+
+// Keeps files open together with their stat results, keyed by normalized
+// path. The parent directory of every cached file is watched with inotify,
+// which also catches files that are replaced by a rename. The cache can be
+// used from all loop threads.
+class FileCache {
+public:
+    using Clock = std::chrono::steady_clock;
+    struct Entry {
+        int fd = -1;
+        struct ::stat st;
+        bool watched = false;
+        Clock::time_point loaded;
+        Entry() {}
+        Entry(const Entry&) = delete;
+        Entry& operator= (const Entry&) = delete;
+        ~Entry();
+    };
+    // the descriptor stays open while the entry is referenced, even after
+    // it got evicted
+    using EntryPtr = std::shared_ptr<const Entry>;
+    using Callback = std::function<void(const boost::system::error_code&, EntryPtr)>;
+    // gets the normalized path of an invalidated entry. A path ending in a
+    // slash stands for everything below it, an empty one for everything.
+    using Listener = std::function<void(const std::string&)>;
+private:
+    boost::asio::io_service& ios;
+    impl::InotifyService& inotify;
+    FileCacheOptions options;
+    std::mutex mutex;
+    impl::LruCache<EntryPtr> entries;
+    struct Directory {
+        // the inotify watch, 0 if the directory cannot be watched
+        unsigned watch = 0;
+        // counts the invalidations of files in the directory
+        uint64_t generation = 0;
+    };
+    std::unordered_map<std::string, Directory> directories;
+    // counts the invalidations of whole directories and of the cache
+    uint64_t mGeneration = 0;
+    std::vector<Listener> listeners;
+    std::atomic<uint64_t> mHits{0};
+    std::atomic<uint64_t> mMisses{0};
+public:
+    // inotify events are handled on ios
+    explicit FileCache(FileCacheOptions options = FileCacheOptions(), boost::asio::io_service& ios = core::service());
+    FileCache(const FileCache&) = delete;
+    FileCache& operator= (const FileCache&) = delete;
+    ~FileCache();
+    // Returns the cached entry or nullptr, never does any I/O
+    EntryPtr lookup(const std::string& path);
+    // Returns the cached entry or opens and stats the file. Blocks on a
+    // miss, meant for the FileService pool.
+    EntryPtr get(const std::string& path, boost::system::error_code& ec);
+    // get() on the FileService pool, callback runs on loop
+    void async_get(boost::asio::io_service& loop, const std::string& path, Callback callback);
+    void async_get(const std::string& path, Callback callback) {
+        async_get(core::currentService(), path, std::move(callback));
+    }
+    void invalidate(const std::string& path);
+    void clear();
+    // listener runs on the io_service of the cache, whenever entries get
+    // invalidated. Caches built on top use it to drop their own entries.
+    void onInvalidate(Listener listener);
+    // Changes whenever path, or the directory or cache around it, got
+    // invalidated. Results computed from the entry of path should only be
+    // cached if it did not change in between.
+    uint64_t generation(const std::string& path);
+    uint64_t hits() const { return mHits.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return mMisses.load(std::memory_order_relaxed); }
+    // Collapses duplicate slashes, "." and ".." without touching the file
+    // system
+    static std::string normalize(const std::string& path);
+private:
+    EntryPtr find(const std::string& key);
+    // watches the directory of key, returns false if that is not possible
+    bool watchDirectory(const std::string& key);
+    void onEvent(const std::string& directory, const impl::InotifyEvent& event);
+    // drops key, or everything below it if prefix is set
+    void invalidateKey(const std::string& key, bool prefix);
+    // generation() of a normalized path, mutex is held
+    uint64_t generationLocked(const std::string& key);
+};
+
+} // namespace fs
+} // namespace nodecxx
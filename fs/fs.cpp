@@ -1,38 +1,137 @@
 #include "fs.hpp"
 #include <core.hpp>
 
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
 using namespace boost::asio;
 
 namespace nodecxx {
 
 namespace impl {
 
+namespace {
+
+unsigned defaultPoolSize() {
+    if (auto env = std::getenv("NODECXX_THREADPOOL_SIZE")) {
+        auto res = std::atoi(env);
+        if (res > 0) return unsigned(res);
+    }
+    return 4;
+}
+
+std::atomic<unsigned>& poolSizeSetting() {
+    static std::atomic<unsigned> res(defaultPoolSize());
+    return res;
+}
+
+} // anonymous namespace
+
+int openFlags(const char* mode) {
+    int flags;
+    switch (mode[0]) {
+    case 'r':
+        flags = 0;
+        break;
+    case 'w':
+        flags = O_CREAT | O_TRUNC;
+        break;
+    case 'a':
+        flags = O_CREAT | O_APPEND;
+        break;
+    default:
+        return -1;
+    }
+    bool plus = std::strchr(mode, '+') != nullptr;
+    if (plus) {
+        flags |= O_RDWR;
+    } else {
+        flags |= mode[0] == 'r' ? O_RDONLY : O_WRONLY;
+    }
+    if (std::strchr(mode, 'x')) flags |= O_EXCL;
+    if (std::strchr(mode, 'e')) flags |= O_CLOEXEC;
+    return flags;
+}
+
 io_service::id FileService::id;
 
-FileService::~FileService() {}
+FileService::FileService(io_service& ios)
+    : io_service::service(ios)
+    , work(new io_service::work(threadPoolService))
+{
+    auto size = poolSizeSetting().load();
+    workerThreads.reserve(size);
+    for (unsigned i = 0; i < size; ++i) {
+        workerThreads.emplace_back([this](){ threadPoolService.run(); });
+    }
+}
+
+FileService::~FileService() {
+    shutdown_service();
+}
+
+void FileService::setPoolSize(unsigned size) {
+    poolSizeSetting() = size ? size : 1;
+}
 
 auto FileService::native_handle(File& file) -> native_handle_type {
     return file.native_handle();
 }
 
 boost::system::error_code FileService::open(File& file, const char* filename, const char* mode) {
-    auto res = ::fopen(filename, mode);
-    if (res) {
-        file.file = res;
-        boost::system::error_code();
+    auto flags = openFlags(mode);
+    if (flags == -1) {
+        return boost::system::error_code(EINVAL, boost::system::system_category());
     }
-    return boost::system::error_code(errno, boost::system::system_category());
+    return open(file, filename, flags, 0666);
 }
 
-boost::system::error_code FileService::close(File& file) {
-    if (::fclose(file.file)) {
+boost::system::error_code FileService::open(File& file, const char* filename, int flags, ::mode_t perms) {
+    // the descriptor would leak otherwise
+    if (file.fd != -1) {
+        return boost::asio::error::already_open;
+    }
+    int res;
+    do {
+        res = ::open(filename, flags | O_CLOEXEC, perms);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
         return currerror();
     }
-    file.file = nullptr;
+    file.fd = res;
     return noerror();
 }
 
+boost::system::error_code FileService::close(File& file) {
+    if (file.fd == -1) {
+        return noerror();
+    }
+    if (auto uring = UringService::get(file.io_service)) {
+        uring->unregisterFile(file.fd);
+    }
+    auto res = ::close(file.fd);
+    file.fd = -1;
+    // the descriptor is released even if close fails
+    return res ? currerror() : noerror();
+}
+
 void FileService::shutdown_service() {
+    work.reset();
+    threadPoolService.stop();
+    for (auto& t : workerThreads) {
+        if (t.joinable()) t.join();
+    }
+}
+
+File::File(boost::asio::io_service& service)
+    : io_service(service)
+    , service(use_service<FileService>(service))
+    , strand(this->service.threadPoolService)
+{}
+
+File::~File() {
+    if (is_open()) close();
 }
 
 } // namespace impl
@@ -1,144 +1,229 @@
 #pragma once
-#include <cstdio>
 #include <cerrno>
+#include <chrono>
 #include <thread>
-#include <tuple>
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/system/error_code.hpp>
 #include <boost/asio.hpp>
+#include "iovec.hpp"
+#include <uring/uring.hpp>
+#include <metrics/metrics.hpp>
 
 namespace nodecxx {
 namespace impl {
 
-boost::system::error_code currerror() {
+inline boost::system::error_code currerror() {
     return boost::system::error_code(errno, boost::system::system_category());
 }
 
-boost::system::error_code noerror() {
+inline boost::system::error_code noerror() {
     return boost::system::error_code();
 }
 
+// Translates an fopen(3) mode string into open(2) flags
+int openFlags(const char* mode);
+
 class File;
 
+struct FileServiceMetrics {
+    // tasks posted to the pool that did not start yet
+    metrics::Gauge queued;
+    // nanoseconds from posting a task until it started
+    metrics::Histogram wait;
+    // nanoseconds a task ran
+    metrics::Histogram duration;
+};
+
+// Runs blocking file operations on a pool of worker threads and posts the
+// completion handlers back to the io_service that owns the file. Operations
+// at an explicit offset use pread/pwrite and run in parallel, operations at
+// the current file position are serialized per file. If io_uring is enabled
+// (see UringService) operations at an explicit offset are submitted to the
+// ring of the owning io_service instead.
 class FileService : public boost::asio::io_service::service {
+    friend class File;
     boost::asio::io_service threadPoolService;
-    boost::asio::io_service::work work;
-    std::thread workerThread;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    std::vector<std::thread> workerThreads;
+    FileServiceMetrics mMetrics;
 public:
     using implementation_type = File;
-    using native_handle_type = FILE*;
+    using native_handle_type = int;
 public:
     static boost::asio::io_service::id id;
-    explicit FileService(boost::asio::io_service& ios)
-        : boost::asio::io_service::service(ios)
-        , work(threadPoolService)
-    {
-        workerThread = std::thread([this](){ threadPoolService.run(); });
-    }
+    explicit FileService(boost::asio::io_service& ios);
     virtual ~FileService();
+    // Number of worker threads of services created after this call. It
+    // defaults to $NODECXX_THREADPOOL_SIZE, or 4 if that is not set.
+    static void setPoolSize(unsigned size);
+    unsigned poolSize() const { return unsigned(workerThreads.size()); }
+    // Runs task on the worker pool
+    template<class Task>
+    void post(Task&& task) {
+        threadPoolService.post(timed(std::forward<Task>(task)));
+    }
+    const FileServiceMetrics& metrics() const { return mMetrics; }
 public: // interface
     native_handle_type native_handle(File& f);
 
     boost::system::error_code open(File& file, const char* filename, const char* mode);
+    boost::system::error_code open(File& file, const char* filename, int flags, ::mode_t perms);
 
     template<class Callback>
     void async_open(File& file, const char* filename, const char* mode, Callback&& callback);
     boost::system::error_code close(File& file);
 public: // Random Access Handle Implementation
     template<class Buffer>
-    size_t read_some_at(File& file, uint64_t offset, Buffer& buffer, boost::system::error_code& ec);
-    template<class Buffer, class RequestHandler>
-    void async_read_some_at(File& file, uint64_t offset, Buffer buffer, RequestHandler handler);
+    size_t read_some_at(File& file, uint64_t offset, const Buffer& buffer, boost::system::error_code& ec);
+    template<class Buffer, class ReadHandler>
+    void async_read_some_at(File& file, uint64_t offset, Buffer buffer, ReadHandler handler);
 
     template<class Buffer>
-    size_t write_some_at(File& file, uint64_t offset, Buffer& buffer, boost::system::error_code& ec);
-    template<class WriteHandler, class Buffer>
-    void async_write_some(File& file, uint64_t offset, Buffer buffer, WriteHandler handler);
+    size_t write_some_at(File& file, uint64_t offset, const Buffer& buffer, boost::system::error_code& ec);
+    template<class Buffer, class WriteHandler>
+    void async_write_some_at(File& file, uint64_t offset, Buffer buffer, WriteHandler handler);
 
     template<class Buffer>
-    size_t read_some(File& file, Buffer buffer, boost::system::error_code& ec);
-    template<class ReadHandler, class Buffer>
+    size_t read_some(File& file, const Buffer& buffer, boost::system::error_code& ec);
+    template<class Buffer, class ReadHandler>
     void async_read_some(File& file, Buffer buffer, ReadHandler handler);
 
     template<class Buffer>
-    size_t write_some(File& file, Buffer buffer, boost::system::error_code& ec);
-    template<class ReadHandler, class Buffer>
-    void async_write_some(File& file, Buffer buffer, ReadHandler handler);
+    size_t write_some(File& file, const Buffer& buffer, boost::system::error_code& ec);
+    template<class Buffer, class WriteHandler>
+    void async_write_some(File& file, Buffer buffer, WriteHandler handler);
 private:
     virtual void shutdown_service();
+    // wraps task to record it in the metrics
+    template<class Task>
+    auto timed(Task&& task) {
+        mMetrics.queued.add();
+        return [this, posted = std::chrono::steady_clock::now(), task = std::forward<Task>(task)]() mutable {
+            auto start = std::chrono::steady_clock::now();
+            mMetrics.queued.sub();
+            mMetrics.wait.record(std::chrono::duration_cast<std::chrono::nanoseconds>(start - posted).count());
+            task();
+            mMetrics.duration.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        };
+    }
+    // runs op on the pool, or on the strand of the file if ordered is set,
+    // and posts handler(ec, result) to the io_service of the file
+    template<class Op, class Handler>
+    void run(File& file, bool ordered, Op op, Handler handler);
 };
 
 class File {
     friend class FileService;
-    FILE* file = nullptr;
+    int fd = -1;
     boost::asio::io_service& io_service;
     FileService& service;
+    // orders the operations that use the file position
+    boost::asio::io_service::strand strand;
 public:
-    File(boost::asio::io_service& service)
-        : io_service(service)
-        , service(boost::asio::use_service<FileService>(service))
-    {}
+    File(boost::asio::io_service& service);
+    File(const File&) = delete;
+    File& operator= (const File&) = delete;
+    ~File();
     boost::asio::io_service& get_io_service() {
         return io_service;
     }
+    FileService& get_service() {
+        return service;
+    }
     bool is_open() const {
-        return file != nullptr;
+        return fd != -1;
+    }
+    boost::system::error_code close() {
+        return service.close(*this);
     }
-    boost::system::error_code close(boost::system::error_code&) {
-        int err = ::fclose(file);
-        return boost::system::error_code(errno, boost::system::system_category());
+    int native_handle() {
+        return fd;
     }
-    FILE* native_handle() {
-        return file;
+    // Registers the descriptor as an io_uring fixed file. Worth it for the
+    // few files that see most of the traffic. Returns false if io_uring is
+    // not in use or out of slots.
+    bool setFixed() {
+        auto uring = UringService::get(io_service);
+        return uring && uring->registerFile(fd);
     }
 
     boost::system::error_code open(const char* filename, const char* mode) {
         return service.open(*this, filename, mode);
     }
+    boost::system::error_code open(const char* filename, int flags, ::mode_t perms = 0666) {
+        return service.open(*this, filename, flags, perms);
+    }
 
     template<class Callback>
     void async_open(const char* filename, const char* mode, Callback&& callback);
 
 public: // Random Access Handle Implementation
+    // Buffers passed to the asynchronous functions are copied, so they have
+    // to refer to memory owned by the caller (asio buffers, iterator ranges)
     template<class Buffer>
-    size_t read_some_at(uint64_t offset, Buffer& buffer, boost::system::error_code& ec) {
-        service.read_some_at(*this, offset, buffer, ec);
+    size_t read_some_at(uint64_t offset, const Buffer& buffer, boost::system::error_code& ec) {
+        return service.read_some_at(*this, offset, buffer, ec);
     }
-    template<class Buffer, class RequestHandler>
-    void async_read_some_at(uint64_t offset, Buffer buffer, RequestHandler handler) {
-        service.async_read_some_at(*this, offset, buffer, handler);
+    template<class Buffer, class ReadHandler>
+    void async_read_some_at(uint64_t offset, Buffer buffer, ReadHandler handler) {
+        service.async_read_some_at(*this, offset, buffer, std::move(handler));
     }
 
     template<class Buffer>
-    size_t write_some_at(uint64_t offset, Buffer& buffer, boost::system::error_code& ec) {
-        service.write_some_at(*this, offset, buffer, ec);
+    size_t write_some_at(uint64_t offset, const Buffer& buffer, boost::system::error_code& ec) {
+        return service.write_some_at(*this, offset, buffer, ec);
     }
-    template<class WriteHandler, class Buffer>
-    void async_write_some(uint64_t offset, Buffer buffer, WriteHandler handler) {
-        service.async_read_some_at(*this, offset, buffer, handler);
+    template<class Buffer, class WriteHandler>
+    void async_write_some_at(uint64_t offset, Buffer buffer, WriteHandler handler) {
+        service.async_write_some_at(*this, offset, buffer, std::move(handler));
     }
 
     template<class Buffer>
-    size_t read_some(Buffer buffer, boost::system::error_code& ec) {
+    size_t read_some(const Buffer& buffer, boost::system::error_code& ec) {
         return service.read_some(*this, buffer, ec);
     }
-    template<class ReadHandler, class Buffer>
+    template<class Buffer, class ReadHandler>
     void async_read_some(Buffer buffer, ReadHandler handler) {
-        service.async_read_some(*this, buffer, handler);
+        service.async_read_some(*this, buffer, std::move(handler));
     }
 
     template<class Buffer>
-    size_t write_some(Buffer buffer, boost::system::error_code& ec) {
-        service.write_some(*this, buffer, ec);
+    size_t write_some(const Buffer& buffer, boost::system::error_code& ec) {
+        return service.write_some(*this, buffer, ec);
     }
-    template<class ReadHandler, class Buffer>
-    void async_write_some(Buffer buffer, ReadHandler handler) {
-        service.async_write_some(*this, buffer, handler);
+    template<class Buffer, class WriteHandler>
+    void async_write_some(Buffer buffer, WriteHandler handler) {
+        service.async_write_some(*this, buffer, std::move(handler));
     }
 };
 
 template<class Callback>
 void File::async_open(const char* filename, const char* mode, Callback&& callback) {
-    service.async_open(*this, filename, mode, callback);
+    service.async_open(*this, filename, mode, std::forward<Callback>(callback));
+}
+
+template<class Op, class Handler>
+void FileService::run(File& file, bool ordered, Op op, Handler handler) {
+    // keeps the loop of the file running until the handler got posted
+    boost::asio::io_service::work loopWork(file.io_service);
+    auto task = [&file, op = std::move(op), handler = std::move(handler), loopWork]() mutable {
+        boost::system::error_code ec;
+        auto res = op(ec);
+        file.io_service.post([handler = std::move(handler), ec, res]() mutable {
+            handler(ec, res);
+        });
+    };
+    if (ordered) {
+        file.strand.post(timed(std::move(task)));
+    } else {
+        threadPoolService.post(timed(std::move(task)));
+    }
 }
 
 template<class Callback>
@@ -146,96 +231,132 @@ void FileService::async_open(File& file,
     const char* filename,
     const char* mode,
     Callback&& callback) {
-    std::function<void(const boost::system::error_code&)> f(std::forward<Callback>(callback));
-    auto args = new std::tuple<std::string, std::string, std::function<void(const boost::system::error_code&)>>(std::string(filename), std::string(mode), std::move(f));
-    threadPoolService.post([this, args, &file](){
-        auto ec = open(file, std::get<0>(*args).c_str(), std::get<1>(*args).c_str());
-        std::get<2>(*args)(ec);
-        delete args;
+    run(file, true, [this, &file, filename = std::string(filename), mode = std::string(mode)](boost::system::error_code& ec) {
+        ec = open(file, filename.c_str(), mode.c_str());
+        return 0;
+    }, [callback = std::forward<Callback>(callback)](const boost::system::error_code& ec, int) mutable {
+        callback(ec);
     });
 }
 
 template<class Buffer>
-size_t FileService::read_some_at(File& file, uint64_t offset, Buffer& buffer, boost::system::error_code& ec)
+size_t FileService::read_some_at(File& file, uint64_t offset, const Buffer& buffer, boost::system::error_code& ec)
 {
-    if (::fseeko(file.file, offset, SEEK_SET)) {
+    Iovecs iov(buffer);
+    if (iov.empty()) {
+        ec = noerror();
+        return 0;
+    }
+    auto n = iov.size();
+    ssize_t res;
+    do {
+        res = n == 1 ? ::pread(file.fd, iov[0].iov_base, iov[0].iov_len, offset)
+                     : ::preadv(file.fd, iov.data(), n, offset);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
         ec = currerror();
         return 0;
     }
-    auto from = buffer.begin();
-    auto to = buffer.end();
-    auto maxSize = std::distance(from, to);
-    ec = noerror();
-    return ::fread(from, maxSize, sizeof(typename Buffer::value_type), maxSize, file.file);
+    ec = res == 0 && iov[0].iov_len ? boost::asio::error::eof : noerror();
+    return res;
 }
 
-template<class Buffer, class RequestHandler>
-void FileService::async_read_some_at(File& file, uint64_t offset, Buffer buffer, RequestHandler handler)
+template<class Buffer, class ReadHandler>
+void FileService::async_read_some_at(File& file, uint64_t offset, Buffer buffer, ReadHandler handler)
 {
-    threadPoolService.post([&file, offset, buffer, handler, this](){
-        boost::system::error_code ec;
-        auto res = read_some_at(file, offset, buffer, ec);
-        handler(ec, res);
-    });
+    if (auto uring = UringService::get(file.io_service)) {
+        uring->async_read(file.fd, offset, buffer, std::move(handler));
+        return;
+    }
+    run(file, false, [this, &file, offset, buffer](boost::system::error_code& ec) {
+        return read_some_at(file, offset, buffer, ec);
+    }, std::move(handler));
 }
 
 template<class Buffer>
-size_t FileService::write_some_at(File& file, uint64_t offset, Buffer& buffer, boost::system::error_code& ec) {
-    if (::fseek(file.file, offset, SEEK_SET)) {
-        ec = currerror();
+size_t FileService::write_some_at(File& file, uint64_t offset, const Buffer& buffer, boost::system::error_code& ec) {
+    Iovecs iov(buffer);
+    if (iov.empty()) {
+        ec = noerror();
         return 0;
     }
-    auto from = buffer.begin();
-    auto to = buffer.end();
-    auto res = std::distance(from, to);
-    if (::fwrite(from, sizeof(typename Buffer::value_type), res, file.file) != res * sizeof(typename Buffer::value_type)) {
+    auto n = iov.size();
+    ssize_t res;
+    do {
+        res = n == 1 ? ::pwrite(file.fd, iov[0].iov_base, iov[0].iov_len, offset)
+                     : ::pwritev(file.fd, iov.data(), n, offset);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
         ec = currerror();
         return 0;
     }
     ec = noerror();
-    return res * sizeof(typename Buffer::value_type);
+    return res;
 }
-template<class WriteHandler, class Buffer>
-void FileService::async_write_some(File& file, uint64_t offset, Buffer buffer, WriteHandler handler) {
-    threadPoolService.post([this, &file, offset, buffer, handler]() {
-        boost::system::error_code ec;
-        auto res = write_some_at(file, offset, buffer, ec);
-        handler(ec, res);
-    });
+
+template<class Buffer, class WriteHandler>
+void FileService::async_write_some_at(File& file, uint64_t offset, Buffer buffer, WriteHandler handler) {
+    if (auto uring = UringService::get(file.io_service)) {
+        uring->async_write(file.fd, offset, buffer, std::move(handler));
+        return;
+    }
+    run(file, false, [this, &file, offset, buffer](boost::system::error_code& ec) {
+        return write_some_at(file, offset, buffer, ec);
+    }, std::move(handler));
 }
 
 template<class Buffer>
-size_t FileService::read_some(File& file, Buffer buffer, boost::system::error_code& ec) {
-    auto res = ::fread(buffer.begin(), sizeof(typename Buffer::value_type), std::distance(buffer.begin(), buffer.end()), file.file);
-    if (res == 0) {
+size_t FileService::read_some(File& file, const Buffer& buffer, boost::system::error_code& ec) {
+    Iovecs iov(buffer);
+    if (iov.empty()) {
+        ec = noerror();
+        return 0;
+    }
+    auto n = iov.size();
+    ssize_t res;
+    do {
+        res = ::readv(file.fd, iov.data(), n);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
         ec = currerror();
+        return 0;
     }
+    ec = res == 0 && iov[0].iov_len ? boost::asio::error::eof : noerror();
     return res;
 }
-template<class ReadHandler, class Buffer>
+
+template<class Buffer, class ReadHandler>
 void FileService::async_read_some(File& file, Buffer buffer, ReadHandler handler) {
-    threadPoolService.post([this, &file, buffer, handler](){
-        boost::system::error_code ec;
-        auto res = read_some(file, buffer, ec);
-        handler(ec, res);
-    });
+    run(file, true, [this, &file, buffer](boost::system::error_code& ec) {
+        return read_some(file, buffer, ec);
+    }, std::move(handler));
 }
 
 template<class Buffer>
-size_t FileService::write_some(File& file, Buffer buffer, boost::system::error_code& ec) {
-    auto res = ::fwrite(buffer.begin(), sizeof(typename Buffer::value_type), std::distance(buffer.begin(), buffer.end()), file.file);
-    if (res == 0) {
+size_t FileService::write_some(File& file, const Buffer& buffer, boost::system::error_code& ec) {
+    Iovecs iov(buffer);
+    if (iov.empty()) {
+        ec = noerror();
+        return 0;
+    }
+    auto n = iov.size();
+    ssize_t res;
+    do {
+        res = ::writev(file.fd, iov.data(), n);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
         ec = currerror();
+        return 0;
     }
+    ec = noerror();
     return res;
 }
-template<class ReadHandler, class Buffer>
-void FileService::async_write_some(File& file, Buffer buffer, ReadHandler handler) {
-    threadPoolService.post([this, &file, buffer, handler](){
-        boost::system::error_code ec;
-        auto res = write_some(file, buffer, ec);
-        handler(ec, res);
-    });
+
+template<class Buffer, class WriteHandler>
+void FileService::async_write_some(File& file, Buffer buffer, WriteHandler handler) {
+    run(file, true, [this, &file, buffer](boost::system::error_code& ec) {
+        return write_some(file, buffer, ec);
+    }, std::move(handler));
 }
 
 } // namespace impl
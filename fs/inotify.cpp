@@ -0,0 +1,171 @@
+#include "inotify.hpp"
+
+#include <cstring>
+#include <unistd.h>
+
+using namespace boost::asio;
+
+namespace nodecxx {
+namespace impl {
+
+io_service::id InotifyService::id;
+
+InotifyService::InotifyService(io_service& ios)
+    : io_service::service(ios)
+    , loop(ios)
+    , descriptor(ios)
+    // room for many events, a single one takes up to
+    // sizeof(inotify_event) + NAME_MAX + 1 bytes
+    , buffer(64 * 1024)
+{
+    fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd != -1) {
+        descriptor.assign(fd);
+    }
+}
+
+InotifyService::~InotifyService() {
+    shutdown_service();
+}
+
+void InotifyService::shutdown_service() {
+    std::lock_guard<std::mutex> lock(mutex);
+    watches.clear();
+    listenerWatches.clear();
+    boost::system::error_code ec;
+    // closes fd
+    descriptor.close(ec);
+    fd = -1;
+}
+
+unsigned InotifyService::addWatch(const std::string& path, uint32_t mask, Listener listener, boost::system::error_code& ec) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd == -1) {
+        ec = boost::system::error_code(ENOSYS, boost::system::system_category());
+        return 0;
+    }
+    // IN_MASK_ADD keeps the events other listeners of the path asked for
+    int wd = ::inotify_add_watch(fd, path.c_str(), mask | IN_MASK_ADD);
+    if (wd == -1) {
+        ec = boost::system::error_code(errno, boost::system::system_category());
+        return 0;
+    }
+    ec = boost::system::error_code();
+    auto& watch = watches[wd];
+    if (watch.path.empty()) {
+        watch.path = path;
+    }
+    auto id = nextId++;
+    watch.listeners.emplace_back(id, std::move(listener));
+    listenerWatches.emplace(id, wd);
+    if (!reading) {
+        reading = true;
+        loop.post([this]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (watches.empty()) {
+                reading = false;
+                return;
+            }
+            read();
+        });
+    }
+    return id;
+}
+
+void InotifyService::removeWatch(unsigned id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto i = listenerWatches.find(id);
+    if (i == listenerWatches.end()) return;
+    auto wd = i->second;
+    listenerWatches.erase(i);
+    auto w = watches.find(wd);
+    if (w == watches.end()) return;
+    auto& listeners = w->second.listeners;
+    for (auto l = listeners.begin(); l != listeners.end(); ++l) {
+        if (l->first == id) {
+            listeners.erase(l);
+            break;
+        }
+    }
+    if (listeners.empty()) {
+        ::inotify_rm_watch(fd, wd);
+        watches.erase(w);
+    }
+    if (watches.empty() && reading) {
+        boost::system::error_code ec;
+        descriptor.cancel(ec);
+    }
+}
+
+void InotifyService::read() {
+    descriptor.async_read_some(boost::asio::buffer(buffer), [this](const boost::system::error_code& ec, size_t bytes) {
+        onRead(ec, bytes);
+    });
+}
+
+void InotifyService::onRead(const boost::system::error_code& ec, size_t bytes) {
+    if (!ec) {
+        size_t pos = 0;
+        while (pos + sizeof(::inotify_event) <= bytes) {
+            ::inotify_event event;
+            std::memcpy(&event, &buffer[pos], sizeof(event));
+            auto name = &buffer[pos + sizeof(event)];
+            // the name is padded with nul bytes
+            auto nameLength = ::strnlen(name, event.len);
+            pos += sizeof(event) + event.len;
+            if (event.mask & IN_Q_OVERFLOW) {
+                std::vector<int> all;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (const auto& w : watches) all.push_back(w.first);
+                }
+                for (auto wd : all) {
+                    dispatch(wd, InotifyEvent{ IN_Q_OVERFLOW, 0, std::string(), boost::string_ref() });
+                }
+                continue;
+            }
+            dispatch(event.wd, InotifyEvent{ event.mask, event.cookie, std::string(), boost::string_ref(name, nameLength) });
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ec == error::operation_aborted || ec == error::bad_descriptor || watches.empty()) {
+        reading = false;
+        // a watch added after the cancel
+        if (!watches.empty() && fd != -1) {
+            reading = true;
+            read();
+        }
+        return;
+    }
+    read();
+}
+
+void InotifyService::dispatch(int wd, const InotifyEvent& event) {
+    std::string path;
+    std::vector<Listener> listeners;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto w = watches.find(wd);
+        if (w == watches.end()) return;
+        path = w->second.path;
+        listeners.reserve(w->second.listeners.size());
+        for (const auto& l : w->second.listeners) {
+            listeners.push_back(l.second);
+        }
+        if (event.mask & IN_IGNORED) {
+            // the kernel dropped the watch, the path got deleted or its
+            // file system unmounted
+            for (const auto& l : w->second.listeners) {
+                listenerWatches.erase(l.first);
+            }
+            watches.erase(w);
+        }
+    }
+    InotifyEvent res{ event.mask, event.cookie, path, event.name };
+    for (const auto& listener : listeners) {
+        listener(res);
+    }
+}
+
+} // namespace impl
+} // namespace nodecxx
@@ -0,0 +1,70 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <sys/inotify.h>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/utility/string_ref.hpp>
+
+namespace nodecxx {
+namespace impl {
+
+struct InotifyEvent {
+    // IN_* bits. IN_Q_OVERFLOW goes to every listener, events got lost
+    // and anything watched may have changed.
+    uint32_t mask;
+    // pairs IN_MOVED_FROM with IN_MOVED_TO
+    uint32_t cookie;
+    // the watched path
+    const std::string& path;
+    // the entry within a watched directory, empty for events on the
+    // watched path itself
+    boost::string_ref name;
+};
+
+// One inotify descriptor per io_service, read through the reactor. Several
+// listeners can watch the same path, the kernel watch is shared and goes
+// away with the last listener. Listeners run on the io_service.
+class InotifyService : public boost::asio::io_service::service {
+public:
+    using Listener = std::function<void(const InotifyEvent&)>;
+private:
+    struct Watch {
+        std::string path;
+        std::vector<std::pair<unsigned, Listener>> listeners;
+    };
+    boost::asio::io_service& loop;
+    int fd = -1;
+    boost::asio::posix::stream_descriptor descriptor;
+    std::vector<char> buffer;
+    std::mutex mutex;
+    std::unordered_map<int, Watch> watches;
+    // listener id -> watch descriptor
+    std::unordered_map<unsigned, int> listenerWatches;
+    unsigned nextId = 1;
+    // a read is pending, only while something is watched so the loop can
+    // run out of work
+    bool reading = false;
+public:
+    static boost::asio::io_service::id id;
+    explicit InotifyService(boost::asio::io_service& ios);
+    virtual ~InotifyService();
+    bool available() const { return fd != -1; }
+    // Watches path for the IN_* events in mask and returns an id for
+    // removeWatch, or 0 and sets ec. Thread safe.
+    unsigned addWatch(const std::string& path, uint32_t mask, Listener listener, boost::system::error_code& ec);
+    void removeWatch(unsigned id);
+private:
+    virtual void shutdown_service();
+    // starts the next read, mutex is held
+    void read();
+    void onRead(const boost::system::error_code& ec, size_t bytes);
+    void dispatch(int wd, const InotifyEvent& event);
+};
+
+} // namespace impl
+} // namespace nodecxx
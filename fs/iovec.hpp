@@ -0,0 +1,65 @@
+#pragma once
+#include <limits.h>
+#include <iterator>
+#include <memory>
+#include <sys/uio.h>
+#include <boost/asio/buffer.hpp>
+
+namespace nodecxx {
+namespace impl {
+
+// Fills iov from either an asio buffer sequence or a contiguous container
+// (anything with begin() and end(), like std::vector<char> or a
+// boost::iterator_range). Returns the number of entries used.
+template<class Buffer>
+size_t fillIovec(const Buffer& buffer, ::iovec* iov, size_t max) {
+    if constexpr (boost::asio::is_const_buffer_sequence<Buffer>::value) {
+        size_t n = 0;
+        auto end = boost::asio::buffer_sequence_end(buffer);
+        for (auto i = boost::asio::buffer_sequence_begin(buffer); i != end && n < max; ++i) {
+            boost::asio::const_buffer b(*i);
+            iov[n].iov_base = const_cast<void*>(b.data());
+            iov[n].iov_len = b.size();
+            ++n;
+        }
+        return n;
+    } else {
+        auto size = std::distance(buffer.begin(), buffer.end());
+        iov[0].iov_base = size ? const_cast<void*>(static_cast<const void*>(&*buffer.begin())) : nullptr;
+        iov[0].iov_len = size * sizeof(*buffer.begin());
+        return 1;
+    }
+}
+
+// The iovecs of a buffer, sized to its number of buffers (at most IOV_MAX).
+// The usual few live in the object itself, more go to the heap.
+class Iovecs {
+    static constexpr size_t inlineCount = 8;
+    ::iovec inlined[inlineCount];
+    std::unique_ptr<::iovec[]> allocated;
+    ::iovec* iov = inlined;
+    size_t n = 0;
+public:
+    template<class Buffer>
+    explicit Iovecs(const Buffer& buffer) {
+        size_t count = 1;
+        if constexpr (boost::asio::is_const_buffer_sequence<Buffer>::value) {
+            count = std::distance(boost::asio::buffer_sequence_begin(buffer), boost::asio::buffer_sequence_end(buffer));
+            if (count > IOV_MAX) count = IOV_MAX;
+        }
+        if (count > inlineCount) {
+            allocated.reset(new ::iovec[count]);
+            iov = allocated.get();
+        }
+        n = fillIovec(buffer, iov, count);
+    }
+    Iovecs(const Iovecs&) = delete;
+    Iovecs& operator= (const Iovecs&) = delete;
+    ::iovec* data() { return iov; }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    ::iovec& operator[](size_t i) { return iov[i]; }
+};
+
+} // namespace impl
+} // namespace nodecxx
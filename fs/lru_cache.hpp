@@ -0,0 +1,71 @@
+#pragma once
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace nodecxx {
+namespace impl {
+
+// A least recently used cache, bounded by the sum of the cost of its
+// entries. Not synchronized.
+template<class V>
+class LruCache {
+    using List = std::list<std::string>;
+    struct Entry {
+        V value;
+        size_t cost;
+        List::iterator pos;
+    };
+    size_t capacity;
+    size_t used = 0;
+    List order;
+    std::unordered_map<std::string, Entry> entries;
+public:
+    explicit LruCache(size_t capacity) : capacity(capacity) {}
+    bool get(const std::string& key, V& result) {
+        auto i = entries.find(key);
+        if (i == entries.end()) return false;
+        order.splice(order.begin(), order, i->second.pos);
+        result = i->second.value;
+        return true;
+    }
+    void put(const std::string& key, V value, size_t cost) {
+        erase(key);
+        if (cost > capacity) return;
+        while (used + cost > capacity) {
+            erase(std::string(order.back()));
+        }
+        order.push_front(key);
+        entries.emplace(key, Entry{std::move(value), cost, order.begin()});
+        used += cost;
+    }
+    void erase(const std::string& key) {
+        auto i = entries.find(key);
+        if (i == entries.end()) return;
+        used -= i->second.cost;
+        order.erase(i->second.pos);
+        entries.erase(i);
+    }
+    // erases the entries whose key matches pred
+    template<class Pred>
+    void eraseIf(Pred pred) {
+        for (auto i = entries.begin(); i != entries.end(); ) {
+            if (pred(i->first)) {
+                used -= i->second.cost;
+                order.erase(i->second.pos);
+                i = entries.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+    void clear() {
+        entries.clear();
+        order.clear();
+        used = 0;
+    }
+    size_t size() const { return entries.size(); }
+};
+
+} // namespace impl
+} // namespace nodecxx
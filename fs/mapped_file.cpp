@@ -0,0 +1,119 @@
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace nodecxx {
+
+struct MappedFile::Mapping {
+    void* addr = nullptr;
+    size_t length = 0;
+
+    ~Mapping() {
+        if (addr) ::munmap(addr, length);
+    }
+};
+
+namespace {
+
+int adviceFlag(MapAdvice advice) {
+    switch (advice) {
+    case MapAdvice::Sequential:
+        return MADV_SEQUENTIAL;
+    case MapAdvice::Random:
+        return MADV_RANDOM;
+    case MapAdvice::WillNeed:
+        return MADV_WILLNEED;
+    case MapAdvice::DontNeed:
+        return MADV_DONTNEED;
+    default:
+        return MADV_NORMAL;
+    }
+}
+
+} // anonymous namespace
+
+MappedFile::MappedFile() {}
+
+MappedFile::~MappedFile() {}
+
+boost::system::error_code MappedFile::map(const char* filename, const Options& options)
+{
+    int fd;
+    do {
+        fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) return impl::currerror();
+    struct ::stat st;
+    if (::fstat(fd, &st) != 0) {
+        auto ec = impl::currerror();
+        ::close(fd);
+        return ec;
+    }
+    auto res = std::make_shared<Mapping>();
+    if (st.st_size > 0) {
+        int flags = MAP_SHARED;
+        if (options.populate) flags |= MAP_POPULATE;
+        auto addr = ::mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+        if (addr == MAP_FAILED) {
+            auto ec = impl::currerror();
+            ::close(fd);
+            return ec;
+        }
+        res->addr = addr;
+        res->length = st.st_size;
+    }
+    // the mapping stays valid without the descriptor
+    ::close(fd);
+    if (res->addr) {
+        if (options.hugePages) {
+            ::madvise(res->addr, res->length, MADV_HUGEPAGE);
+        }
+        if (options.advice != MapAdvice::Normal) {
+            ::madvise(res->addr, res->length, adviceFlag(options.advice));
+        }
+    }
+    mapping = std::move(res);
+    return impl::noerror();
+}
+
+void MappedFile::unmap()
+{
+    // slices that are still queued keep the memory mapped
+    mapping.reset();
+}
+
+boost::system::error_code MappedFile::advise(Advice advice, size_t offset, size_t length)
+{
+    if (!mapping || !mapping->addr) return impl::noerror();
+    // clamped like slice(), nothing to advise past the end
+    if (offset >= mapping->length) return impl::noerror();
+    // madvise wants a page aligned start
+    static const size_t pageSize = size_t(::sysconf(_SC_PAGESIZE));
+    auto begin = offset - offset % pageSize;
+    if (length > mapping->length - offset) length = mapping->length - offset;
+    auto addr = static_cast<char*>(mapping->addr) + begin;
+    if (::madvise(addr, length + (offset - begin), adviceFlag(advice)) != 0) {
+        return impl::currerror();
+    }
+    return impl::noerror();
+}
+
+const char* MappedFile::data() const
+{
+    return mapping ? static_cast<const char*>(mapping->addr) : nullptr;
+}
+
+size_t MappedFile::size() const
+{
+    return mapping ? mapping->length : 0;
+}
+
+Buffer MappedFile::slice(size_t offset, size_t length) const
+{
+    return Buffer(data(), size(), mapping).slice(offset, length);
+}
+
+} // namespace nodecxx
@@ -0,0 +1,70 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <net/buffer.hpp>
+#include "fs.hpp"
+
+namespace nodecxx {
+
+// madvise(2) hints
+enum class MapAdvice { Normal, Sequential, Random, WillNeed, DontNeed };
+
+struct MappedFileOptions {
+    // fault in all pages while mapping instead of on first access
+    bool populate = false;
+    // ask for transparent huge pages (best effort)
+    bool hugePages = false;
+    MapAdvice advice = MapAdvice::Normal;
+};
+
+// A read-only memory mapping of a whole file. Slices of it can be written
+// to sockets without copying, each slice keeps the mapping alive.
+class MappedFile {
+public:
+    using Advice = MapAdvice;
+    using Options = MappedFileOptions;
+private:
+    struct Mapping;
+    std::shared_ptr<const Mapping> mapping;
+public:
+    MappedFile();
+    MappedFile(const MappedFile&) = default;
+    MappedFile(MappedFile&&) = default;
+    MappedFile& operator= (const MappedFile&) = default;
+    MappedFile& operator= (MappedFile&&) = default;
+    ~MappedFile();
+    // Maps filename, replacing the current mapping
+    boost::system::error_code map(const char* filename, const MappedFileOptions& options = MappedFileOptions());
+    // Maps filename on the FileService pool (mapping a large file with
+    // populate blocks until it is read) and calls callback(ec, file) on ios.
+    // The result is handed over, nothing refers to the caller meanwhile.
+    template<class Callback>
+    static void async_map(boost::asio::io_service& ios, const std::string& filename, const Options& options, Callback&& callback);
+    void unmap();
+    boost::system::error_code advise(Advice advice, size_t offset = 0, size_t length = std::string::npos);
+public: // access
+    bool is_mapped() const { return mapping != nullptr; }
+    const char* data() const;
+    size_t size() const;
+    boost::string_ref view() const { return boost::string_ref(data(), size()); }
+    // length bytes from offset on, the buffer shares ownership of the mapping
+    Buffer slice(size_t offset = 0, size_t length = std::string::npos) const;
+};
+
+template<class Callback>
+void MappedFile::async_map(boost::asio::io_service& ios, const std::string& filename, const Options& options, Callback&& callback)
+{
+    boost::asio::io_service::work work(ios);
+    auto& service = boost::asio::use_service<impl::FileService>(ios);
+    service.post([&ios, work, filename, options, callback = std::forward<Callback>(callback)]() mutable {
+        MappedFile result;
+        auto ec = result.map(filename.c_str(), options);
+        ios.post([ec, result = std::move(result), callback = std::move(callback)]() mutable {
+            callback(ec, std::move(result));
+        });
+    });
+}
+
+} // namespace nodecxx
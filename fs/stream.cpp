@@ -0,0 +1,392 @@
+#include "stream.hpp"
+#include <http/http.hpp>
+
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace boost::asio;
+
+namespace nodecxx {
+namespace fs {
+
+ReadStream::ReadStream(io_service& ios, std::string path, ReadStreamOptions options)
+    : file(ios)
+    , path(std::move(path))
+    , options(std::move(options))
+    , position(this->options.start)
+    , remaining(this->options.length)
+{
+    if (this->options.highWaterMark == 0) {
+        this->options.highWaterMark = 1;
+    }
+}
+
+void ReadStream::open()
+{
+    opening = true;
+    auto self = shared_from_this();
+    // opening and stat'ing may block, both run on the pool
+    io_service::work work(file.get_io_service());
+    file.get_service().post([self, work]() {
+        auto ec = self->file.open(self->path.c_str(), O_RDONLY);
+        struct ::stat st;
+        std::memset(&st, 0, sizeof(st));
+        if (!ec && ::fstat(self->file.native_handle(), &st) != 0) {
+            ec = impl::currerror();
+        }
+        if (!ec && self->options.sequential) {
+            auto length = self->options.length;
+            ::posix_fadvise(self->file.native_handle(), off_t(self->options.start),
+                            length > uint64_t(std::numeric_limits<off_t>::max()) ? 0 : off_t(length),
+                            POSIX_FADV_SEQUENTIAL);
+        }
+        self->file.get_io_service().post([self, ec, st]() {
+            self->onOpen(ec, st);
+        });
+    });
+}
+
+void ReadStream::onOpen(const boost::system::error_code& ec, const struct ::stat& st)
+{
+    opening = false;
+    if (destroyed) {
+        closeFile();
+        return;
+    }
+    if (ec) {
+        fail(ec);
+        return;
+    }
+    isOpen = true;
+    if (S_ISREG(st.st_mode)) {
+        uint64_t size = st.st_size;
+        remaining = position >= size ? 0 : std::min(remaining, size - position);
+        lengthKnown = true;
+    }
+    fireEvent(ready);
+    read();
+    maybeEnd();
+}
+
+void ReadStream::pause()
+{
+    paused = true;
+}
+
+void ReadStream::resume()
+{
+    paused = false;
+    if (destroyed) return;
+    if (hasPending) {
+        auto chunk = std::move(pending);
+        pending = Buffer();
+        hasPending = false;
+        read();
+        emit(chunk);
+    } else {
+        read();
+    }
+    maybeEnd();
+}
+
+void ReadStream::destroy()
+{
+    if (destroyed) return;
+    destroyed = true;
+    pending = Buffer();
+    hasPending = false;
+    // an operation in flight still uses the descriptor, its completion
+    // closes the file
+    if (!opening && !reading) {
+        closeFile();
+    }
+}
+
+void ReadStream::read()
+{
+    if (destroyed || !isOpen || reading || hasPending || eof) return;
+    if (remaining == 0) {
+        eof = true;
+        return;
+    }
+    auto chunk = takeChunk();
+    auto size = size_t(std::min<uint64_t>(options.highWaterMark, remaining));
+    reading = true;
+    auto self = shared_from_this();
+    file.async_read_some_at(position, buffer(chunk->data(), size),
+            [self, chunk](const boost::system::error_code& ec, size_t bytes) {
+        self->onRead(chunk, ec, bytes);
+    });
+}
+
+void ReadStream::onRead(std::shared_ptr<Chunk> chunk, const boost::system::error_code& ec, size_t bytes)
+{
+    reading = false;
+    if (destroyed) {
+        closeFile();
+        return;
+    }
+    if (ec == boost::asio::error::eof) {
+        eof = true;
+    } else if (ec) {
+        fail(ec);
+        return;
+    } else {
+        position += bytes;
+        remaining -= bytes;
+        mBytesRead += bytes;
+        auto bytesData = chunk->data();
+        Buffer result(bytesData, bytes, std::move(chunk));
+        if (paused) {
+            pending = std::move(result);
+            hasPending = true;
+            return;
+        }
+        // the next chunk is read while this one is consumed
+        read();
+        emit(result);
+    }
+    maybeEnd();
+}
+
+void ReadStream::emit(const Buffer& chunk)
+{
+    fireEvent(data, chunk.data(), chunk.size());
+    if (!destroyed && sink) {
+        sink(chunk);
+    }
+}
+
+void ReadStream::maybeEnd()
+{
+    if (destroyed || !eof || reading || hasPending || paused) return;
+    fireEvent(::nodecxx::end);
+    destroy();
+}
+
+void ReadStream::fail(const boost::system::error_code& ec)
+{
+    if (destroyed) return;
+    failed = true;
+    fireEvent(error, ec);
+    destroy();
+}
+
+void ReadStream::closeFile()
+{
+    if (file.is_open()) {
+        file.close();
+    }
+    if (!closeFired) {
+        closeFired = true;
+        fireEvent(close, failed);
+    }
+    if (pipeRef) {
+        // the caller may still use the stream
+        file.get_io_service().post([ref = std::move(pipeRef)]() {});
+    }
+}
+
+auto ReadStream::takeChunk() -> std::shared_ptr<Chunk>
+{
+    // a chunk is free again once no Buffer refers to it anymore
+    for (const auto& chunk : chunks) {
+        if (chunk.use_count() == 1) return chunk;
+    }
+    auto res = std::make_shared<Chunk>(options.highWaterMark);
+    if (chunks.size() < maxSpareChunks) {
+        chunks.push_back(res);
+    }
+    return res;
+}
+
+void ReadStream::checkLoop(io_service& dest)
+{
+    // the references to dest are only counted on its loop
+    if (&dest != &file.get_io_service()) {
+        throw std::invalid_argument("ReadStream::pipe: the destination belongs to another loop than " + path);
+    }
+}
+
+void ReadStream::pipe(HttpServerResponse& resp, bool endDestination)
+{
+    checkLoop(resp.service());
+    auto setLength = [this, resp = makeRef(resp)]() {
+        if (lengthKnown && !resp->headersSent()) {
+            resp->setHeader("Content-Length", std::to_string(length()));
+        }
+    };
+    if (isOpen) {
+        setLength();
+    } else {
+        on(ready, setLength);
+    }
+    pipe<HttpServerResponse>(resp, endDestination);
+}
+
+WriteStream::WriteStream(io_service& ios, std::string path, WriteStreamOptions options)
+    : file(ios)
+    , path(std::move(path))
+    , options(std::move(options))
+    , position(this->options.start)
+{}
+
+void WriteStream::open()
+{
+    opening = true;
+    auto self = shared_from_this();
+    io_service::work work(file.get_io_service());
+    file.get_service().post([self, work]() {
+        auto ec = self->file.open(self->path.c_str(), self->options.flags, self->options.mode);
+        self->file.get_io_service().post([self, ec]() {
+            self->onOpen(ec);
+        });
+    });
+}
+
+void WriteStream::onOpen(const boost::system::error_code& ec)
+{
+    opening = false;
+    if (destroyed) {
+        closeFile();
+        return;
+    }
+    if (ec) {
+        fail(ec);
+        return;
+    }
+    isOpen = true;
+    fireEvent(ready);
+    flush();
+}
+
+bool WriteStream::write(Buffer data)
+{
+    if (destroyed || ending) return false;
+    queued += data.size();
+    if (!data.empty()) {
+        queue.push_back(std::move(data));
+    }
+    flush();
+    if (queued >= options.highWaterMark) {
+        needDrain = true;
+        return false;
+    }
+    return true;
+}
+
+void WriteStream::end()
+{
+    if (destroyed || ending) return;
+    ending = true;
+    flush();
+}
+
+void WriteStream::end(Buffer data)
+{
+    write(std::move(data));
+    end();
+}
+
+void WriteStream::destroy()
+{
+    if (destroyed) return;
+    destroyed = true;
+    queue.clear();
+    queued = 0;
+    if (!opening && !writing) {
+        closeFile();
+    }
+}
+
+void WriteStream::flush()
+{
+    if (destroyed || !isOpen || writing) return;
+    if (queue.empty()) {
+        if (ending) {
+            fireEvent(finish);
+            destroy();
+        }
+        return;
+    }
+    // everything queued so far goes out with one pwritev
+    std::vector<const_buffer> buffers;
+    buffers.reserve(std::min(queue.size(), maxGather));
+    for (const auto& b : queue) {
+        if (buffers.size() == maxGather) break;
+        buffers.emplace_back(b.data(), b.size());
+    }
+    writing = true;
+    auto self = shared_from_this();
+    file.async_write_some_at(position, std::move(buffers), [self](const boost::system::error_code& ec, size_t bytes) {
+        self->onWrite(ec, bytes);
+    });
+}
+
+void WriteStream::onWrite(const boost::system::error_code& ec, size_t bytes)
+{
+    writing = false;
+    if (destroyed) {
+        closeFile();
+        return;
+    }
+    if (ec) {
+        fail(ec);
+        return;
+    }
+    position += bytes;
+    mBytesWritten += bytes;
+    queued -= bytes;
+    while (bytes > 0) {
+        auto& front = queue.front();
+        if (bytes < front.size()) {
+            front = front.slice(bytes);
+            break;
+        }
+        bytes -= front.size();
+        queue.pop_front();
+    }
+    if (needDrain && queue.empty()) {
+        needDrain = false;
+        fireEvent(drain);
+    }
+    flush();
+}
+
+void WriteStream::fail(const boost::system::error_code& ec)
+{
+    if (destroyed) return;
+    failed = true;
+    fireEvent(error, ec);
+    destroy();
+}
+
+void WriteStream::closeFile()
+{
+    if (file.is_open()) {
+        file.close();
+    }
+    if (!closeFired) {
+        closeFired = true;
+        fireEvent(close, failed);
+    }
+}
+
+std::shared_ptr<ReadStream> createReadStream(io_service& ios, std::string path, ReadStreamOptions options)
+{
+    auto res = std::make_shared<ReadStream>(ios, std::move(path), std::move(options));
+    res->open();
+    return res;
+}
+
+std::shared_ptr<WriteStream> createWriteStream(io_service& ios, std::string path, WriteStreamOptions options)
+{
+    auto res = std::make_shared<WriteStream>(ios, std::move(path), std::move(options));
+    res->open();
+    return res;
+}
+
+} // namespace fs
+} // namespace nodecxx
@@ -0,0 +1,229 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <boost/asio.hpp>
+#include <events.hpp>
+#include <ref.hpp>
+#include <core.hpp>
+#include <net/events.hpp>
+#include <net/buffer.hpp>
+#include "fs.hpp"
+
+namespace nodecxx {
+
+class HttpServerResponse;
+
+namespace fs {
+
+// the file of a stream got opened
+struct ready_t {
+    using function_type = std::function<void()>;
+    constexpr ready_t() {}
+};
+
+constexpr ready_t ready;
+
+struct ReadStreamOptions {
+    // size of the chunks read from the file, also the amount a piped
+    // destination may buffer before the stream pauses
+    size_t highWaterMark = 64 * 1024;
+    uint64_t start = 0;
+    // number of bytes to read, everything up to the end by default
+    uint64_t length = uint64_t(-1);
+    // tell the kernel to read ahead aggressively
+    bool sequential = true;
+};
+
+// Reads a file in chunks of highWaterMark bytes. While one chunk is handed
+// to the data listeners the next one is already being read. Emission
+// starts as soon as the file is open, unless the stream got paused.
+class ReadStream
+    : public EmittingEvents<ready_t, data_t, end_t, error_t, close_t>
+    , public std::enable_shared_from_this<ReadStream>
+{
+    using Chunk = std::vector<char>;
+    // chunks kept around for reuse
+    static constexpr size_t maxSpareChunks = 4;
+    impl::File file;
+    std::string path;
+    ReadStreamOptions options;
+    uint64_t position;
+    uint64_t remaining;
+    uint64_t mBytesRead = 0;
+    bool lengthKnown = false;
+    bool opening = false;
+    bool isOpen = false;
+    bool reading = false;
+    bool paused = false;
+    bool eof = false;
+    bool destroyed = false;
+    bool failed = false;
+    bool closeFired = false;
+    // a chunk that got read while the stream was paused
+    Buffer pending;
+    bool hasPending = false;
+    std::vector<std::shared_ptr<Chunk>> chunks;
+    // the destination of pipe(), gets the chunks without a copy
+    std::function<void(const Buffer&)> sink;
+    // a piping stream keeps itself alive until it is closed
+    std::shared_ptr<ReadStream> pipeRef;
+public:
+    ReadStream(boost::asio::io_service& ios, std::string path, ReadStreamOptions options);
+    // opens the file, called by createReadStream
+    void open();
+    void pause();
+    void resume();
+    bool isPaused() const { return paused; }
+    // Stops reading and closes the file. No events but close fire anymore.
+    void destroy();
+    uint64_t bytesRead() const { return mBytesRead; }
+    // Number of bytes the stream produces in total. Known once the stream is
+    // ready, unless the file is not a regular file.
+    bool hasLength() const { return lengthKnown; }
+    uint64_t length() const { return remaining + mBytesRead; }
+    // Writes all data to dest and pauses while more than highWaterMark bytes
+    // wait to be sent, until dest signals drain. dest gets ended after the
+    // last chunk if endDestination is set. dest can be a Socket, a
+    // WriteStream or anything else with the same interface. A stream has
+    // one destination. A Socket or a response is held by a Ref and has to
+    // belong to the loop of the stream, std::invalid_argument otherwise.
+    template<class Destination>
+    void pipe(Destination& dest, bool endDestination = true);
+    // Also sets the Content-Length of the response, if its head was not
+    // sent yet
+    void pipe(HttpServerResponse& resp, bool endDestination = true);
+private:
+    // throws unless dest belongs to the io_service of the stream
+    void checkLoop(boost::asio::io_service& dest);
+    void onOpen(const boost::system::error_code& ec, const struct ::stat& st);
+    void read();
+    void onRead(std::shared_ptr<Chunk> chunk, const boost::system::error_code& ec, size_t bytes);
+    void emit(const Buffer& chunk);
+    void maybeEnd();
+    void fail(const boost::system::error_code& ec);
+    void closeFile();
+    std::shared_ptr<Chunk> takeChunk();
+};
+
+struct WriteStreamOptions {
+    // write() returns false while more than this is waiting to be written
+    size_t highWaterMark = 64 * 1024;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    ::mode_t mode = 0666;
+    // the file offset of the first byte written
+    uint64_t start = 0;
+};
+
+// Writes to a file in the background. Buffers written while a write is in
+// flight are collected and go out with a single pwritev.
+class WriteStream
+    : public EmittingEvents<ready_t, drain_t, finish_t, error_t, close_t>
+    , public std::enable_shared_from_this<WriteStream>
+{
+    static constexpr size_t maxGather = 64;
+    impl::File file;
+    std::string path;
+    WriteStreamOptions options;
+    uint64_t position;
+    uint64_t mBytesWritten = 0;
+    std::deque<Buffer> queue;
+    size_t queued = 0;
+    bool opening = false;
+    bool isOpen = false;
+    bool writing = false;
+    bool ending = false;
+    bool needDrain = false;
+    bool destroyed = false;
+    bool failed = false;
+    bool closeFired = false;
+public:
+    WriteStream(boost::asio::io_service& ios, std::string path, WriteStreamOptions options);
+    // opens the file, called by createWriteStream
+    void open();
+    // Queues data and returns false if the caller should wait for drain
+    // before it writes more
+    bool write(Buffer data);
+    bool write(std::string data) {
+        return write(Buffer(std::move(data)));
+    }
+    // finish fires once everything is written
+    void end();
+    void end(Buffer data);
+    void destroy();
+    size_t bufferSize() const { return queued; }
+    uint64_t bytesWritten() const { return mBytesWritten; }
+private:
+    void onOpen(const boost::system::error_code& ec);
+    void flush();
+    void onWrite(const boost::system::error_code& ec, size_t bytes);
+    void fail(const boost::system::error_code& ec);
+    void closeFile();
+};
+
+std::shared_ptr<ReadStream> createReadStream(boost::asio::io_service& ios, std::string path,
+                                             ReadStreamOptions options = ReadStreamOptions());
+std::shared_ptr<WriteStream> createWriteStream(boost::asio::io_service& ios, std::string path,
+                                               WriteStreamOptions options = WriteStreamOptions());
+
+inline std::shared_ptr<ReadStream> createReadStream(std::string path, ReadStreamOptions options = ReadStreamOptions()) {
+    return createReadStream(core::currentService(), std::move(path), std::move(options));
+}
+
+inline std::shared_ptr<WriteStream> createWriteStream(std::string path, WriteStreamOptions options = WriteStreamOptions()) {
+    return createWriteStream(core::currentService(), std::move(path), std::move(options));
+}
+
+template<class Destination>
+void ReadStream::pipe(Destination& dest, bool endDestination)
+{
+    if constexpr (IsRefCountable<Destination>::value) {
+        checkLoop(dest.service());
+    }
+    // dest may outlive the stream and the other way round, the stream
+    // stops writing once dest is closed
+    std::weak_ptr<ReadStream> weak = shared_from_this();
+    pipeRef = shared_from_this();
+    // streams as destinations are kept alive by shared_ptr, sockets and
+    // responses by a Ref, a read that completes after dest closed still
+    // finds it
+    auto target = [&dest]() {
+        if constexpr (std::is_base_of<std::enable_shared_from_this<Destination>, Destination>::value) {
+            return dest.shared_from_this();
+        } else if constexpr (IsRefCountable<Destination>::value) {
+            return Ref<Destination>(&dest);
+        } else {
+            return &dest;
+        }
+    }();
+    sink = [this, target](const Buffer& chunk) {
+        target->write(chunk);
+        // a failed write may have closed dest already
+        if (!destroyed && target->bufferSize() > options.highWaterMark) {
+            pause();
+        }
+    };
+    dest.on(drain, [weak]() {
+        if (auto self = weak.lock()) self->resume();
+    });
+    dest.on(close, [weak](bool) {
+        if (auto self = weak.lock()) self->destroy();
+    });
+    on(error, [target](const boost::system::error_code&) {
+        // what got sent so far is incomplete
+        target->destroy();
+    });
+    if (endDestination) {
+        on(::nodecxx::end, [target]() {
+            target->end(Buffer());
+        });
+    }
+    resume();
+}
+
+} // namespace fs
+} // namespace nodecxx
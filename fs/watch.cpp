@@ -0,0 +1,198 @@
+#include "watch.hpp"
+#include "fs.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace boost::asio;
+
+namespace nodecxx {
+namespace fs {
+
+namespace {
+
+constexpr uint32_t watchEvents = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+std::string join(const std::string& dir, boost::string_ref name) {
+    std::string res = dir;
+    if (res.empty() || res.back() != '/') res += '/';
+    res.append(name.data(), name.size());
+    return res;
+}
+
+bool isDirectory(const std::string& dir, const ::dirent* entry) {
+    if (entry->d_type != DT_UNKNOWN) return entry->d_type == DT_DIR;
+    // some file systems do not fill in d_type
+    struct ::stat st;
+    return ::lstat(join(dir, entry->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+} // anonymous namespace
+
+Watcher::Watcher(io_service& ios, std::string root, WatchCallback callback, WatchOptions options)
+    : inotify(use_service<impl::InotifyService>(ios))
+    , root(std::move(root))
+    , callback(std::move(callback))
+    , options(options)
+    , timer(ios)
+{
+    while (this->root.size() > 1 && this->root.back() == '/') {
+        this->root.pop_back();
+    }
+}
+
+Watcher::~Watcher() {
+    close();
+}
+
+boost::system::error_code Watcher::start() {
+    auto ec = addWatch(root);
+    if (ec) return ec;
+    struct ::stat st;
+    if (options.recursive && ::stat(root.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        addTree(root, false);
+    }
+    return impl::noerror();
+}
+
+void Watcher::close() {
+    if (closed) return;
+    closed = true;
+    for (const auto& w : watches) {
+        inotify.removeWatch(w.second);
+    }
+    watches.clear();
+    pending.clear();
+    boost::system::error_code ec;
+    timer.cancel(ec);
+}
+
+boost::system::error_code Watcher::addWatch(const std::string& path) {
+    if (watches.count(path)) return impl::noerror();
+    std::weak_ptr<Watcher> weak = shared_from_this();
+    boost::system::error_code ec;
+    auto id = inotify.addWatch(path, watchEvents, [weak, path](const impl::InotifyEvent& event) {
+        if (auto self = weak.lock()) self->onEvent(path, event);
+    }, ec);
+    if (!ec) {
+        watches.emplace(path, id);
+    }
+    return ec;
+}
+
+void Watcher::addTree(const std::string& dir, bool report) {
+    // the watch goes first, so nothing created during the walk is missed
+    if (dir != root && addWatch(dir)) return;
+    auto d = ::opendir(dir.c_str());
+    if (d == nullptr) return;
+    std::vector<std::string> subdirs;
+    while (auto entry = ::readdir(d)) {
+        if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0) continue;
+        auto path = join(dir, entry->d_name);
+        if (report) {
+            record(path, WatchChange::Rename);
+        }
+        if (isDirectory(dir, entry)) {
+            subdirs.push_back(std::move(path));
+        }
+    }
+    ::closedir(d);
+    for (const auto& subdir : subdirs) {
+        addTree(subdir, report);
+    }
+}
+
+void Watcher::removeTree(const std::string& dir) {
+    auto prefix = dir + '/';
+    for (auto i = watches.begin(); i != watches.end(); ) {
+        if (i->first == dir || i->first.compare(0, prefix.size(), prefix) == 0) {
+            inotify.removeWatch(i->second);
+            i = watches.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void Watcher::onEvent(const std::string& dir, const impl::InotifyEvent& event) {
+    if (closed) return;
+    if (event.mask & IN_Q_OVERFLOW) {
+        // anything may have changed
+        record(root, WatchChange::Rename);
+        return;
+    }
+    auto kind = event.mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+        ? WatchChange::Rename : WatchChange::Change;
+    if (event.name.empty()) {
+        if (event.mask & IN_IGNORED) {
+            // the kernel removed the watch
+            watches.erase(dir);
+            return;
+        }
+        if (event.mask & IN_MOVE_SELF) {
+            // the watch follows the directory to a path we do not know
+            removeTree(dir);
+        }
+        // DELETE_SELF is reported by the parent directory as well, unless
+        // dir is the root
+        if (dir == root || !(event.mask & IN_DELETE_SELF)) {
+            record(dir, kind);
+        }
+        return;
+    }
+    auto path = join(dir, event.name);
+    record(path, kind);
+    if (options.recursive && (event.mask & IN_ISDIR)) {
+        if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+            // files may have been created before the watch was in place
+            addTree(path, true);
+        } else if (event.mask & IN_MOVED_FROM) {
+            removeTree(path);
+        }
+    }
+}
+
+void Watcher::record(std::string path, WatchChange::Kind kind) {
+    auto now = Clock::now();
+    if (pending.empty()) {
+        firstPending = now;
+    }
+    auto res = pending.emplace(std::move(path), kind);
+    if (!res.second && kind == WatchChange::Rename) {
+        // a rename is the stronger signal
+        res.first->second = kind;
+    }
+    // every change pushes the report back, up to maxDelay
+    auto deadline = std::min(now + options.debounce, firstPending + options.maxDelay);
+    timer.expires_at(deadline);
+    std::weak_ptr<Watcher> weak = shared_from_this();
+    timer.async_wait([weak](const boost::system::error_code& ec) {
+        if (ec == error::operation_aborted) return;
+        if (auto self = weak.lock()) self->flush();
+    });
+}
+
+void Watcher::flush() {
+    if (closed || pending.empty()) return;
+    std::vector<WatchChange> changes;
+    changes.reserve(pending.size());
+    for (auto& p : pending) {
+        changes.push_back(WatchChange{ p.first, p.second });
+    }
+    pending.clear();
+    callback(changes);
+}
+
+std::shared_ptr<Watcher> watch(io_service& ios, const std::string& path, WatchCallback callback,
+                               boost::system::error_code& ec, WatchOptions options) {
+    auto res = std::make_shared<Watcher>(ios, path, std::move(callback), std::move(options));
+    ec = res->start();
+    if (ec) return nullptr;
+    return res;
+}
+
+} // namespace fs
+} // namespace nodecxx
@@ -0,0 +1,81 @@
+#pragma once
+#include <map>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <core.hpp>
+#include "inotify.hpp"
+
+namespace nodecxx {
+namespace fs {
+
+struct WatchChange {
+    // like node: Rename if the path got created, deleted or moved,
+    // Change if its contents or attributes changed
+    enum Kind { Change, Rename };
+    std::string path;
+    Kind kind;
+};
+
+using WatchCallback = std::function<void(const std::vector<WatchChange>&)>;
+
+struct WatchOptions {
+    // watch the directories below path too, including ones created later
+    bool recursive = true;
+    // changes are reported once nothing happened for this long...
+    std::chrono::milliseconds debounce{50};
+    // ...or this long after the first unreported change at the latest
+    std::chrono::milliseconds maxDelay{1000};
+};
+
+// Reports changes below a path in batches. Every path shows up once per
+// batch, sorted, so a burst of saves to a file results in one callback.
+class Watcher : public std::enable_shared_from_this<Watcher> {
+    using Clock = std::chrono::steady_clock;
+    impl::InotifyService& inotify;
+    std::string root;
+    WatchCallback callback;
+    WatchOptions options;
+    // watched directory -> listener id
+    std::unordered_map<std::string, unsigned> watches;
+    std::map<std::string, WatchChange::Kind> pending;
+    Clock::time_point firstPending;
+    boost::asio::steady_timer timer;
+    bool closed = false;
+public:
+    Watcher(boost::asio::io_service& ios, std::string root, WatchCallback callback, WatchOptions options);
+    ~Watcher();
+    // Watches root (and its subdirectories), called by watch()
+    boost::system::error_code start();
+    // No callbacks run after close. Dropping the last reference closes too.
+    void close();
+    const std::string& path() const { return root; }
+private:
+    boost::system::error_code addWatch(const std::string& path);
+    // watches dir and the directories below it, the entries found are
+    // reported as renamed if report is set
+    void addTree(const std::string& dir, bool report);
+    void removeTree(const std::string& dir);
+    void onEvent(const std::string& dir, const impl::InotifyEvent& event);
+    void record(std::string path, WatchChange::Kind kind);
+    void flush();
+};
+
+// Watches path, a file or a directory, and calls callback on ios with the
+// changes. The initial directory walk of a recursive watch runs on the
+// calling thread. Returns nullptr and sets ec if path cannot be watched.
+std::shared_ptr<Watcher> watch(boost::asio::io_service& ios, const std::string& path, WatchCallback callback,
+                               boost::system::error_code& ec, WatchOptions options = WatchOptions());
+
+inline std::shared_ptr<Watcher> watch(const std::string& path, WatchCallback callback,
+                                      boost::system::error_code& ec, WatchOptions options = WatchOptions()) {
+    return watch(core::currentService(), path, std::move(callback), ec, std::move(options));
+}
+
+} // namespace fs
+} // namespace nodecxx
@@ -0,0 +1,216 @@
+#include "whole_file.hpp"
+
+#include <unistd.h>
+
+using namespace boost::asio;
+
+namespace nodecxx {
+
+namespace {
+
+// reads above this size do not hold up the rest of their batch
+constexpr size_t batchedReadLimit = 256 * 1024;
+// growth step for files whose size is not known upfront (pipes, /proc)
+constexpr size_t unknownSizeChunk = 64 * 1024;
+
+int openPath(const std::string& path, int flags, ::mode_t mode, boost::system::error_code& ec) {
+    int fd;
+    do {
+        fd = ::open(path.c_str(), flags | O_CLOEXEC, mode);
+    } while (fd < 0 && errno == EINTR);
+    ec = fd < 0 ? impl::currerror() : impl::noerror();
+    return fd;
+}
+
+bool statFile(int fd, struct ::stat& st, boost::system::error_code& ec) {
+    if (::fstat(fd, &st) != 0) {
+        ec = impl::currerror();
+        return false;
+    }
+    return true;
+}
+
+// Reads from fd until eof. If st describes a regular file the result is
+// sized once from st_size.
+std::string readAll(int fd, const struct ::stat& st, boost::system::error_code& ec) {
+    std::string res;
+    bool sized = S_ISREG(st.st_mode) && st.st_size > 0;
+    res.resize(sized ? size_t(st.st_size) : unknownSizeChunk);
+    size_t pos = 0;
+    for (;;) {
+        if (pos == res.size()) {
+            // the size is exact for regular files, anything else grows
+            if (sized) break;
+            res.resize(res.size() * 2);
+        }
+        auto n = ::pread(fd, &res[pos], res.size() - pos, pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ec = impl::currerror();
+            res.clear();
+            return res;
+        }
+        if (n == 0) break;
+        pos += size_t(n);
+    }
+    res.resize(pos);
+    ec = impl::noerror();
+    return res;
+}
+
+boost::system::error_code writeAll(int fd, boost::string_ref data) {
+    while (!data.empty()) {
+        auto n = ::write(fd, data.data(), data.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return impl::currerror();
+        }
+        data.remove_prefix(size_t(n));
+    }
+    return impl::noerror();
+}
+
+void closeFile(int fd, boost::system::error_code& ec) {
+    if (::close(fd) != 0 && !ec) {
+        ec = impl::currerror();
+    }
+}
+
+} // anonymous namespace
+
+namespace fs {
+
+std::string readFileSync(const std::string& path, boost::system::error_code& ec) {
+    auto fd = openPath(path, O_RDONLY, 0, ec);
+    if (fd < 0) return std::string();
+    struct ::stat st;
+    std::string res;
+    if (statFile(fd, st, ec)) {
+        res = readAll(fd, st, ec);
+    }
+    ::close(fd);
+    return res;
+}
+
+boost::system::error_code writeFileSync(const std::string& path, boost::string_ref data, int flags, ::mode_t mode) {
+    boost::system::error_code ec;
+    auto fd = openPath(path, flags, mode, ec);
+    if (fd < 0) return ec;
+    ec = writeAll(fd, data);
+    closeFile(fd, ec);
+    return ec;
+}
+
+void readFile(io_service& ios, std::string path, ReadFileCallback callback) {
+    auto request = std::make_shared<impl::WholeFileService::Request>();
+    request->path = std::move(path);
+    request->onRead = std::move(callback);
+    use_service<impl::WholeFileService>(ios).submit(std::move(request));
+}
+
+void writeFile(io_service& ios, std::string path, Buffer data, WriteFileCallback callback, int flags, ::mode_t mode) {
+    auto request = std::make_shared<impl::WholeFileService::Request>();
+    request->isWrite = true;
+    request->path = std::move(path);
+    request->data = std::move(data);
+    request->flags = flags;
+    request->mode = mode;
+    request->onWrite = std::move(callback);
+    use_service<impl::WholeFileService>(ios).submit(std::move(request));
+}
+
+} // namespace fs
+
+namespace impl {
+
+io_service::id WholeFileService::id;
+
+WholeFileService::WholeFileService(io_service& ios)
+    : io_service::service(ios)
+    , loop(ios)
+    , files(use_service<FileService>(ios))
+{}
+
+void WholeFileService::shutdown_service() {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.clear();
+}
+
+void WholeFileService::submit(std::shared_ptr<Request> request) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(request));
+        if (scheduled) return;
+        scheduled = true;
+    }
+    // the loop must not run out of work before the callbacks are posted
+    io_service::work work(loop);
+    files.post([this, work]() { runBatch(); });
+}
+
+void WholeFileService::runBatch() {
+    std::vector<std::shared_ptr<Request>> batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch.swap(pending);
+        scheduled = false;
+    }
+    std::vector<std::shared_ptr<Request>> done;
+    done.reserve(batch.size());
+    for (auto& request : batch) {
+        if (request->isWrite) {
+            auto fd = openPath(request->path, request->flags, request->mode, request->ec);
+            if (fd >= 0) {
+                request->ec = writeAll(fd, request->data.view());
+                closeFile(fd, request->ec);
+            }
+            // release the data before the callback is posted
+            request->data = Buffer();
+            done.push_back(std::move(request));
+            continue;
+        }
+        auto fd = openPath(request->path, O_RDONLY, 0, request->ec);
+        struct ::stat st;
+        if (fd >= 0 && !statFile(fd, st, request->ec)) {
+            ::close(fd);
+            fd = -1;
+        }
+        if (fd >= 0 && S_ISREG(st.st_mode) && size_t(st.st_size) > batchedReadLimit) {
+            runAlone(std::move(request), fd, st);
+            continue;
+        }
+        if (fd >= 0) {
+            request->result = readAll(fd, st, request->ec);
+            ::close(fd);
+        }
+        done.push_back(std::move(request));
+    }
+    if (!done.empty()) {
+        complete(std::move(done));
+    }
+}
+
+void WholeFileService::runAlone(std::shared_ptr<Request> request, int fd, struct ::stat st) {
+    io_service::work work(loop);
+    files.post([this, work, request, fd, st]() {
+        request->result = readAll(fd, st, request->ec);
+        ::close(fd);
+        complete({ request });
+    });
+}
+
+void WholeFileService::complete(std::vector<std::shared_ptr<Request>> done) {
+    loop.post([done = std::move(done)]() {
+        for (auto& request : done) {
+            if (request->isWrite) {
+                request->onWrite(request->ec);
+            } else {
+                request->onRead(request->ec, std::move(request->result));
+            }
+        }
+    });
+}
+
+} // namespace impl
+
+} // namespace nodecxx
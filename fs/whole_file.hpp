@@ -0,0 +1,88 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <net/buffer.hpp>
+#include <core.hpp>
+#include "fs.hpp"
+
+namespace nodecxx {
+namespace fs {
+
+using ReadFileCallback = std::function<void(const boost::system::error_code&, std::string)>;
+using WriteFileCallback = std::function<void(const boost::system::error_code&)>;
+
+constexpr int defaultWriteFlags = O_WRONLY | O_CREAT | O_TRUNC;
+
+// Reads the whole file. Regular files are stat'ed first and the result is
+// allocated once and filled with as few preads as possible.
+std::string readFileSync(const std::string& path, boost::system::error_code& ec);
+boost::system::error_code writeFileSync(const std::string& path, boost::string_ref data,
+                                        int flags = defaultWriteFlags, ::mode_t mode = 0666);
+
+// The asynchronous versions run on the FileService pool and call back on
+// ios. Small reads that are issued while an earlier one still waits for a
+// worker are handled by the same worker task and complete together.
+void readFile(boost::asio::io_service& ios, std::string path, ReadFileCallback callback);
+void writeFile(boost::asio::io_service& ios, std::string path, Buffer data, WriteFileCallback callback,
+               int flags = defaultWriteFlags, ::mode_t mode = 0666);
+
+inline void readFile(std::string path, ReadFileCallback callback) {
+    readFile(core::currentService(), std::move(path), std::move(callback));
+}
+
+inline void writeFile(std::string path, Buffer data, WriteFileCallback callback) {
+    writeFile(core::currentService(), std::move(path), std::move(data), std::move(callback));
+}
+
+inline void writeFile(std::string path, std::string data, WriteFileCallback callback) {
+    writeFile(core::currentService(), std::move(path), Buffer(std::move(data)), std::move(callback));
+}
+
+} // namespace fs
+
+namespace impl {
+
+// Queues the whole-file operations of one io_service. The first queued
+// operation posts a task to the pool, everything queued until a worker picks
+// that task up is done by it and the callbacks are posted back in one go.
+class WholeFileService : public boost::asio::io_service::service {
+public:
+    struct Request {
+        bool isWrite = false;
+        std::string path;
+        Buffer data;
+        int flags = 0;
+        ::mode_t mode = 0;
+        fs::ReadFileCallback onRead;
+        fs::WriteFileCallback onWrite;
+        boost::system::error_code ec;
+        std::string result;
+    };
+private:
+    boost::asio::io_service& loop;
+    FileService& files;
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Request>> pending;
+    bool scheduled = false;
+public:
+    static boost::asio::io_service::id id;
+    explicit WholeFileService(boost::asio::io_service& ios);
+    void submit(std::shared_ptr<Request> request);
+private:
+    virtual void shutdown_service();
+    void runBatch();
+    // continues a large read in a task of its own
+    void runAlone(std::shared_ptr<Request> request, int fd, struct ::stat st);
+    void complete(std::vector<std::shared_ptr<Request>> done);
+};
+
+} // namespace impl
+} // namespace nodecxx
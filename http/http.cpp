@@ -1,8 +1,13 @@
 #include <core.hpp>
+#include <fs/fs.hpp>
+#include <metrics/loop_monitor.hpp>
+#include <trace/trace.hpp>
+#include <worker/worker.hpp>
 #include "http.hpp"
 
 #include <chrono>
 #include <iomanip>
+#include <utility>
 
 using namespace boost::asio;
 using namespace boost::system;
@@ -14,7 +19,7 @@ namespace {
 // and is hidden from the user.
 
 void getHttpDate(std::ostream& os) {
-    os.imbue(std::locale("en_US.UTF-8"));
+    os.imbue(std::locale::classic());
     std::chrono::system_clock::now();
     auto t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
     ::tm gtime;
@@ -105,22 +110,77 @@ const char* defaultStatusMessage(int statusCode) {
 
 class IncomingMessageImpl : public IncomingMessage {
     ::http_parser parser;
-    ::http_parser_settings parserSettings;
+    ::http_parser_settings parserSettings{};
     std::string mCurrHeader;
     std::string mCurrValue;
     bool inHeaderValueState = false;
     bool onMessageCompleteCalled = false;
+    // Set while a complete request waits for its response. Pipelined
+    // requests are kept in pendingInput meanwhile, parsing them would
+    // reuse this object and the response under the running handler. The
+    // socket does not read meanwhile, so it holds one read at most.
+    bool paused = false;
+    std::string pendingInput;
+    // the end of a draining connection is queued, input is dropped
+    bool ending = false;
 public:
     IncomingMessageImpl(Socket<boost::asio::ip::tcp>& socket,
                         HttpServer& server);
 private:
+    void execute(const char* d, size_t s) {
+        auto parsed = ::http_parser_execute(&parser, &parserSettings, d, s);
+        if (HTTP_PARSER_ERRNO(&parser) == HPE_PAUSED) {
+            pendingInput.append(d + parsed, s - parsed);
+            return;
+        }
+        if (HTTP_PARSER_ERRNO(&parser) != HPE_OK) {
+            // the parser cannot recover, neither can the connection
+            server.metrics().parseErrors.add();
+            socket.close();
+            return;
+        }
+        if (onMessageCompleteCalled && parser.upgrade == 1) {
+            handleUpgrade(parser, std::string(d, s));
+        }
+    }
+    void resume() {
+        paused = false;
+        if (ending || socket.destroyed()) return;
+        ::http_parser_pause(&parser, 0);
+        auto input = std::move(pendingInput);
+        pendingInput.clear();
+        if (!input.empty()) execute(input.data(), input.size());
+        // the input may hold the next request still waiting for its response
+        if (!paused) socket.resume();
+    }
+    void responseFinished() override {
+        closeIfDrained();
+        if (!paused || ending) return;
+        // not from within end(), which may run inside the handler
+        boost::asio::post(socket.service(), [self = Ref<IncomingMessageImpl>(this)]() {
+            self->resume();
+        });
+    }
 public:
+    void closeIfDrained() override {
+        // upgraded connections are not HTTP anymore, they are closed at
+        // the deadline
+        bool idle = mRequests == 0 || onMessageCompleteCalled;
+        if (!draining || ending || !idle || responsePending() || parser.upgrade) return;
+        ending = true;
+        pendingInput.clear();
+        // after the response, which may have ended the socket already
+        socket.end(std::string());
+    }
     void parseRequest() {
         socket.on(data, [this](const char* d, size_t s) {
-            ::http_parser_execute(&parser, &parserSettings, d, s);
-            if (onMessageCompleteCalled && parser.upgrade == 1) {
-                handleUpgrade(parser, d);
+            server.metrics().bytesIn.add(s);
+            if (ending) return;
+            if (paused) {
+                pendingInput.append(d, s);
+                return;
             }
+            execute(d, s);
         });
     }
     void onUrl(const char* str, size_t len) {
@@ -148,21 +208,38 @@ public:
     {
         if (mCurrHeader.empty()) return;
         mHeaders.emplace(mCurrHeader, mCurrValue);
-        mKeepAlive = ::http_should_keep_alive(&parser) != 0;
+        mKeepAlive = !draining && ::http_should_keep_alive(&parser) != 0;
         mHttpMajor = parser.http_major;
         mHttpMinor = parser.http_minor;
-        mMethod = ::http_method_str(static_cast<::http_method>(parser.method));
+        mMethodId = static_cast<::http_method>(parser.method);
+        mMethod = ::http_method_str(mMethodId);
+        trace::headersComplete(traceId(), mRequests);
         IncomingMessage::onMessageBegin();
     }
 
     void onMessageBegin()
     {
+        // a keep-alive connection reuses this object for every request
+        mStartTime = std::chrono::steady_clock::now();
+        trace::firstByteRead(traceId(), ++mRequests);
+        mUrl.clear();
+        mHeaders.clear();
+        mCurrHeader.clear();
+        mCurrValue.clear();
+        inHeaderValueState = false;
+        onMessageCompleteCalled = false;
     }
 
     void onMessageComplete()
     {
-        mKeepAlive = ::http_should_keep_alive(&parser) != 0;
+        mKeepAlive = !draining && ::http_should_keep_alive(&parser) != 0;
         onMessageCompleteCalled = true;
+        if (responsePending() && !parser.upgrade) {
+            paused = true;
+            ::http_parser_pause(&parser, 1);
+            socket.pause();
+        }
+        closeIfDrained();
     }
 
     void onBody(const char* str, size_t len)
@@ -221,8 +298,10 @@ int on_body(::http_parser* parser, const char* str, size_t length) {
 IncomingMessageImpl::IncomingMessageImpl(Socket<ip::tcp>& socket, HttpServer& server)
         : IncomingMessage(socket, server)
     {
-        socket.on(close, [this](bool){
-            delete this;
+        socket.on(close, [this](bool hadError){
+            trace::closeConn(traceId(), hadError);
+            this->server.metrics().activeConnections.sub();
+            connectionClosed(hadError);
         });
         ::http_parser_init(&parser, ::HTTP_REQUEST);
         parser.data = this;
@@ -232,20 +311,48 @@ IncomingMessageImpl::IncomingMessageImpl(Socket<ip::tcp>& socket, HttpServer& se
         parserSettings.on_headers_complete = &on_headers_complete;
         parserSettings.on_message_begin = &on_message_begin;
         parserSettings.on_message_complete = &on_message_complete;
+        parserSettings.on_body = &on_body;
     }
 
 }
 
-IncomingMessage::~IncomingMessage() {}
+IncomingMessage::~IncomingMessage() {
+    delete recycledResponse;
+}
+
+void IncomingMessage::connectionClosed(bool hadError)
+{
+    server.closedConnection(this);
+    if (recycledResponse) recycledResponse->socketClosed(hadError);
+    // the reference of the open connection
+    release();
+}
+
+void IncomingMessage::drain()
+{
+    if (draining) return;
+    draining = true;
+    mKeepAlive = false;
+    // a response whose head is not sent yet announces the close
+    if (responsePending() && !recycledResponse->mHeadersSent) {
+        recycledResponse->sendCloseHeader = true;
+    }
+    closeIfDrained();
+}
 
 void IncomingMessage::onMessageBegin()
 {
     if (recycledResponse == nullptr) {
         recycledResponse = new HttpServerResponse(*this);
     } else {
+        server.mMetrics.keepAliveReuses.add();
         recycledResponse->reset();
     }
+    auto id = traceId();
+    auto requestNumber = mRequests;
+    trace::handlerStart(id, requestNumber);
     server.messageBegin(this, recycledResponse);
+    trace::handlerEnd(id, requestNumber);
 }
 
 void IncomingMessage::handleUpgrade(const ::http_parser& parser, const std::string& buffer) {
@@ -261,31 +368,265 @@ void IncomingMessage::handleUpgrade(const ::http_parser& parser, const std::stri
     }
 }
 
+// the state of close(), used on Loop::main() apart from the callback
+struct HttpServer::Closing {
+    // the loop that called close(), for the callback
+    Loop& loop;
+    std::function<void()> callback;
+    boost::asio::steady_timer deadline;
+    // run() does not return before the callback ran
+    boost::asio::executor_work_guard<boost::asio::io_service::executor_type> work;
+    bool done = false;
+    // set under connectionsMutex once the server stopped accepting
+    bool stopped = false;
+    Closing(Loop& loop, std::function<void()> callback)
+        : loop(loop)
+        , callback(std::move(callback))
+        , deadline(core::service())
+        , work(core::service().get_executor())
+    {}
+};
+
 HttpServer::HttpServer()
 {
     server.on(connection, [this](auto& socket) { openedConnection(socket); });
 } 
 
+HttpServer::~HttpServer() {}
+
 void HttpServer::listen(const std::string& port, const std::string& host)
 {
     server.listen(port, host);
 }
 
 void HttpServer::openedConnection(Socket<boost::asio::ip::tcp>& socket) {
+    mMetrics.connections.add();
+    mMetrics.activeConnections.add();
     auto msg = new IncomingMessageImpl(socket, *this);
+    // released when the connection closes
+    msg->addRef();
+    bool draining;
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        msg->nextConnection = connections;
+        if (connections) connections->prevConnection = msg;
+        connections = msg;
+        draining = closing != nullptr;
+    }
     msg->parseRequest();
+    // accepted before close() stopped the server
+    if (draining) msg->drain();
+}
+
+void HttpServer::closedConnection(IncomingMessage* msg) {
+    bool drained;
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        if (msg->prevConnection) msg->prevConnection->nextConnection = msg->nextConnection;
+        else connections = msg->nextConnection;
+        if (msg->nextConnection) msg->nextConnection->prevConnection = msg->prevConnection;
+        msg->prevConnection = msg->nextConnection = nullptr;
+        drained = closing && closing->stopped && connections == nullptr && server.handoffs() == 0;
+    }
+    if (drained) Loop::main().post([this]() { closed(); });
+}
+
+void HttpServer::close(std::chrono::steady_clock::duration timeout, std::function<void()> callback)
+{
+    auto& loop = Loop::current() ? *Loop::current() : Loop::main();
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        if (closing) return;
+        closing.reset(new Closing(loop, std::move(callback)));
+    }
+    Loop::main().dispatch([this, timeout]() {
+        // accepts complete on this loop, none are handed off from now on
+        server.close();
+        bool drained;
+        {
+            // a connection is counted as a handoff until it is in the list
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            closing->stopped = true;
+            drained = connections == nullptr && server.handoffs() == 0;
+        }
+        if (drained) {
+            closed();
+            return;
+        }
+        closing->deadline.expires_after(timeout);
+        closing->deadline.async_wait([this](const boost::system::error_code& ec) {
+            if (ec || closing->done) return;
+            for (auto other : core::loops()) {
+                other->post([this, other]() { closeConnections(*other, true); });
+            }
+        });
+        // the connections belong to their loops
+        for (auto other : core::loops()) {
+            other->post([this, other]() { closeConnections(*other, false); });
+        }
+    });
+}
+
+void HttpServer::closeConnections(Loop& loop, bool force)
+{
+    // references keep the connections alive while closing one frees
+    // another, only taken on the loop of the connection
+    std::vector<Ref<IncomingMessage>> open;
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (auto msg = connections; msg; msg = msg->nextConnection) {
+            if (&msg->socket.service() == &loop.service()) open.emplace_back(msg);
+        }
+    }
+    for (auto& msg : open) {
+        if (force) msg->socket.close();
+        else msg->drain();
+    }
+}
+
+void HttpServer::closed()
+{
+    if (closing->done) return;
+    closing->done = true;
+    closing->deadline.cancel();
+    // its timer would keep run() from returning
+    if (loopLag) loopLag->stop();
+    closing->loop.dispatch([this]() {
+        if (closing->callback) closing->callback();
+        // run() may return from now on
+        Loop::main().dispatch([this]() { closing->work.reset(); });
+    });
 }
 
 void HttpServer::messageBegin(IncomingMessage* req, HttpServerResponse* resp) {
+    if (!metricsPath.empty() && isMetricsUrl(req->url())) {
+        serveMetrics(*resp);
+        return;
+    }
     fireEvent(request, *req, *resp);
 }
 
+void HttpServer::enableMetrics(const std::string& path, const HttpServer* source)
+{
+    metricsPath = path;
+    metricsSource = source ? source : this;
+    if (!loopLag) {
+        loopLag.reset(new metrics::LoopLagProbe(core::service()));
+        core::service().post([this]() {
+            {
+                std::lock_guard<std::mutex> lock(connectionsMutex);
+                if (closing && closing->done) return;
+            }
+            loopLag->start();
+        });
+    }
+}
+
+bool HttpServer::isMetricsUrl(const std::string& url) const
+{
+    return url.compare(0, metricsPath.size(), metricsPath) == 0
+        && (url.size() == metricsPath.size() || url[metricsPath.size()] == '?');
+}
+
+void HttpServer::serveMetrics(HttpServerResponse& resp)
+{
+    static const char* statusClasses[] = {
+        "class=\"1xx\"", "class=\"2xx\"", "class=\"3xx\"", "class=\"4xx\"", "class=\"5xx\""
+    };
+    Buffer text;
+    {
+        // scrapes on different threads share the buffer
+        std::lock_guard<std::mutex> lock(metricsMutex);
+        auto& out = metricsText;
+        auto& m = metricsSource->mMetrics;
+        out.begin();
+        out.family("nodecxx_http_request_duration_seconds", "summary",
+                   "Time from the first byte of a request until its response ended.");
+        for (int i = 0; i < 5; ++i) {
+            out.summary("nodecxx_http_request_duration_seconds", statusClasses[i], m.latency[i], 1e-9);
+        }
+        out.family("nodecxx_http_received_bytes_total", "counter", "Bytes read from HTTP connections.");
+        out.sample("nodecxx_http_received_bytes_total", nullptr, m.bytesIn.value());
+        out.family("nodecxx_http_sent_bytes_total", "counter", "Bytes written to HTTP connections.");
+        out.sample("nodecxx_http_sent_bytes_total", nullptr, m.bytesOut.value());
+        out.family("nodecxx_http_connections_total", "counter", "Accepted HTTP connections.");
+        out.sample("nodecxx_http_connections_total", nullptr, m.connections.value());
+        out.family("nodecxx_http_active_connections", "gauge", "Open HTTP connections.");
+        out.sample("nodecxx_http_active_connections", nullptr, m.activeConnections.value());
+        out.family("nodecxx_http_keepalive_reuses_total", "counter", "Requests on an already used connection.");
+        out.sample("nodecxx_http_keepalive_reuses_total", nullptr, m.keepAliveReuses.value());
+        out.family("nodecxx_http_parse_errors_total", "counter", "Malformed requests.");
+        out.sample("nodecxx_http_parse_errors_total", nullptr, m.parseErrors.value());
+        out.family("nodecxx_loop_lag_seconds", "summary", "How late a timer fires on the event loop.");
+        out.summary("nodecxx_loop_lag_seconds", nullptr, loopLag->lag(), 1e-9);
+        auto& monitor = metrics::LoopMonitor::instance();
+        if (auto threads = monitor.threads()) {
+            out.family("nodecxx_loop_thread_lag_seconds", "summary",
+                       "How long handlers posted to the loop waited for a thread.");
+            for (size_t i = 0; i < threads; ++i) {
+                out.summary("nodecxx_loop_thread_lag_seconds", monitor.thread(i).label, monitor.thread(i).lag, 1e-9);
+            }
+            out.family("nodecxx_loop_thread_listener_duration_seconds", "summary", "Time event listeners ran.");
+            for (size_t i = 0; i < threads; ++i) {
+                out.summary("nodecxx_loop_thread_listener_duration_seconds", monitor.thread(i).label,
+                            monitor.thread(i).handlerDuration, 1e-9);
+            }
+            out.family("nodecxx_loop_thread_handlers_total", "counter", "Handlers run by a loop thread.");
+            for (size_t i = 0; i < threads; ++i) {
+                out.sample("nodecxx_loop_thread_handlers_total", monitor.thread(i).label,
+                           monitor.thread(i).handlers.load(std::memory_order_relaxed));
+            }
+            out.family("nodecxx_loop_thread_handlers_per_second", "gauge", "Handlers run during the last second.");
+            for (size_t i = 0; i < threads; ++i) {
+                out.sample("nodecxx_loop_thread_handlers_per_second", monitor.thread(i).label,
+                           monitor.thread(i).handlersPerSecond.load(std::memory_order_relaxed));
+            }
+            out.family("nodecxx_loop_thread_slow_listeners_total", "counter",
+                       "Event listeners that ran longer than the slow threshold.");
+            for (size_t i = 0; i < threads; ++i) {
+                out.sample("nodecxx_loop_thread_slow_listeners_total", monitor.thread(i).label,
+                           monitor.thread(i).slowHandlers.load(std::memory_order_relaxed));
+            }
+        }
+        auto& sockets = socketMetrics();
+        out.family("nodecxx_socket_send_queue_bytes", "gauge", "Bytes queued on sockets and not sent yet.");
+        out.sample("nodecxx_socket_send_queue_bytes", nullptr, sockets.queuedBytes.value());
+        out.family("nodecxx_socket_send_queue_items", "gauge", "Writes queued on sockets and not sent yet.");
+        out.sample("nodecxx_socket_send_queue_items", nullptr, sockets.queuedItems.value());
+        // looking the service up must not start a pool
+        if (has_service<impl::FileService>(core::service())) {
+            auto& files = use_service<impl::FileService>(core::service()).metrics();
+            out.family("nodecxx_fs_queued_tasks", "gauge", "File system tasks waiting for a pool thread.");
+            out.sample("nodecxx_fs_queued_tasks", nullptr, files.queued.value());
+            out.family("nodecxx_fs_task_wait_seconds", "summary", "Time file system tasks waited for a pool thread.");
+            out.summary("nodecxx_fs_task_wait_seconds", nullptr, files.wait, 1e-9);
+            out.family("nodecxx_fs_task_duration_seconds", "summary", "Time file system tasks ran.");
+            out.summary("nodecxx_fs_task_duration_seconds", nullptr, files.duration, 1e-9);
+        }
+        if (auto pool = worker::Pool::sharedIfStarted()) {
+            auto& workers = pool->metrics();
+            out.family("nodecxx_worker_queued_tasks", "gauge", "Worker pool tasks waiting for a pool thread.");
+            out.sample("nodecxx_worker_queued_tasks", nullptr, workers.queued.value());
+            out.family("nodecxx_worker_task_wait_seconds", "summary", "Time worker pool tasks waited for a pool thread.");
+            out.summary("nodecxx_worker_task_wait_seconds", nullptr, workers.wait, 1e-9);
+            out.family("nodecxx_worker_task_duration_seconds", "summary", "Time worker pool tasks ran.");
+            out.summary("nodecxx_worker_task_duration_seconds", nullptr, workers.duration, 1e-9);
+            out.family("nodecxx_worker_steals_total", "counter", "Tasks a pool thread took from another one.");
+            out.sample("nodecxx_worker_steals_total", nullptr, workers.steals.value());
+        }
+        text = out.finish();
+    }
+    resp.setHeader("Content-Type", "text/plain; version=0.0.4");
+    resp.end(std::move(text));
+}
+
 HttpServerResponse::HttpServerResponse(IncomingMessage& incomingMessage)
     : incomingMessage(incomingMessage)
     , sendCloseHeader(!incomingMessage.mKeepAlive)
 {
-    incomingMessage.socket.on(close, [this](bool){
-        delete this;
+    incomingMessage.socket.on(drain, [this]() {
+        notifyFlushed(true);
+        fireEvent(drain);
     });
 }
 
@@ -293,15 +634,69 @@ void HttpServerResponse::reset()
 {
     sendCloseHeader = !incomingMessage.mKeepAlive;
     mHeadersSent = false;
+    mFinished = false;
+    mHeaders.clear();
+    mContentLength = 0;
+    mHasContentLength = false;
+    mRawHeaders.clear();
+    buffer.clear();
     statusCode = 200;
     sendDate = true;
     statusMessage.clear();
+    // listeners belong to the previous request
+    clearListeners(close);
+    clearListeners(drain);
+    notifyFlushed(true);
+}
+
+void HttpServerResponse::socketClosed(bool hadError)
+{
+    notifyFlushed(false);
+    fireEvent(close, hadError);
+}
+
+void HttpServerResponse::notifyFlushed(bool sent)
+{
+    if (auto waiter = std::exchange(flushWaiter, nullptr)) {
+        waiter->flushed(sent);
+    }
 }
 
 void HttpServerResponse::prepareSend()
 {
     if (mHeadersSent) return;
-    // here we need to send the headers
+    buffer.clear();
+    renderHead();
+    countOut(buffer.size());
+    incomingMessage.socket.write(std::move(buffer));
+    buffer.clear();
+}
+
+void HttpServerResponse::countOut(size_t bytes)
+{
+    incomingMessage.server.mMetrics.bytesOut.add(bytes);
+}
+
+void HttpServerResponse::finished()
+{
+    if (mFinished) return;
+    mFinished = true;
+    trace::responseEnd(incomingMessage.traceId(), statusCode);
+    auto elapsed = std::chrono::steady_clock::now() - incomingMessage.mStartTime;
+    incomingMessage.server.mMetrics.latencyFor(statusCode).record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    incomingMessage.responseFinished();
+}
+
+void HttpServerResponse::renderHead()
+{
+    mHeadersSent = true;
+    trace::firstByteWritten(incomingMessage.traceId(), statusCode);
+    // without a length the end of the body can only be signalled by
+    // closing the connection
+    if (!mHasContentLength) {
+        sendCloseHeader = true;
+    }
     std::stringstream ss;
     ss << "HTTP/";
     if (incomingMessage.mHttpMajor < 2) {
@@ -323,17 +718,74 @@ void HttpServerResponse::prepareSend()
     if (sendCloseHeader) {
         ss << "Connection: close\r\n";
     }
-    if (mContentLength) {
+    if (mHasContentLength) {
         ss << "Content-Length: " << mContentLength << "\r\n";
     }
     for (auto& p : mHeaders) {
         ss << p.first << ": " << p.second << "\r\n";
     }
-    ss << "\r\n";
-    const auto& s = ss.str();
-    incomingMessage.socket.write(s);
+    ss << mRawHeaders << "\r\n";
+    buffer += ss.str();
 }
 
+void HttpServerResponse::write(Buffer body)
+{
+    prepareSend();
+    countOut(body.size());
+    incomingMessage.socket.write(std::move(body));
+}
 
-} // namespace nodecxx
+void HttpServerResponse::end(Buffer body)
+{
+    buffer.clear();
+    if (!mHeadersSent) {
+        if (!mHasContentLength) {
+            mContentLength = body.size();
+            mHasContentLength = true;
+        }
+        renderHead();
+        countOut(buffer.size());
+        // the socket writes head and body with one gather write
+        incomingMessage.socket.write(std::move(buffer));
+        buffer.clear();
+    }
+    countOut(body.size());
+    if (sendCloseHeader) {
+        incomingMessage.socket.end(std::move(body));
+    } else {
+        incomingMessage.socket.write(std::move(body));
+    }
+    finished();
+}
+
+size_t HttpServerResponse::bufferSize() const
+{
+    return incomingMessage.socket.bufferSize();
+}
+
+bool HttpServerResponse::destroyed() const
+{
+    return incomingMessage.socket.destroyed();
+}
+
+void HttpServerResponse::destroy()
+{
+    incomingMessage.socket.close();
+}
 
+void HttpServerResponse::sendFile(int fd, uint64_t offset, size_t length, std::shared_ptr<const void> owner)
+{
+    if (!mHeadersSent) {
+        mContentLength = length;
+        mHasContentLength = true;
+    }
+    prepareSend();
+    countOut(length);
+    incomingMessage.socket.sendFile(fd, offset, length, std::move(owner));
+    if (sendCloseHeader) {
+        incomingMessage.socket.end(std::string());
+    }
+    finished();
+}
+
+} // namespace nodecxx
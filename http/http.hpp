@@ -1,10 +1,17 @@
 #pragma once
 #include <json>
 #include <events.hpp>
+#include <ref.hpp>
 #include <net/net.hpp>
 #include <net/events.hpp>
+#include <metrics/metrics.hpp>
+#include <metrics/loop_lag.hpp>
+#include <metrics/prometheus.hpp>
 #include "http_parser.h"
 
+#include <mutex>
+#include <chrono>
+#include <memory>
 #include <functional>
 #include <unordered_map>
 
@@ -13,17 +20,30 @@ namespace nodecxx {
 class HttpServer;
 class IncomingMessage;
 
-class HttpServerResponse : public EmittingEvents<close_t> {
+class HttpServerResponse : public EmittingEvents<close_t, drain_t> {
     friend class IncomingMessage;
     IncomingMessage& incomingMessage;
     bool sendCloseHeader;
     bool mHeadersSent = false;
     std::unordered_map<std::string, std::string> mHeaders;
-    unsigned mContentLength = 0;
+    uint64_t mContentLength = 0;
+    bool mHasContentLength = false;
+    std::string mRawHeaders;
     std::string buffer;
+    bool mFinished = false;
+    impl::FlushWaiter* flushWaiter = nullptr;
 private:
     void reset();
+    void notifyFlushed(bool sent);
+    // the connection closed
+    void socketClosed(bool hadError);
+    // renders the status line and headers into buffer
+    void renderHead();
     void prepareSend();
+    // counts bytes handed to the socket
+    void countOut(size_t bytes);
+    // records the request in the server metrics once the response ended
+    void finished();
 private: // Construction
     HttpServerResponse(IncomingMessage& incomingMessage);
 public:
@@ -34,9 +54,11 @@ public:
     template<class S>
     void setHeader(const std::string& name, S&& value) {
         if (name == "Content-Length") {
-            mContentLength = std::stoul(value);
+            mContentLength = std::stoull(value);
+            mHasContentLength = true;
+            return;
         }
-        mHeaders.emplace(name, std::forward<S>(value));
+        mHeaders[name] = std::forward<S>(value);
     }
     bool getHeader(const std::string& name, std::string& result) const {
         auto i = mHeaders.find(name);
@@ -50,10 +72,38 @@ public:
         mHeaders.erase(i);
         return true;
     }
+    // Appends pre-rendered "Name: value\r\n" lines to the response head
+    void addRawHeaders(const std::string& lines) {
+        mRawHeaders += lines;
+    }
     template<class B>
     void write(B&& b);
     template<class B>
     void end(B&& b);
+    // Sends body without copying it
+    void write(Buffer body);
+    void end(Buffer body);
+    // Ends the response with length bytes of the file fd sent from offset
+    // with sendfile. owner has to keep fd open until the data is sent.
+    void sendFile(int fd, uint64_t offset, size_t length, std::shared_ptr<const void> owner);
+    // Bytes written but not sent yet. The drain event fires once they are.
+    size_t bufferSize() const;
+    // Closes the connection, the response cannot be finished anymore
+    void destroy();
+    // Calls waiter->flushed(true) once the bytes written so far are sent
+    // or the next request on the connection began, flushed(false) if the
+    // connection closed first. One waiter at a time, nullptr removes it.
+    // Unlike a drain listener it does not allocate.
+    void onFlushed(impl::FlushWaiter* waiter) { flushWaiter = waiter; }
+    // the connection closed, what is written is dropped
+    bool destroyed() const;
+    // the io_service of the loop of the connection
+    boost::asio::io_service& service() const;
+    // A response is part of its request, references to either keep both
+    // alive: a handler that answers later holds a Ref<HttpServerResponse>
+    // instead of capturing it by reference.
+    void addRef();
+    void release();
 };
 
 struct upgrade_t {
@@ -63,25 +113,53 @@ struct upgrade_t {
 
 constexpr upgrade_t upgrade;
 
-class IncomingMessage : public EmittingEvents<close_t, data_t, error_t, upgrade_t> {
+// A request and the connection it came in on. Keep-alive connections reuse
+// it for each of their requests; the next request is parsed once the
+// response to the current one ended. It is freed once the connection
+// closed and no Ref to it or its response is left.
+class IncomingMessage : public RefCounted, public EmittingEvents<close_t, data_t, error_t, upgrade_t> {
     friend class HttpServer;
     friend class HttpServerResponse;
 protected:
     Socket<boost::asio::ip::tcp>& socket;
+    Ref<Socket<boost::asio::ip::tcp>> socketRef;
     HttpServer& server;
     std::string mUrl;
     std::string mMethod;
+    ::http_method mMethodId = HTTP_GET;
     std::unordered_multimap<std::string, std::string> mHeaders;
     int mHttpMajor = 0;
     int mHttpMinor = 0;
     bool mKeepAlive = true;
+    // when the first byte of the request got parsed
+    std::chrono::steady_clock::time_point mStartTime;
+    // requests on this connection so far
+    uint64_t mRequests = 0;
     HttpServerResponse* recycledResponse = nullptr;
+    // the open connections of the server, linked for close()
+    IncomingMessage* prevConnection = nullptr;
+    IncomingMessage* nextConnection = nullptr;
+    // set by HttpServer::close(), the connection closes once the current
+    // request is answered
+    bool draining = false;
 protected: // internal callbacks
     void onMessageBegin();
+    // identifies the connection in traces
+    uint64_t traceId() const { return reinterpret_cast<uintptr_t>(&socket); }
     void handleUpgrade(const ::http_parser& parser, const std::string& buffer);
+    // the response of the current request ended
+    virtual void responseFinished() {}
+    // tells the response and drops the reference of the open connection
+    void connectionClosed(bool hadError);
+    // no more requests after the current one, on the loop of the connection
+    void drain();
+    // ends the connection if it drains and no request is in progress
+    virtual void closeIfDrained() {}
+    bool responsePending() const { return recycledResponse && !recycledResponse->mFinished; }
 protected: // construction
     IncomingMessage(Socket<boost::asio::ip::tcp>& socket, HttpServer& server)
         : socket(socket)
+        , socketRef(&socket)
         , server(server)
     {}
     virtual ~IncomingMessage();
@@ -96,6 +174,9 @@ public: // Access
     const std::string& method() const {
         return mMethod;
     }
+    ::http_method methodId() const {
+        return mMethodId;
+    }
 };
 
 struct request_t {
@@ -105,38 +186,126 @@ struct request_t {
 
 constexpr request_t request;
 
+// Recorded by every HttpServer. Recording is a few relaxed atomic adds on
+// memory of the recording thread, the threads are merged when read.
+struct HttpServerMetrics {
+    // nanoseconds from the first byte of a request until its response
+    // ended, by status class: latency[0] for 1xx up to latency[4] for 5xx
+    metrics::Histogram latency[5];
+    // body and header bytes read and written
+    metrics::Counter bytesIn;
+    metrics::Counter bytesOut;
+    metrics::Counter connections;
+    metrics::Gauge activeConnections;
+    // requests that were not the first on their connection
+    metrics::Counter keepAliveReuses;
+    // malformed requests, their connection got closed
+    metrics::Counter parseErrors;
+    // the histogram for statusCode
+    metrics::Histogram& latencyFor(int statusCode) {
+        auto c = statusCode / 100 - 1;
+        return latency[c < 0 ? 0 : c > 4 ? 4 : c];
+    }
+};
+
+// Serves HTTP on the loops of core::loops(). It listens on Loop::main(),
+// request listeners run on the loop of the connection.
 class HttpServer : public EmittingEvents<request_t> {
+    struct Closing;
     TcpServer server;
+    HttpServerMetrics mMetrics;
+    std::string metricsPath;
+    const HttpServer* metricsSource = nullptr;
+    std::mutex metricsMutex;
+    metrics::PrometheusText metricsText;
+    std::unique_ptr<metrics::LoopLagProbe> loopLag;
+    // the open connections of all loops, the first of a linked list
+    std::mutex connectionsMutex;
+    IncomingMessage* connections = nullptr;
+    // set once by close()
+    std::unique_ptr<Closing> closing;
     friend class IncomingMessage;
+    friend class HttpServerResponse;
 public:
     HttpServer();
+    ~HttpServer();
     void listen(const std::string& port, const std::string& host);
+    // Shuts the server down gracefully: it stops accepting, lets requests
+    // in progress finish and closes every connection after its current
+    // request, the response announces it with Connection: close. Idle
+    // keep-alive connections close right away, those still open after
+    // timeout get closed. callback runs on the calling loop once all
+    // connections closed, the server must live until then. Later calls
+    // do nothing.
+    void close(std::chrono::steady_clock::duration timeout, std::function<void()> callback = nullptr);
+    HttpServerMetrics& metrics() { return mMetrics; }
+    const HttpServerMetrics& metrics() const { return mMetrics; }
+    // Answers requests for path with the metrics in the Prometheus text
+    // format, without firing the request event. They cover source, or
+    // this server if that is null, the loop lag of core::service(), the
+    // send queues of all sockets and the FileService pool. A server on a
+    // port of its own can serve the metrics of another one this way.
+    void enableMetrics(const std::string& path = "/metrics", const HttpServer* source = nullptr);
 private:
+    bool isMetricsUrl(const std::string& url) const;
+    void serveMetrics(HttpServerResponse& resp);
     void openedConnection(Socket<boost::asio::ip::tcp>& socket);
+    void closedConnection(IncomingMessage* msg);
+    // drains or, if force is set, closes the connections of loop
+    void closeConnections(Loop& loop, bool force);
+    // all connections closed after close(), on Loop::main()
+    void closed();
     void messageBegin(IncomingMessage* req, HttpServerResponse* resp);
 };
 
+inline void HttpServerResponse::addRef()
+{
+    incomingMessage.addRef();
+}
+
+inline void HttpServerResponse::release()
+{
+    incomingMessage.release();
+}
+
+inline boost::asio::io_service& HttpServerResponse::service() const
+{
+    return incomingMessage.socket.service();
+}
+
 template<class B>
 void HttpServerResponse::write(B&& b)
 {
-    serializer<B> ser;
-    if (!mHeadersSent)
-        buffer += ser(std::forward<B>(b));
-    incomingMessage.socket.write(b);
+    prepareSend();
+    serializer<typename std::remove_const<typename std::remove_reference<B>::type>::type> ser;
+    auto body = ser(std::forward<B>(b));
+    countOut(body.size());
+    incomingMessage.socket.write(std::move(body));
 }
 
 template<class B>
 void HttpServerResponse::end(B&& b)
 {
-    serializer<B> ser;
-    buffer += ser(std::forward<B>(b));
+    serializer<typename std::remove_const<typename std::remove_reference<B>::type>::type> ser;
+    auto body = ser(std::forward<B>(b));
+    buffer.clear();
     if (!mHeadersSent) {
-        if (mContentLength == 0) {
-            mContentLength = buffer.size();
+        if (!mHasContentLength) {
+            mContentLength = body.size();
+            mHasContentLength = true;
         }
-        prepareSend();
+        renderHead();
+    }
+    // headers and body go out in one write
+    buffer += body;
+    countOut(buffer.size());
+    if (sendCloseHeader) {
+        incomingMessage.socket.end(std::move(buffer));
+    } else {
+        incomingMessage.socket.write(std::move(buffer));
     }
-    incomingMessage.socket.write(buffer);
+    buffer.clear();
+    finished();
 }
 
 } // namespace nodecxx
@@ -0,0 +1,151 @@
+#include "loop.hpp"
+#include "core.hpp"
+
+#include <cerrno>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace nodecxx {
+
+namespace {
+
+thread_local Loop* currentLoop = nullptr;
+
+// at most this many tasks run per wakeup, so a busy producer cannot keep
+// the loop from its sockets
+constexpr unsigned maxBatch = 1024;
+
+} // anonymous namespace
+
+namespace impl {
+
+LoopTask* MpscQueue::pop() {
+    auto task = first;
+    auto next = task->next.load(std::memory_order_acquire);
+    if (task == &stub) {
+        if (next == nullptr) return nullptr;
+        first = next;
+        task = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        first = next;
+        return task;
+    }
+    // task is the last one, unless a push is half done
+    if (task != last.load(std::memory_order_acquire)) return nullptr;
+    // the stub goes behind it, so task can be taken without the queue
+    // running empty
+    push(&stub);
+    next = task->next.load(std::memory_order_acquire);
+    if (next) {
+        first = next;
+        return task;
+    }
+    return nullptr;
+}
+
+CurrentLoop::CurrentLoop(Loop* loop)
+    : prev(currentLoop)
+{
+    currentLoop = loop;
+}
+
+CurrentLoop::~CurrentLoop() {
+    currentLoop = prev;
+}
+
+} // namespace impl
+
+Loop::Loop()
+    : owned(new boost::asio::io_service())
+    , ios(*owned)
+    , eventFd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , wakeup(ios, eventFd)
+{}
+
+Loop::Loop(boost::asio::io_service& ios)
+    : ios(ios)
+    , eventFd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , wakeup(ios, eventFd)
+{}
+
+Loop::~Loop() {
+    boost::system::error_code ec;
+    wakeup.close(ec);
+    while (auto task = queue.pop()) {
+        delete task;
+    }
+}
+
+Loop& Loop::main() {
+    static Loop res(core::service());
+    return res;
+}
+
+Loop* Loop::current() {
+    return currentLoop;
+}
+
+void Loop::run() {
+    impl::CurrentLoop scope(this);
+    auto work = boost::asio::make_work_guard(ios);
+    ios.restart();
+    ios.run();
+}
+
+void Loop::stop() {
+    ios.stop();
+}
+
+void Loop::enqueue(impl::LoopTask* task) {
+    // taken back when the task ran
+    ios.get_executor().on_work_started();
+    queue.push(task);
+    if (!armed.load(std::memory_order_relaxed) && !armed.exchange(true)) {
+        // from the loop thread, while the task keeps the io_service busy
+        ios.post([this]() { arm(); });
+    }
+    if (!wakeupPending.exchange(true)) {
+        uint64_t one = 1;
+        while (::write(eventFd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    }
+}
+
+// The read on the eventfd must not keep the io_service running by itself,
+// only the posted tasks do. Its work count is given back right away and
+// taken again when the handler runs. Called when something else keeps the
+// io_service busy, otherwise giving it back would stop the io_service.
+void Loop::arm() {
+    wakeup.async_read_some(boost::asio::buffer(&wakeupValue, sizeof(wakeupValue)),
+            [this](const boost::system::error_code& ec, size_t) {
+        onWakeup(ec);
+    });
+    ios.get_executor().on_work_finished();
+}
+
+void Loop::onWakeup(const boost::system::error_code& ec) {
+    ios.get_executor().on_work_started();
+    if (ec == boost::asio::error::operation_aborted) return;
+    // Producers that push from now on write the eventfd again. An exchange
+    // and not a store, so the pushes of producers that saw the flag set
+    // and did not write are visible below.
+    wakeupPending.exchange(false, std::memory_order_acq_rel);
+    unsigned n = 0;
+    while (auto task = queue.pop()) {
+        std::unique_ptr<impl::LoopTask> owner(task);
+        task->run();
+        ios.get_executor().on_work_finished();
+        if (++n == maxBatch) {
+            // the rest after the next turn of the io_service
+            if (!wakeupPending.exchange(true)) {
+                uint64_t one = 1;
+                while (::write(eventFd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+            }
+            break;
+        }
+    }
+    arm();
+}
+
+} // namespace nodecxx
@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include <boost/asio.hpp>
+
+namespace nodecxx {
+
+namespace impl {
+
+// work handed to a loop, linked into its queue
+struct LoopTask {
+    std::atomic<LoopTask*> next{nullptr};
+    virtual ~LoopTask() {}
+    virtual void run() = 0;
+};
+
+template<class F>
+struct LoopTaskImpl : LoopTask {
+    F f;
+    template<class G>
+    explicit LoopTaskImpl(G&& g) : f(std::forward<G>(g)) {}
+    void run() override { f(); }
+};
+
+// An intrusive multi-producer single-consumer queue (Dmitry Vyukov's).
+// push() is one atomic exchange and never waits. While a push is half done
+// pop() does not see the tasks pushed after it, they show up once it
+// completed.
+class MpscQueue {
+    struct Stub : LoopTask {
+        void run() override {}
+    };
+    // producers link behind the last task
+    std::atomic<LoopTask*> last;
+    // the consumer takes from here
+    LoopTask* first;
+    Stub stub;
+public:
+    MpscQueue()
+        : last(&stub)
+        , first(&stub)
+    {}
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator= (const MpscQueue&) = delete;
+    void push(LoopTask* task) {
+        task->next.store(nullptr, std::memory_order_relaxed);
+        auto prev = last.exchange(task, std::memory_order_acq_rel);
+        prev->next.store(task, std::memory_order_release);
+    }
+    // the consumer only, nullptr if nothing can be taken right now
+    LoopTask* pop();
+};
+
+} // namespace impl
+
+// An event loop: an io_service together with a queue other threads hand
+// work to. post() may be called from any thread, the task runs on a thread
+// that runs the loop. A batch of posts costs one eventfd write, the loop
+// drains everything queued when it wakes up.
+//
+// The loop of core::service() is Loop::main(), run() runs it. Other loops
+// own their io_service and are run by a thread of their own with
+// Loop::run().
+class Loop {
+    // declared first, so it is destroyed after everything that uses it
+    std::unique_ptr<boost::asio::io_service> owned;
+    boost::asio::io_service& ios;
+    impl::MpscQueue queue;
+    // set by the producer that writes the eventfd, cleared by the loop
+    // before it drains the queue
+    std::atomic<bool> wakeupPending{false};
+    // the eventfd is read from the first post() on
+    std::atomic<bool> armed{false};
+    int eventFd;
+    boost::asio::posix::stream_descriptor wakeup;
+    uint64_t wakeupValue = 0;
+public:
+    // a loop with an io_service of its own
+    Loop();
+    // a loop for ios, which has to outlive it
+    explicit Loop(boost::asio::io_service& ios);
+    Loop(const Loop&) = delete;
+    Loop& operator= (const Loop&) = delete;
+    // Only when nothing runs the loop anymore. Tasks still queued are
+    // dropped without running.
+    ~Loop();
+    // the loop of core::service()
+    static Loop& main();
+    // the loop the calling thread runs, nullptr outside of loop threads
+    static Loop* current();
+public:
+    boost::asio::io_service& service() { return ios; }
+    bool inLoopThread() const { return current() == this; }
+    // Runs f on the loop, after the tasks posted before it. A posted task
+    // keeps the loop from running out of work, like io_service::post.
+    template<class F>
+    void post(F&& f) {
+        enqueue(new impl::LoopTaskImpl<typename std::decay<F>::type>(std::forward<F>(f)));
+    }
+    // runs f right away when called on the loop, posts it otherwise
+    template<class F>
+    void dispatch(F&& f) {
+        if (inLoopThread()) f();
+        else post(std::forward<F>(f));
+    }
+    // Runs the loop on the calling thread until stop() is called, also
+    // while there is nothing to do
+    void run();
+    // makes run() return, may be called from any thread
+    void stop();
+private:
+    void enqueue(impl::LoopTask* task);
+    void arm();
+    void onWakeup(const boost::system::error_code& ec);
+};
+
+namespace impl {
+
+// makes loop the current loop of the thread for the scope
+class CurrentLoop {
+    Loop* prev;
+public:
+    explicit CurrentLoop(Loop* loop);
+    ~CurrentLoop();
+    CurrentLoop(const CurrentLoop&) = delete;
+    CurrentLoop& operator= (const CurrentLoop&) = delete;
+};
+
+} // namespace impl
+
+} // namespace nodecxx
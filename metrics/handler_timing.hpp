@@ -0,0 +1,29 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <typeinfo>
+
+namespace nodecxx {
+namespace metrics {
+namespace impl {
+
+// set while the LoopMonitor times event listeners
+inline std::atomic<bool> handlerTiming{false};
+
+// Times an event listener on a loop thread of core::run, see LoopMonitor.
+// Does nothing on other threads.
+class HandlerScope {
+    void* thread;
+    int64_t start = 0;
+    const std::type_info& event;
+    const std::type_info& handler;
+public:
+    HandlerScope(const std::type_info& event, const std::type_info& handler);
+    HandlerScope(const HandlerScope&) = delete;
+    HandlerScope& operator= (const HandlerScope&) = delete;
+    ~HandlerScope();
+};
+
+} // namespace impl
+} // namespace metrics
+} // namespace nodecxx
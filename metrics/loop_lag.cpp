@@ -0,0 +1,41 @@
+#include "loop_lag.hpp"
+
+namespace nodecxx {
+namespace metrics {
+
+LoopLagProbe::LoopLagProbe(boost::asio::io_service& ios, std::chrono::nanoseconds interval)
+    : timer(ios)
+    , interval(interval)
+{}
+
+void LoopLagProbe::start() {
+    if (running) return;
+    running = true;
+    expected = Clock::now();
+    arm();
+}
+
+void LoopLagProbe::stop() {
+    running = false;
+    boost::system::error_code ec;
+    timer.cancel(ec);
+}
+
+void LoopLagProbe::arm() {
+    expected += interval;
+    timer.expires_at(expected);
+    timer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec || !running) return;
+        auto now = Clock::now();
+        auto lag = std::chrono::duration_cast<std::chrono::nanoseconds>(now - expected).count();
+        if (lag < 0) lag = 0;
+        mLag.record(uint64_t(lag));
+        mLastLag.store(lag, std::memory_order_relaxed);
+        // a stalled loop is measured once, not once per missed interval
+        expected = now;
+        arm();
+    });
+}
+
+} // namespace metrics
+} // namespace nodecxx
@@ -0,0 +1,37 @@
+#pragma once
+#include <chrono>
+#include <atomic>
+#include <boost/asio.hpp>
+#include "metrics.hpp"
+
+namespace nodecxx {
+namespace metrics {
+
+// Measures how late a timer fires on an io_service, which is how long ready
+// handlers had to wait for the loop. Like monitorEventLoopDelay in node.
+// While started the timer keeps the io_service from running out of work.
+class LoopLagProbe {
+    using Clock = std::chrono::steady_clock;
+    boost::asio::steady_timer timer;
+    std::chrono::nanoseconds interval;
+    Clock::time_point expected;
+    bool running = false;
+    Histogram mLag;
+    std::atomic<int64_t> mLastLag{0};
+public:
+    explicit LoopLagProbe(boost::asio::io_service& ios,
+                          std::chrono::nanoseconds interval = std::chrono::milliseconds(100));
+    LoopLagProbe(const LoopLagProbe&) = delete;
+    LoopLagProbe& operator= (const LoopLagProbe&) = delete;
+    // start and stop have to run on the io_service
+    void start();
+    void stop();
+    // lag in nanoseconds, one record per interval
+    const Histogram& lag() const { return mLag; }
+    int64_t lastLag() const { return mLastLag.load(std::memory_order_relaxed); }
+private:
+    void arm();
+};
+
+} // namespace metrics
+} // namespace nodecxx
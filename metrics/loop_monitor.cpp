@@ -0,0 +1,292 @@
+#include "loop_monitor.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <execinfo.h>
+#include <cxxabi.h>
+
+namespace nodecxx {
+namespace metrics {
+
+namespace impl {
+
+constexpr int maxFrames = 64;
+
+struct LoopThreadState : LoopThreadStats {
+    boost::asio::io_service* ios = nullptr;
+    pthread_t pthread;
+    // start of the running outermost listener, 0 while none runs
+    std::atomic<int64_t> handlerStart{0};
+    // counts the outermost listeners
+    std::atomic<uint64_t> seq{0};
+    unsigned depth = 0;
+    // a listener of the current outermost one got reported already
+    bool reported = false;
+    // written by the signal handler on the thread itself
+    void* frames[maxFrames];
+    std::atomic<int> frameCount{0};
+    std::atomic<uint64_t> sampledSeq{0};
+    // watchdog only
+    uint64_t signalledSeq = 0;
+    uint64_t lastHandlers = 0;
+};
+
+} // namespace impl
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+thread_local impl::LoopThreadState* currentThread = nullptr;
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+std::string demangle(const char* name) {
+    int status = 0;
+    auto res = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status != 0 || res == nullptr) return name;
+    std::string str(res);
+    std::free(res);
+    return str;
+}
+
+// turns "binary(_Z3foov+0x12) [0x4005]" into "binary(foo()+0x12) [0x4005]"
+std::string symbolize(const char* line) {
+    auto open = std::strchr(line, '(');
+    auto plus = open ? std::strchr(open, '+') : nullptr;
+    if (open == nullptr || plus == nullptr || plus == open + 1) return line;
+    std::string mangled(open + 1, plus);
+    return std::string(line, open + 1) + demangle(mangled.c_str()) + plus;
+}
+
+void onSampleSignal(int) {
+    auto thread = currentThread;
+    if (thread == nullptr || thread->handlerStart.load(std::memory_order_relaxed) == 0) return;
+    thread->frameCount.store(::backtrace(thread->frames, impl::maxFrames), std::memory_order_relaxed);
+    thread->sampledSeq.store(thread->seq.load(std::memory_order_relaxed), std::memory_order_release);
+}
+
+} // anonymous namespace
+
+namespace impl {
+
+HandlerScope::HandlerScope(const std::type_info& event, const std::type_info& handler)
+    : thread(currentThread)
+    , event(event)
+    , handler(handler)
+{
+    auto t = currentThread;
+    if (t == nullptr) return;
+    start = nowNs();
+    if (t->depth++ == 0) {
+        t->seq.fetch_add(1, std::memory_order_relaxed);
+        t->reported = false;
+        t->handlerStart.store(start, std::memory_order_release);
+    }
+}
+
+HandlerScope::~HandlerScope() {
+    auto t = static_cast<LoopThreadState*>(thread);
+    if (t == nullptr) return;
+    auto duration = nowNs() - start;
+    auto& monitor = LoopMonitor::instance();
+    auto threshold = monitor.slowThreshold.load(std::memory_order_relaxed);
+    // nested listeners end first, the innermost slow one gets reported
+    if (threshold > 0 && duration >= threshold && !t->reported) {
+        t->reported = true;
+        monitor.report(*t, event, handler, duration);
+    }
+    if (--t->depth == 0) {
+        t->handlerDuration.record(uint64_t(duration));
+        t->handlerStart.store(0, std::memory_order_release);
+    }
+}
+
+} // namespace impl
+
+LoopMonitor& LoopMonitor::instance() {
+    static LoopMonitor res;
+    return res;
+}
+
+LoopMonitor::LoopMonitor() {}
+
+LoopMonitor::~LoopMonitor() {
+    stop();
+}
+
+void LoopMonitor::enable(LoopMonitorOptions options) {
+    std::lock_guard<std::mutex> lock(mutex);
+    mOptions = options;
+    slowThreshold = options.slowThreshold.count();
+    if (options.backtraces) {
+        // the first call loads libgcc, which must not happen in a signal
+        // handler
+        void* frames[1];
+        ::backtrace(frames, 1);
+    }
+    mEnabled = true;
+}
+
+void LoopMonitor::disable() {
+    mEnabled = false;
+    impl::handlerTiming = false;
+}
+
+void LoopMonitor::onSlowHandler(Listener listener) {
+    std::lock_guard<std::mutex> lock(mutex);
+    listeners.push_back(std::move(listener));
+}
+
+const LoopThreadStats& LoopMonitor::thread(size_t index) const {
+    return *mThreads.at(index);
+}
+
+void LoopMonitor::start(const std::vector<boost::asio::io_service*>& services) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto numThreads = unsigned(services.size());
+    ++generation;
+    while (mThreads.size() < numThreads) {
+        auto state = std::make_unique<impl::LoopThreadState>();
+        state->index = unsigned(mThreads.size());
+        std::snprintf(state->label, sizeof(state->label), "thread=\"%u\"", state->index);
+        mThreads.push_back(std::move(state));
+    }
+    for (unsigned i = 0; i < numThreads; ++i) {
+        mThreads[i]->ios = services[i];
+    }
+    activeThreads.store(numThreads, std::memory_order_release);
+    impl::handlerTiming = mOptions.slowThreshold.count() > 0;
+    if (mOptions.backtraces && sampleSignal == 0) {
+        struct ::sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = &onSampleSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (::sigaction(mOptions.backtraceSignal, &action, &previousAction) == 0) {
+            sampleSignal = mOptions.backtraceSignal;
+        }
+    }
+    stopping = false;
+    watchdog = std::thread([this]() { watch(); });
+}
+
+void LoopMonitor::runThread(unsigned index) {
+    auto& state = *mThreads[index];
+    state.pthread = ::pthread_self();
+    currentThread = &state;
+    while (state.ios->run_one()) {
+        state.handlers.fetch_add(1, std::memory_order_relaxed);
+    }
+    currentThread = nullptr;
+}
+
+void LoopMonitor::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        impl::handlerTiming = false;
+        // probes still queued belong to this run
+        ++generation;
+    }
+    wakeup.notify_all();
+    if (watchdog.joinable()) watchdog.join();
+    std::lock_guard<std::mutex> lock(mutex);
+    // the watchdog sends no more signals, the application may use it again
+    if (sampleSignal != 0) {
+        ::sigaction(sampleSignal, &previousAction, nullptr);
+        sampleSignal = 0;
+    }
+}
+
+void LoopMonitor::watch() {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto threshold = mOptions.slowThreshold;
+    auto period = std::chrono::duration_cast<std::chrono::milliseconds>(threshold / 4);
+    period = std::max(std::chrono::milliseconds(1), std::min(period, std::chrono::milliseconds(100)));
+    if (threshold.count() == 0) period = std::chrono::milliseconds(100);
+    auto nextProbe = Clock::now();
+    auto lastRate = Clock::now();
+    auto numThreads = activeThreads.load();
+    while (!stopping) {
+        wakeup.wait_for(lock, period);
+        if (stopping) break;
+        auto now = Clock::now();
+        auto ns = nowNs();
+        for (unsigned i = 0; i < numThreads; ++i) {
+            auto& t = *mThreads[i];
+            auto start = t.handlerStart.load(std::memory_order_acquire);
+            auto seq = t.seq.load(std::memory_order_relaxed);
+            if (sampleSignal != 0 && threshold.count() > 0 && start != 0
+                    && ns - start >= threshold.count() && t.signalledSeq != seq) {
+                t.signalledSeq = seq;
+                ::pthread_kill(t.pthread, sampleSignal);
+            }
+        }
+        if (now >= nextProbe) {
+            nextProbe = now + mOptions.lagInterval;
+            // one probe per loop. A probe is no work that keeps run() from
+            // returning for long.
+            for (unsigned i = 0; i < numThreads; ++i) {
+                mThreads[i]->ios->post([this, gen = generation.load(), posted = ns]() {
+                    auto t = currentThread;
+                    if (t == nullptr || gen != generation.load(std::memory_order_relaxed)) return;
+                    t->lag.record(uint64_t(std::max<int64_t>(0, nowNs() - posted)));
+                });
+            }
+        }
+        if (now - lastRate >= std::chrono::seconds(1)) {
+            double seconds = std::chrono::duration<double>(now - lastRate).count();
+            lastRate = now;
+            for (unsigned i = 0; i < numThreads; ++i) {
+                auto& t = *mThreads[i];
+                auto handlers = t.handlers.load(std::memory_order_relaxed);
+                t.handlersPerSecond.store((handlers - t.lastHandlers) / seconds, std::memory_order_relaxed);
+                t.lastHandlers = handlers;
+            }
+        }
+    }
+}
+
+void LoopMonitor::report(impl::LoopThreadState& thread, const std::type_info& event,
+                         const std::type_info& handler, int64_t duration) {
+    thread.slowHandlers.fetch_add(1, std::memory_order_relaxed);
+    SlowHandlerReport res;
+    res.thread = thread.index;
+    res.event = demangle(event.name());
+    res.handler = demangle(handler.name());
+    res.duration = std::chrono::nanoseconds(duration);
+    if (thread.sampledSeq.load(std::memory_order_acquire) == thread.seq.load(std::memory_order_relaxed)) {
+        auto n = thread.frameCount.load(std::memory_order_relaxed);
+        if (auto symbols = ::backtrace_symbols(thread.frames, n)) {
+            // the first frames are the signal handler
+            for (int i = 2; i < n; ++i) {
+                res.backtrace.push_back(symbolize(symbols[i]));
+            }
+            std::free(symbols);
+        }
+    }
+    std::vector<Listener> toCall;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        toCall = listeners;
+    }
+    if (mOptions.log) {
+        std::cerr << "nodecxx: slow " << res.event << " listener on loop thread " << res.thread << ": "
+                  << duration / 1000000.0 << "ms in " << res.handler << '\n';
+        for (const auto& frame : res.backtrace) {
+            std::cerr << "    " << frame << '\n';
+        }
+    }
+    for (const auto& listener : toCall) {
+        listener(res);
+    }
+}
+
+} // namespace metrics
+} // namespace nodecxx
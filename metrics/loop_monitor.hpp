@@ -0,0 +1,117 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <functional>
+#include <condition_variable>
+#include <boost/asio.hpp>
+#include "metrics.hpp"
+#include "handler_timing.hpp"
+
+namespace nodecxx {
+namespace metrics {
+
+struct LoopMonitorOptions {
+    // how often the scheduling lag of every loop thread is probed
+    std::chrono::nanoseconds lagInterval = std::chrono::milliseconds(100);
+    // event listeners running at least this long get reported, zero
+    // turns timing listeners off
+    std::chrono::nanoseconds slowThreshold = std::chrono::milliseconds(50);
+    // Samples the stack of a listener once it ran for slowThreshold, which
+    // shows where it blocks. Needs -rdynamic for function names. The signal
+    // interrupts the listener, a sleep or poll it is blocked in may return
+    // early with EINTR.
+    bool backtraces = true;
+    // used to interrupt the loop thread for the stack sample, its handler
+    // is installed while run() runs and restored afterwards
+    int backtraceSignal = SIGRTMIN + 4;
+    // writes slow listeners to std::cerr
+    bool log = true;
+};
+
+struct SlowHandlerReport {
+    // index of the loop thread
+    unsigned thread;
+    // demangled type of the event and of the listener
+    std::string event;
+    std::string handler;
+    std::chrono::nanoseconds duration;
+    // the stack while the listener was running, empty if none got sampled
+    std::vector<std::string> backtrace;
+};
+
+struct LoopThreadStats {
+    unsigned index = 0;
+    // thread="<index>", for labels
+    char label[24] = {};
+    // nanoseconds a handler posted to the io_service waited until it ran
+    Histogram lag;
+    // nanoseconds the outermost event listeners ran
+    Histogram handlerDuration;
+    // io_service handlers run
+    std::atomic<uint64_t> handlers{0};
+    std::atomic<uint64_t> slowHandlers{0};
+    // handlers run during the last second
+    std::atomic<double> handlersPerSecond{0};
+};
+
+namespace impl {
+struct LoopThreadState;
+}
+
+// Watches the loop threads of core::run(). A watchdog thread posts probes
+// to every loop to measure how long handlers wait for its thread, samples
+// the stack of listeners that run too long and computes the handler rates.
+class LoopMonitor {
+    friend class impl::HandlerScope;
+public:
+    using Listener = std::function<void(const SlowHandlerReport&)>;
+private:
+    LoopMonitorOptions mOptions;
+    std::atomic<bool> mEnabled{false};
+    std::atomic<int64_t> slowThreshold{0};
+    std::mutex mutex;
+    std::vector<Listener> listeners;
+    // grows only, so stats stay valid
+    std::vector<std::unique_ptr<impl::LoopThreadState>> mThreads;
+    std::atomic<unsigned> activeThreads{0};
+    std::atomic<uint64_t> generation{0};
+    std::thread watchdog;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    // the signal the sampling handler is installed for while running, 0
+    // without backtraces, and the action it replaced
+    int sampleSignal = 0;
+    struct ::sigaction previousAction;
+public:
+    static LoopMonitor& instance();
+    ~LoopMonitor();
+    // takes effect with the next run()
+    void enable(LoopMonitorOptions options = LoopMonitorOptions());
+    void disable();
+    bool enabled() const { return mEnabled.load(std::memory_order_relaxed); }
+    const LoopMonitorOptions& options() const { return mOptions; }
+    // listener runs on the loop thread right after the slow listener
+    void onSlowHandler(Listener listener);
+    // the threads of the current or last run()
+    size_t threads() const { return activeThreads.load(std::memory_order_acquire); }
+    const LoopThreadStats& thread(size_t index) const;
+public: // used by core::run
+    // one thread per io_service, thread i runs services[i]
+    void start(const std::vector<boost::asio::io_service*>& services);
+    void runThread(unsigned index);
+    void stop();
+private:
+    LoopMonitor();
+    void watch();
+    void report(impl::LoopThreadState& thread, const std::type_info& event,
+                const std::type_info& handler, int64_t duration);
+};
+
+} // namespace metrics
+} // namespace nodecxx
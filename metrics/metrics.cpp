@@ -0,0 +1,104 @@
+#include "metrics.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+namespace nodecxx {
+namespace metrics {
+
+namespace impl {
+
+unsigned assignShard() {
+    static std::atomic<unsigned> next{0};
+    return next.fetch_add(1, std::memory_order_relaxed) % maxShards;
+}
+
+} // namespace impl
+
+uint64_t Counter::value() const {
+    uint64_t res = 0;
+    for (const auto& c : cells) {
+        res += c.value.load(std::memory_order_relaxed);
+    }
+    return res;
+}
+
+int64_t Gauge::value() const {
+    int64_t res = 0;
+    for (const auto& c : cells) {
+        res += c.value.load(std::memory_order_relaxed);
+    }
+    return res;
+}
+
+uint64_t HistogramSnapshot::percentile(double q) const {
+    if (count == 0) return 0;
+    auto rank = uint64_t(std::ceil(std::min(std::max(q, 0.0), 1.0) * count));
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return std::min(Histogram::upperBound(i), max);
+        }
+    }
+    return max;
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other) {
+    if (counts.size() < other.counts.size()) {
+        counts.resize(other.counts.size());
+    }
+    for (size_t i = 0; i < other.counts.size(); ++i) {
+        counts[i] += other.counts[i];
+    }
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+}
+
+Histogram::~Histogram() {
+    for (auto& s : shards) {
+        delete s.load(std::memory_order_relaxed);
+    }
+}
+
+Histogram::Shard* Histogram::allocate() {
+    auto& slot = shards[impl::shardIndex()];
+    // value-initialized, all zero
+    auto res = new Shard();
+    Shard* expected = nullptr;
+    if (!slot.compare_exchange_strong(expected, res, std::memory_order_acq_rel)) {
+        // another thread on the same shard was faster
+        delete res;
+        return expected;
+    }
+    return res;
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot res;
+    snapshot(res);
+    return res;
+}
+
+void Histogram::snapshot(HistogramSnapshot& res) const {
+    res.counts.assign(buckets, 0);
+    res.count = 0;
+    res.sum = 0;
+    res.max = 0;
+    for (const auto& slot : shards) {
+        auto s = slot.load(std::memory_order_acquire);
+        if (s == nullptr) continue;
+        for (unsigned i = 0; i < buckets; ++i) {
+            auto n = s->counts[i].load(std::memory_order_relaxed);
+            res.counts[i] += n;
+            res.count += n;
+        }
+        res.sum += s->sum.load(std::memory_order_relaxed);
+        res.max = std::max(res.max, s->max.load(std::memory_order_relaxed));
+    }
+}
+
+} // namespace metrics
+} // namespace nodecxx
@@ -0,0 +1,126 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace nodecxx {
+namespace metrics {
+
+namespace impl {
+
+// Every thread records into a shard of its own, threads beyond maxShards
+// share one. Readers sum up the shards, writers never synchronize.
+constexpr unsigned maxShards = 64;
+
+unsigned assignShard();
+
+inline unsigned shardIndex() {
+    static thread_local unsigned index = maxShards;
+    if (__builtin_expect(index == maxShards, 0)) {
+        index = assignShard();
+    }
+    return index;
+}
+
+} // namespace impl
+
+// A monotonic counter
+class Counter {
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Cell, impl::maxShards> cells;
+public:
+    void add(uint64_t n = 1) {
+        cells[impl::shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+};
+
+// A value that goes up and down, like the number of open connections
+class Gauge {
+    struct alignas(64) Cell {
+        std::atomic<int64_t> value{0};
+    };
+    std::array<Cell, impl::maxShards> cells;
+public:
+    void add(int64_t n = 1) {
+        cells[impl::shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    void sub(int64_t n = 1) { add(-n); }
+    int64_t value() const;
+};
+
+struct HistogramSnapshot {
+    // recorded values per bucket, see Histogram::bucketOf
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    // The smallest value that at least q (0..1) of the recorded values are
+    // less or equal to, exact up to the bucket resolution
+    uint64_t percentile(double q) const;
+    double mean() const { return count ? double(sum) / count : 0.0; }
+    void merge(const HistogramSnapshot& other);
+};
+
+// A histogram with log-linear buckets like HdrHistogram: every power of two
+// is split into 16 buckets, which bounds the error to 1/16. Values up to
+// 2^41 are told apart, that is about 36 minutes in nanoseconds.
+class Histogram {
+public:
+    static constexpr unsigned subBucketBits = 4;
+    static constexpr unsigned subBuckets = 1u << subBucketBits;
+    static constexpr unsigned maxExponent = 40;
+    static constexpr unsigned buckets = subBuckets + (maxExponent - subBucketBits + 1) * subBuckets;
+private:
+    struct Shard {
+        std::atomic<uint64_t> counts[buckets];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+    // allocated by the first record() of a shard
+    std::array<std::atomic<Shard*>, impl::maxShards> shards{};
+public:
+    Histogram() {}
+    Histogram(const Histogram&) = delete;
+    Histogram& operator= (const Histogram&) = delete;
+    ~Histogram();
+    void record(uint64_t value) {
+        auto s = shards[impl::shardIndex()].load(std::memory_order_acquire);
+        if (__builtin_expect(s == nullptr, 0)) {
+            s = allocate();
+        }
+        s->counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        s->sum.fetch_add(value, std::memory_order_relaxed);
+        auto max = s->max.load(std::memory_order_relaxed);
+        while (value > max && !s->max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+    // merges the shards, the result may miss records that happen meanwhile
+    HistogramSnapshot snapshot() const;
+    // same, reuses the memory of into
+    void snapshot(HistogramSnapshot& into) const;
+    static unsigned bucketOf(uint64_t value) {
+        if (value < subBuckets) return unsigned(value);
+        unsigned exponent = 63 - __builtin_clzll(value);
+        if (exponent > maxExponent) return buckets - 1;
+        return (exponent - subBucketBits + 1) * subBuckets
+            + unsigned((value >> (exponent - subBucketBits)) & (subBuckets - 1));
+    }
+    // the smallest value of bucket
+    static uint64_t lowerBound(unsigned bucket) {
+        if (bucket < subBuckets) return bucket;
+        unsigned exponent = bucket / subBuckets + subBucketBits - 1;
+        return uint64_t(subBuckets + bucket % subBuckets) << (exponent - subBucketBits);
+    }
+    // the largest value of bucket
+    static uint64_t upperBound(unsigned bucket) {
+        return bucket + 1 < buckets ? lowerBound(bucket + 1) - 1 : UINT64_MAX;
+    }
+private:
+    Shard* allocate();
+};
+
+} // namespace metrics
+} // namespace nodecxx
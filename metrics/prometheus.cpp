@@ -0,0 +1,111 @@
+#include "prometheus.hpp"
+
+#include <cmath>
+#include <charconv>
+
+namespace nodecxx {
+namespace metrics {
+
+namespace {
+
+const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+const char* quantileLabels[] = { "quantile=\"0.5\"", "quantile=\"0.9\"", "quantile=\"0.99\"", "quantile=\"0.999\"" };
+
+} // anonymous namespace
+
+void PrometheusText::begin() {
+    if (!buffer || buffer.use_count() > 1) {
+        buffer = std::make_shared<std::string>();
+        buffer->reserve(16 * 1024);
+    }
+    buffer->clear();
+}
+
+Buffer PrometheusText::finish() const {
+    return Buffer(buffer->data(), buffer->size(), buffer);
+}
+
+void PrometheusText::family(const char* name, const char* type, const char* help) {
+    auto& out = *buffer;
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void PrometheusText::sample(const char* name, const char* labels, uint64_t value) {
+    sampleName(name, nullptr, labels);
+    number(value);
+    *buffer += '\n';
+}
+
+void PrometheusText::sample(const char* name, const char* labels, int64_t value) {
+    sampleName(name, nullptr, labels);
+    number(value);
+    *buffer += '\n';
+}
+
+void PrometheusText::sample(const char* name, const char* labels, double value) {
+    sampleName(name, nullptr, labels);
+    number(value);
+    *buffer += '\n';
+}
+
+void PrometheusText::summary(const char* name, const char* labels, const Histogram& histogram, double scale) {
+    histogram.snapshot(scratch);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+        sampleName(name, nullptr, labels, quantileLabels[i]);
+        number(scratch.count ? scratch.percentile(quantiles[i]) * scale : NAN);
+        *buffer += '\n';
+    }
+    sampleName(name, "_sum", labels);
+    number(scratch.sum * scale);
+    *buffer += '\n';
+    sampleName(name, "_count", labels);
+    number(scratch.count);
+    *buffer += '\n';
+}
+
+void PrometheusText::sampleName(const char* name, const char* suffix, const char* labels, const char* extraLabel) {
+    auto& out = *buffer;
+    out += name;
+    if (suffix) out += suffix;
+    if (labels || extraLabel) {
+        out += '{';
+        if (labels) out += labels;
+        if (labels && extraLabel) out += ',';
+        if (extraLabel) out += extraLabel;
+        out += '}';
+    }
+    out += ' ';
+}
+
+void PrometheusText::number(uint64_t value) {
+    char str[32];
+    auto res = std::to_chars(str, str + sizeof(str), value);
+    buffer->append(str, res.ptr);
+}
+
+void PrometheusText::number(int64_t value) {
+    char str[32];
+    auto res = std::to_chars(str, str + sizeof(str), value);
+    buffer->append(str, res.ptr);
+}
+
+void PrometheusText::number(double value) {
+    if (std::isnan(value)) {
+        *buffer += "NaN";
+        return;
+    }
+    char str[32];
+    auto res = std::to_chars(str, str + sizeof(str), value);
+    buffer->append(str, res.ptr);
+}
+
+} // namespace metrics
+} // namespace nodecxx
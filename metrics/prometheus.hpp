@@ -0,0 +1,39 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <net/buffer.hpp>
+#include "metrics.hpp"
+
+namespace nodecxx {
+namespace metrics {
+
+// Renders metrics in the Prometheus text exposition format. The text goes
+// to one buffer that is reused by the next scrape, unless the previous
+// result is still referenced, e.g. because it is still being sent.
+class PrometheusText {
+    std::shared_ptr<std::string> buffer;
+    HistogramSnapshot scratch;
+public:
+    // starts a new text
+    void begin();
+    // the text rendered since begin(), shares the buffer
+    Buffer finish() const;
+    // # HELP and # TYPE lines, once per metric name
+    void family(const char* name, const char* type, const char* help);
+    // labels is a list like `a="1",b="2"` or nullptr
+    void sample(const char* name, const char* labels, uint64_t value);
+    void sample(const char* name, const char* labels, int64_t value);
+    void sample(const char* name, const char* labels, double value);
+    // Writes a histogram as a summary of quantiles, _sum and _count. The
+    // values get multiplied by scale, e.g. 1e-9 for nanoseconds to seconds.
+    void summary(const char* name, const char* labels, const Histogram& histogram, double scale);
+private:
+    void sampleName(const char* name, const char* suffix, const char* labels, const char* extraLabel = nullptr);
+    void number(uint64_t value);
+    void number(int64_t value);
+    void number(double value);
+};
+
+} // namespace metrics
+} // namespace nodecxx
@@ -0,0 +1,45 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <boost/utility/string_ref.hpp>
+
+namespace nodecxx {
+
+// A read-only view of bytes together with a reference to whatever owns
+// them. Sockets send Buffers without copying, the owner is released once
+// the data went out.
+class Buffer {
+    const char* mData = nullptr;
+    size_t mSize = 0;
+    std::shared_ptr<const void> mOwner;
+public:
+    Buffer() {}
+    Buffer(const char* data, size_t size, std::shared_ptr<const void> owner)
+        : mData(data)
+        , mSize(size)
+        , mOwner(std::move(owner))
+    {}
+    // takes ownership of str
+    explicit Buffer(std::string str) {
+        auto owner = std::make_shared<std::string>(std::move(str));
+        mData = owner->data();
+        mSize = owner->size();
+        mOwner = std::move(owner);
+    }
+public:
+    const char* data() const { return mData; }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    const char* begin() const { return mData; }
+    const char* end() const { return mData + mSize; }
+    boost::string_ref view() const { return boost::string_ref(mData, mSize); }
+    const std::shared_ptr<const void>& owner() const { return mOwner; }
+    // a part of this buffer that shares its owner
+    Buffer slice(size_t offset, size_t length = std::string::npos) const {
+        if (offset > mSize) offset = mSize;
+        if (length > mSize - offset) length = mSize - offset;
+        return Buffer(mData + offset, length, mOwner);
+    }
+};
+
+} // namespace nodecxx
@@ -32,5 +32,29 @@ struct drain_t {
 
 constexpr drain_t drain;
 
+// a socket that was connected with Socket::connect is ready
+struct connect_t {
+    using function_type = std::function<void()>;
+    constexpr connect_t() {}
+};
+
+constexpr connect_t connect;
+
+// a readable stream has no more data
+struct end_t {
+    using function_type = std::function<void()>;
+    constexpr end_t() {}
+};
+
+constexpr end_t end;
+
+// a writable stream has written everything after end() was called
+struct finish_t {
+    using function_type = std::function<void()>;
+    constexpr finish_t() {}
+};
+
+constexpr finish_t finish;
+
 } // namespace nodecxx
 
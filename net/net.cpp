@@ -1,5 +1,11 @@
 #include "net.hpp"
 
 namespace nodecxx {
+
+SocketMetrics& socketMetrics() {
+    static SocketMetrics res;
+    return res;
+}
+
 } // namespace nodecxx
 
@@ -2,20 +2,50 @@
 #include <string>
 #include <memory>
 #include <functional>
-#include <queue>
+#include <deque>
+#include <optional>
+#include <utility>
 #include <cassert>
 #include <atomic>
 #include <iostream>
 
 #include <boost/asio.hpp>
+#include <sys/sendfile.h>
 
 #include "events.hpp"
 #include <events.hpp>
 #include <core.hpp>
+#include <loop.hpp>
+#include <ref.hpp>
 #include <json>
+#include <uring/uring.hpp>
+#include <metrics/metrics.hpp>
+#include <trace/trace.hpp>
+#include "buffer.hpp"
 
 namespace nodecxx {
 
+// what all sockets have queued for sending but not sent yet
+struct SocketMetrics {
+    metrics::Gauge queuedBytes;
+    metrics::Gauge queuedItems;
+};
+
+SocketMetrics& socketMetrics();
+
+namespace impl {
+
+// Notified once the data written before it was registered is sent, with
+// sent set, or when the connection closed first. See Socket::onFlushed.
+struct FlushWaiter {
+    FlushWaiter* nextWaiter = nullptr;
+    virtual void flushed(bool sent) = 0;
+protected:
+    ~FlushWaiter() {}
+};
+
+} // namespace impl
+
 template<class T>
 struct serializer {
     std::string operator() (const T& obj) const {
@@ -38,78 +68,301 @@ struct serializer<Json> {
     }
 };
 
+// A connection. It belongs to the loop of its io_service and is used on
+// the thread of that loop only. The socket holds a reference to itself
+// while it is open, pending operations and Refs keep it alive after it
+// got closed.
 template<class Protocol>
-class Socket : public EmittingEvents<close_t, data_t, error_t, drain_t> {
+class Socket : public RefCounted, public EmittingEvents<close_t, data_t, error_t, drain_t, connect_t> {
+    struct SendItem {
+        std::string data;
+        bool close;
+        // sent instead of data without copying, if isSlice is set
+        Buffer slice;
+        bool isSlice = false;
+        // file contents to send with sendfile, if fd != -1
+        int fd = -1;
+        uint64_t offset = 0;
+        size_t remaining = 0;
+        std::shared_ptr<const void> owner;
+        // the size counted in socketMetrics()
+        size_t accounted = 0;
+
+        SendItem(std::string data, bool close)
+            : data(std::move(data))
+            , close(close)
+        {}
+        const char* bytes() const { return isSlice ? slice.data() : data.data(); }
+        size_t size() const {
+            return fd != -1 ? remaining : isSlice ? slice.size() : data.size();
+        }
+    };
+    // at most this many queued items go out with one gather write
+    static constexpr size_t maxGather = 64;
+    boost::asio::io_service& ios;
     boost::asio::basic_stream_socket<Protocol> socket;
     std::vector<char> buffer;
-    std::queue<std::pair<std::string, bool>> sendBuffer;
+    std::deque<SendItem> sendBuffer;
+    std::vector<boost::asio::const_buffer> gatherBuffers;
     bool insideSend = false;
+    bool closed = false;
+    // writes are queued until connect() got through
+    bool connecting = false;
+    // set by pause(), no read is issued while it is
+    bool readPaused = false;
+    // a read was skipped because of pause(), resume() issues it
+    bool readStopped = false;
+    // set if reads and writes go through io_uring instead of the reactor
+    impl::UringService* uring;
+    impl::UringOp* pendingRead = nullptr;
+    impl::UringOp* pendingWrite = nullptr;
+    // notified when the send buffer runs empty or the socket closes
+    impl::FlushWaiter* flushWaiters = nullptr;
+    // run() stops the other loops once core::service() runs out of work, a
+    // socket of one of them keeps it busy while it is open
+    std::optional<boost::asio::executor_work_guard<boost::asio::io_service::executor_type>> mainWork;
 public:
-    Socket() : socket(core::service()) {}
+    // a socket of the current loop
+    Socket()
+        : Socket(core::currentService())
+    {}
+    explicit Socket(boost::asio::io_service& ios)
+        : ios(ios)
+        , socket(ios)
+        , uring(impl::UringService::get(ios))
+    {
+        // released by close()
+        addRef();
+        if (&ios != &core::service()) mainWork.emplace(core::service().get_executor());
+    }
 public: // functionality
     boost::asio::basic_stream_socket<Protocol>& native() { return socket; }
+    boost::asio::io_service& service() { return ios; }
+    // closed, writes are dropped
+    bool destroyed() const { return closed; }
+    // Stops reading after the data event in progress, the peer gets
+    // backpressure from TCP. resume() reads again.
+    void pause() { readPaused = true; }
+    void resume() {
+        readPaused = false;
+        if (std::exchange(readStopped, false)) do_read();
+    }
+    // Connects to the first address of host that accepts, emits connect
+    // and starts reading. Data written meanwhile is sent once connected,
+    // failures emit error and close the socket.
+    void connect(const std::string& port, const std::string& host);
     void close();
+    // same as close(), for code that handles streams and sockets alike
+    void destroy() { close(); }
+    // Calls waiter->flushed() once everything written so far is sent or
+    // the socket closed. Waiters are linked into the socket, nothing is
+    // allocated. Not for sockets that are closed already.
+    void onFlushed(impl::FlushWaiter* waiter) {
+        waiter->nextWaiter = flushWaiters;
+        flushWaiters = waiter;
+    }
     size_t bufferSize() const {
         size_t res = 0;
         for (const auto& b: sendBuffer) {
             res += b.size();
         }
+        return res;
     }
     template<class B>
     void write(B&& data) {
+        if (closed) return;
         serializer<typename std::remove_const<typename std::remove_reference<B>::type>::type> ser;
-        sendBuffer.emplace(ser(std::forward<B>(data)), false);
+        sendBuffer.emplace_back(ser(std::forward<B>(data)), false);
+        enqueued();
         do_send();
     }
     template<class B>
     void end(B&& data) {
+        if (closed) return;
         serializer<typename std::remove_const<typename std::remove_reference<B>::type>::type> ser;
-        sendBuffer.emplace(ser(std::forward<B>(data)), true);
-        if (sendBuffer.size() == 1) do_send();
+        sendBuffer.emplace_back(ser(std::forward<B>(data)), true);
+        enqueued();
+        do_send();
+    }
+    // Queues data without copying it
+    void write(Buffer data) {
+        queue(std::move(data), false);
+    }
+    void end(Buffer data) {
+        queue(std::move(data), true);
+    }
+    // Sends length bytes of the file fd, starting at offset, with
+    // sendfile(2). owner is kept alive until the data is sent, it should
+    // own the file descriptor.
+    void sendFile(int fd, uint64_t offset, size_t length, std::shared_ptr<const void> owner) {
+        if (closed) return;
+        sendBuffer.emplace_back(std::string(), false);
+        auto& item = sendBuffer.back();
+        item.fd = fd;
+        item.offset = offset;
+        item.remaining = length;
+        item.owner = std::move(owner);
+        enqueued();
+        do_send();
+    }
+private:
+    void queue(Buffer data, bool close) {
+        if (closed) return;
+        sendBuffer.emplace_back(std::string(), close);
+        sendBuffer.back().slice = std::move(data);
+        sendBuffer.back().isSlice = true;
+        enqueued();
+        do_send();
+    }
+    void enqueued() {
+        auto& item = sendBuffer.back();
+        item.accounted = item.size();
+        auto& m = socketMetrics();
+        m.queuedBytes.add(item.accounted);
+        m.queuedItems.add();
+    }
+    void popFront() {
+        auto& m = socketMetrics();
+        m.queuedBytes.sub(sendBuffer.front().accounted);
+        m.queuedItems.sub();
+        sendBuffer.pop_front();
+    }
+    void notifyFlushed(bool sent) {
+        auto waiter = std::exchange(flushWaiters, nullptr);
+        while (waiter) {
+            // the waiter may free itself
+            auto next = waiter->nextWaiter;
+            waiter->flushed(sent);
+            waiter = next;
+        }
     }
 public:
     void do_read()
     {
-        if (!socket.is_open()) return;
+        if (closed || !socket.is_open()) return;
         buffer.resize(1024);
-        // TODO: this might not be safe
+        if (uring) {
+            pendingRead = uring->async_recv(socket.native_handle(), buffer.data(), buffer.size(),
+                    [this, self = Ref<Socket>(this)](const boost::system::error_code& ec, size_t bt) {
+                pendingRead = nullptr;
+                on_read(ec, bt);
+            });
+            return;
+        }
         socket.async_read_some(boost::asio::buffer(buffer),
-                [this](const boost::system::error_code& ec, size_t bt) {
-            if (check_error(ec)) return;
-            buffer.resize(bt);
-            fireEvent(data, buffer.data(), buffer.size());
-            do_read();
+                [this, self = Ref<Socket>(this)](const boost::system::error_code& ec, size_t bt) {
+            on_read(ec, bt);
         });
     }
+private:
+    // the handler that calls it holds a reference, listeners may close
+    // the socket
+    void on_read(const boost::system::error_code& ec, size_t bt) {
+        if (closed || check_error(ec)) return;
+        buffer.resize(bt);
+        fireEvent(data, buffer.data(), buffer.size());
+        if (closed) return;
+        if (readPaused) {
+            readStopped = true;
+            return;
+        }
+        do_read();
+    }
 private:
     bool check_error(const boost::system::error_code& ec) {
         if (!ec) return false;
         fireEvent(error, ec);
-        fireEvent(::nodecxx::close, true);
-        if (socket.is_open())
-            socket.close();
-        else
-            delete this;
+        do_close(true);
         return true;
     }
+    void do_close(bool hadError);
     void do_send()
     {
-        if (insideSend) return;
+        if (insideSend || closed || connecting) return;
         insideSend = true;
-        boost::asio::async_write(socket, boost::asio::buffer(sendBuffer.front().first), [this](const boost::system::error_code& ec, size_t) {
-            if (check_error(ec)) return;
-            if (sendBuffer.front().second) {
-                close();
+        if (sendBuffer.front().fd != -1) {
+            do_sendfile();
+            return;
+        }
+        if (uring) {
+            uring_send(0);
+            return;
+        }
+        // everything queued up to the next file goes out in one write
+        gatherBuffers.clear();
+        for (const auto& item : sendBuffer) {
+            if (item.fd != -1 || gatherBuffers.size() == maxGather) break;
+            gatherBuffers.emplace_back(item.bytes(), item.size());
+            if (item.close) break;
+        }
+        boost::asio::async_write(socket, gatherBuffers,
+                [this, self = Ref<Socket>(this), count = gatherBuffers.size()](const boost::system::error_code& ec, size_t) {
+            if (closed || check_error(ec)) return;
+            sent(count);
+        });
+    }
+    // sends the front of the send buffer from offset on
+    void uring_send(size_t offset)
+    {
+        const auto& item = sendBuffer.front();
+        pendingWrite = uring->async_send(socket.native_handle(), item.bytes() + offset, item.size() - offset,
+                [this, self = Ref<Socket>(this), offset](const boost::system::error_code& ec, size_t bt) {
+            pendingWrite = nullptr;
+            if (closed || check_error(ec)) return;
+            if (offset + bt < sendBuffer.front().size()) {
+                uring_send(offset + bt);
             } else {
-                sendBuffer.pop();
-                insideSend = false;
-                if (sendBuffer.size()) do_send();
-                else {
-                    fireEvent(drain);
-                }
+                sent();
             }
         });
     }
+    void do_sendfile()
+    {
+        auto& item = sendBuffer.front();
+        boost::system::error_code ec;
+        socket.native_non_blocking(true, ec);
+        while (!ec && item.remaining > 0) {
+            off_t offset = item.offset;
+            auto res = ::sendfile(socket.native_handle(), item.fd, &offset, item.remaining);
+            if (res > 0) {
+                item.offset += res;
+                item.remaining -= res;
+            } else if (res == 0) {
+                // the file got truncated
+                ec = boost::asio::error::eof;
+            } else if (errno == EAGAIN) {
+                socket.async_wait(boost::asio::socket_base::wait_write,
+                        [this, self = Ref<Socket>(this)](const boost::system::error_code& ec) {
+                    if (closed || check_error(ec)) return;
+                    do_sendfile();
+                });
+                return;
+            } else if (errno != EINTR) {
+                ec = boost::system::error_code(errno, boost::system::system_category());
+            }
+        }
+        if (check_error(ec)) return;
+        sent();
+    }
+    // the first count items of the send buffer went out
+    void sent(size_t count = 1)
+    {
+        for (size_t i = 1; i < count; ++i) {
+            popFront();
+        }
+        if (sendBuffer.front().close) {
+            notifyFlushed(true);
+            close();
+        } else {
+            popFront();
+            insideSend = false;
+            if (sendBuffer.size()) do_send();
+            else {
+                notifyFlushed(true);
+                fireEvent(drain);
+            }
+        }
+    }
 };
 
 struct connection_t {
@@ -118,15 +371,28 @@ struct connection_t {
 
 constexpr connection_t connection;
 
+// Accepts connections on the loop it listens on and hands them to the
+// loops of core::loops() in turn. The connection callback runs on the loop
+// of the connection.
 template<class Protocol>
 class Server : public EmittingEvents<error_t> {
     std::function<void(Socket<Protocol>&)> callback;
     std::vector<typename Protocol::acceptor> acceptors;
+    size_t nextLoop = 0;
+    bool closed = false;
+    // accepted connections the callback did not get yet
+    std::atomic<size_t> mHandoffs{0};
 public:
     template<class Callback>
     Server(Callback&& callback) : callback(std::forward<Callback>(callback)) {}
     Server() {}
     void listen(const std::string& port, const std::string& host);
+    // Stops accepting, on the loop the server listens on. Connections
+    // accepted so far stay open.
+    void close();
+    // Connections that got accepted and are on their way to their loop,
+    // they are counted until the connection callback returned
+    size_t handoffs() const { return mHandoffs.load(std::memory_order_acquire); }
     template<class Callback>
     void on(connection_t, Callback&& callback)
     {
@@ -155,6 +421,7 @@ void Server<Protocol>::listen(const std::string& port, const std::string& host)
     auto strand = std::make_shared<boost::asio::io_service::strand>(core::service());
     resolver->async_resolve(typename Protocol::resolver::query(host, port),
         strand->wrap([this, resolver](const boost::system::error_code& ec, typename Protocol::resolver::iterator iterator) {
+            if (closed) return;
             typename Protocol::resolver::iterator end;
             for (; iterator != end; ++iterator) {
                 acceptors.emplace_back(core::service(), *iterator);
@@ -168,30 +435,90 @@ void Server<Protocol>::listen(const std::string& port, const std::string& host)
 template<class Protocol>
 void Server<Protocol>::do_accept(size_t acceptorPos)
 {
-    auto sock = new Socket<Protocol>();
-    acceptors[acceptorPos].async_accept(sock->native(), [this, sock, acceptorPos](const boost::system::error_code& ec) {
+    auto& loops = core::loops();
+    auto& loop = *loops[nextLoop++ % loops.size()];
+    auto sock = new Socket<Protocol>(loop.service());
+    acceptors[acceptorPos].async_accept(sock->native(), [this, sock, &loop, acceptorPos](const boost::system::error_code& ec) {
         if (ec) {
-            fireEvent(error, ec);
-            if (sock->native().is_open())
-                sock->close();
-            else
-                delete sock;
+            if (!closed) fireEvent(error, ec);
+            sock->close();
         } else {
-            callback(*sock);
-            sock->do_read();
+            trace::acceptConn(reinterpret_cast<uintptr_t>(sock));
+            mHandoffs.fetch_add(1, std::memory_order_relaxed);
+            loop.dispatch([this, sock]() {
+                callback(*sock);
+                mHandoffs.fetch_sub(1, std::memory_order_release);
+                sock->do_read();
+            });
             do_accept(acceptorPos);
         }
     });
 }
 
+template<class Protocol>
+void Server<Protocol>::close()
+{
+    closed = true;
+    boost::system::error_code ec;
+    // the pending accepts complete with operation_aborted
+    for (auto& acceptor : acceptors) {
+        acceptor.close(ec);
+    }
+}
+
+template<class Protocol>
+void Socket<Protocol>::connect(const std::string& port, const std::string& host)
+{
+    connecting = true;
+    auto resolver = std::make_shared<typename Protocol::resolver>(ios);
+    resolver->async_resolve(typename Protocol::resolver::query(host, port),
+        [this, self = Ref<Socket>(this), resolver](const boost::system::error_code& ec, typename Protocol::resolver::iterator iterator) {
+            if (closed || check_error(ec)) return;
+            boost::asio::async_connect(socket, iterator,
+                [this, self](const boost::system::error_code& ec, typename Protocol::resolver::iterator) {
+                    if (closed || check_error(ec)) return;
+                    connecting = false;
+                    this->fireEvent(::nodecxx::connect);
+                    if (closed) return;
+                    do_read();
+                    if (sendBuffer.size()) do_send();
+                });
+        });
+}
+
 template<class Protocol>
 void Socket<Protocol>::close()
 {
-    bool hadError = socket.is_open();
-    if (!hadError)
-        socket.close();
+    do_close(false);
+}
+
+template<class Protocol>
+void Socket<Protocol>::do_close(bool hadError)
+{
+    if (closed) return;
+    closed = true;
+    // nothing queued gets sent anymore. The items stay until the socket is
+    // freed, a cancelled io_uring send may still read them.
+    auto& m = socketMetrics();
+    for (auto& item : sendBuffer) {
+        m.queuedBytes.sub(item.accounted);
+        m.queuedItems.sub();
+        item.accounted = 0;
+    }
+    bool cancelled = true;
+    if (pendingRead && !uring->cancel(pendingRead)) cancelled = false;
+    if (pendingWrite && !uring->cancel(pendingWrite)) cancelled = false;
+    boost::system::error_code ec;
+    // completes the io_uring operations that could not be cancelled
+    if (!cancelled) socket.shutdown(Protocol::socket::shutdown_both, ec);
+    // cancels outstanding operations, they release their references
+    socket.close(ec);
+    notifyFlushed(false);
     this->fireEvent(::nodecxx::close, hadError);
-    delete this;
+    mainWork.reset();
+    // the reference of the open socket, the caller holds another one if it
+    // uses the socket afterwards
+    release();
 }
 
 } // namespace nodecxx
@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <boost/asio.hpp>
+#include <fs/fs.hpp>
+#include <net/net.hpp>
+#include "promise.hpp"
+
+namespace nodecxx {
+namespace promise {
+
+namespace impl {
+
+// resolves once the socket sent what was written before
+class FlushPromise final : public ::nodecxx::impl::FlushWaiter {
+    Promise<> promise;
+public:
+    explicit FlushPromise(Promise<> promise) : promise(std::move(promise)) {}
+    void flushed(bool sent) override {
+        if (sent) promise.resolve();
+        else promise.reject(boost::asio::error::operation_aborted);
+        delete this;
+    }
+};
+
+} // namespace impl
+
+// File::async_open. The promise belongs to the current loop and settles
+// there, also if the file uses the io_service of another loop.
+inline Promise<> open(::nodecxx::impl::File& file, const char* filename, const char* mode) {
+    Promise<> res;
+    file.async_open(filename, mode, [res](const boost::system::error_code& ec) mutable {
+        // moved, its references are only counted on its loop
+        auto& loop = res.loop();
+        loop.dispatch([res = std::move(res), ec]() {
+            if (ec) res.reject(ec);
+            else res.resolve();
+        });
+    });
+    return res;
+}
+
+// Writes data to socket, fulfilled once it is sent, rejected with
+// operation_aborted if the socket closed first
+template<class Protocol, class B>
+Promise<> write(Socket<Protocol>& socket, B&& data) {
+    Promise<> res;
+    socket.write(std::forward<B>(data));
+    if (socket.bufferSize() == 0) res.resolve();
+    else socket.onFlushed(new impl::FlushPromise(res));
+    return res;
+}
+
+// Fulfilled after duration on the current loop
+template<class Rep, class Period>
+Promise<> delay(std::chrono::duration<Rep, Period> duration) {
+    Promise<> res;
+    auto timer = std::make_unique<boost::asio::steady_timer>(res.loop().service(), duration);
+    auto& t = *timer;
+    t.async_wait([res, timer = std::move(timer)](const boost::system::error_code& ec) {
+        if (ec) res.reject(ec);
+        else res.resolve();
+    });
+    return res;
+}
+
+} // namespace promise
+} // namespace nodecxx
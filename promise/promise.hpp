@@ -0,0 +1,372 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/system/error_code.hpp>
+#include <loop.hpp>
+
+namespace nodecxx {
+
+template<class T = void>
+class Promise;
+
+namespace impl {
+
+// A move-only callable that is stored in place if it fits into Size bytes,
+// on the heap otherwise
+template<class Signature, size_t Size = 48>
+class SmallFunction;
+
+template<class R, class... A, size_t Size>
+class SmallFunction<R(A...), Size> {
+    enum class Op { move, destroy };
+    alignas(std::max_align_t) unsigned char storage[Size];
+    R (*invoker)(void*, A...) = nullptr;
+    // moves the callable from src to dst or destroys it in src
+    void (*manager)(Op, void* dst, void* src) = nullptr;
+    template<class F>
+    static constexpr bool fits = sizeof(F) <= Size && alignof(F) <= alignof(std::max_align_t)
+                                 && std::is_nothrow_move_constructible<F>::value;
+public:
+    SmallFunction() = default;
+    template<class F, class = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, SmallFunction>::value>::type>
+    SmallFunction(F&& f) {
+        using D = typename std::decay<F>::type;
+        if constexpr (fits<D>) {
+            new (storage) D(std::forward<F>(f));
+            invoker = [](void* p, A... args) -> R {
+                return (*static_cast<D*>(p))(std::forward<A>(args)...);
+            };
+            manager = [](Op op, void* dst, void* src) {
+                auto f = static_cast<D*>(src);
+                if (op == Op::move) new (dst) D(std::move(*f));
+                f->~D();
+            };
+        } else {
+            new (storage) D*(new D(std::forward<F>(f)));
+            invoker = [](void* p, A... args) -> R {
+                return (**static_cast<D**>(p))(std::forward<A>(args)...);
+            };
+            manager = [](Op op, void* dst, void* src) {
+                auto f = *static_cast<D**>(src);
+                if (op == Op::move) new (dst) D*(f);
+                else delete f;
+            };
+        }
+    }
+    SmallFunction(SmallFunction&& other) noexcept {
+        *this = std::move(other);
+    }
+    SmallFunction& operator= (SmallFunction&& other) noexcept {
+        if (this == &other) return *this;
+        reset();
+        if (other.manager) {
+            other.manager(Op::move, storage, other.storage);
+            invoker = std::exchange(other.invoker, nullptr);
+            manager = std::exchange(other.manager, nullptr);
+        }
+        return *this;
+    }
+    ~SmallFunction() {
+        reset();
+    }
+    void reset() {
+        if (manager) {
+            manager(Op::destroy, nullptr, storage);
+            invoker = nullptr;
+            manager = nullptr;
+        }
+    }
+    explicit operator bool() const { return invoker != nullptr; }
+    R operator()(A... args) {
+        return invoker(storage, std::forward<A>(args)...);
+    }
+};
+
+// the value of a Promise<void>
+struct Unit {};
+
+template<class T>
+using ValueOf = typename std::conditional<std::is_void<T>::value, Unit, T>::type;
+
+template<class T>
+struct IsPromise : std::false_type {};
+
+template<class T>
+struct IsPromise<Promise<T>> : std::true_type {};
+
+// the value type of the promise then() returns for a continuation that
+// returns R
+template<class R>
+struct Unwrap {
+    using type = R;
+};
+
+template<class T>
+struct Unwrap<Promise<T>> {
+    using type = T;
+};
+
+// Shared by the copies of a Promise. Only the thread of its loop touches
+// it, the reference count is not atomic.
+template<class T>
+struct PromiseState {
+    enum class Status { pending, fulfilled, rejected };
+    using Callback = SmallFunction<void(PromiseState&)>;
+
+    unsigned refs = 1;
+    Loop& loop;
+    Status status = Status::pending;
+    std::optional<ValueOf<T>> value;
+    boost::system::error_code error;
+    // most promises have a single continuation, it does not allocate
+    Callback first;
+    std::vector<Callback> more;
+
+    explicit PromiseState(Loop& loop) : loop(loop) {}
+
+    void retain() { ++refs; }
+    void release() {
+        if (--refs == 0) delete this;
+    }
+    void subscribe(Callback callback) {
+        if (status == Status::pending) {
+            if (!first) first = std::move(callback);
+            else more.push_back(std::move(callback));
+            return;
+        }
+        // settled already: the continuation runs after the caller returned,
+        // as it would have otherwise
+        retain();
+        loop.post([this, callback = std::move(callback)]() mutable {
+            callback(*this);
+            release();
+        });
+    }
+    void settle(Status result) {
+        status = result;
+        // a continuation may drop the last reference, or throw
+        struct Hold {
+            PromiseState* state;
+            ~Hold() { state->release(); }
+        } hold{this};
+        retain();
+        if (first) {
+            auto callback = std::move(first);
+            callback(*this);
+        }
+        auto callbacks = std::move(more);
+        for (auto& callback : callbacks) {
+            callback(*this);
+        }
+    }
+};
+
+} // namespace impl
+
+// A single-threaded promise, an alternative to nesting callbacks:
+//
+//   promise::open(file, "data.json", "r")
+//       .then([&]() { return query(...); })
+//       .then([&](Rows& rows) { resp.end(render(rows)); })
+//       .fail([&](const boost::system::error_code& ec) { resp.statusCode = 500; resp.end(ec.message()); });
+//
+// A promise belongs to the loop it was created on, or Loop::main() if it
+// was created outside of loop threads, and is resolved and used on the
+// thread of that loop only. Continuations run right when the promise
+// settles, without a trip through the loop; then() on a settled promise
+// posts the continuation to the loop instead. Continuations that capture
+// up to about 40 bytes are stored without allocating.
+//
+// Copies refer to the same promise. Errors are error codes like everywhere
+// else; an exception thrown by a continuation propagates out of whatever
+// settled the promise.
+template<class T>
+class Promise {
+    template<class> friend class Promise;
+    using State = impl::PromiseState<T>;
+    using Status = typename State::Status;
+    State* state;
+public:
+    using value_type = T;
+    // a pending promise of the current loop
+    Promise()
+        : state(new State(Loop::current() ? *Loop::current() : Loop::main()))
+    {}
+    explicit Promise(Loop& loop)
+        : state(new State(loop))
+    {}
+    Promise(const Promise& other)
+        : state(other.state)
+    {
+        state->retain();
+    }
+    Promise(Promise&& other) noexcept
+        : state(std::exchange(other.state, nullptr))
+    {}
+    Promise& operator= (Promise other) noexcept {
+        std::swap(state, other.state);
+        return *this;
+    }
+    ~Promise() {
+        if (state) state->release();
+    }
+    template<class... V>
+    static Promise resolved(V&&... value) {
+        Promise res;
+        res.resolve(std::forward<V>(value)...);
+        return res;
+    }
+    static Promise rejected(const boost::system::error_code& ec) {
+        Promise res;
+        res.reject(ec);
+        return res;
+    }
+public:
+    bool pending() const { return state->status == Status::pending; }
+    bool fulfilled() const { return state->status == Status::fulfilled; }
+    bool failed() const { return state->status == Status::rejected; }
+    Loop& loop() const { return state->loop; }
+    // Fulfills the promise with value, resolve() for Promise<void>. Does
+    // nothing if the promise settled already.
+    template<class... V>
+    void resolve(V&&... value) const {
+        if (!pending()) return;
+        state->value.emplace(std::forward<V>(value)...);
+        state->settle(Status::fulfilled);
+    }
+    void reject(const boost::system::error_code& ec) const {
+        if (!pending()) return;
+        state->error = ec;
+        state->settle(Status::rejected);
+    }
+    // Calls f with the value, f() for Promise<void>, once the promise is
+    // fulfilled. The returned promise gets what f returns, or what the
+    // promise that f returns gets, or the error this promise is rejected
+    // with.
+    template<class F>
+    auto then(F&& f) const {
+        using R = decltype(call(f, std::declval<State&>()));
+        Promise<typename impl::Unwrap<R>::type> next(state->loop);
+        state->subscribe([f = std::forward<F>(f), next](State& s) mutable {
+            if (s.status == Status::rejected) {
+                next.reject(s.error);
+                return;
+            }
+            if constexpr (impl::IsPromise<R>::value) {
+                call(f, s).pipe(next);
+            } else if constexpr (std::is_void<R>::value) {
+                call(f, s);
+                next.resolve();
+            } else {
+                next.resolve(call(f, s));
+            }
+        });
+        return next;
+    }
+    // Calls f with the error code once the promise is rejected. f recovers
+    // with a value, or a promise of one, the value passes through.
+    template<class F>
+    Promise fail(F&& f) const {
+        using R = decltype(f(std::declval<const boost::system::error_code&>()));
+        Promise next(state->loop);
+        state->subscribe([f = std::forward<F>(f), next](State& s) mutable {
+            if (s.status == Status::fulfilled) {
+                next.settleFrom(s);
+                return;
+            }
+            if constexpr (impl::IsPromise<R>::value) {
+                f(s.error).pipe(next);
+            } else if constexpr (std::is_void<R>::value) {
+                f(s.error);
+                next.resolve();
+            } else {
+                next.resolve(f(s.error));
+            }
+        });
+        return next;
+    }
+private:
+    template<class F>
+    static decltype(auto) call(F& f, State& s) {
+        if constexpr (std::is_void<T>::value) return f();
+        else return f(*s.value);
+    }
+    void settleFrom(State& s) const {
+        if (s.status == Status::rejected) {
+            reject(s.error);
+        } else if constexpr (std::is_void<T>::value) {
+            resolve();
+        } else {
+            resolve(*s.value);
+        }
+    }
+    // settles to the same as this promise
+    void pipe(const Promise& to) const {
+        state->subscribe([to](State& s) {
+            to.settleFrom(s);
+        });
+    }
+    template<class U>
+    friend auto all(const std::vector<Promise<U>>& promises);
+    template<class U>
+    friend Promise<U> race(const std::vector<Promise<U>>& promises);
+};
+
+// Fulfilled with the values of promises, in their order, once all of them
+// are, a Promise<void> for promises of void. Rejected with the first error.
+template<class T>
+auto all(const std::vector<Promise<T>>& promises) {
+    using Result = typename std::conditional<std::is_void<T>::value, void, std::vector<T>>::type;
+    Promise<Result> res;
+    if (promises.empty()) {
+        if constexpr (std::is_void<T>::value) res.resolve();
+        else res.resolve(Result());
+        return res;
+    }
+    struct Values {
+        std::vector<std::optional<impl::ValueOf<T>>> values;
+        size_t left;
+    };
+    auto values = std::make_shared<Values>();
+    values->values.resize(promises.size());
+    values->left = promises.size();
+    for (size_t i = 0; i < promises.size(); ++i) {
+        promises[i].state->subscribe([res, values, i](impl::PromiseState<T>& s) {
+            if (s.status == impl::PromiseState<T>::Status::rejected) {
+                res.reject(s.error);
+                return;
+            }
+            values->values[i] = *s.value;
+            if (--values->left) return;
+            if constexpr (std::is_void<T>::value) {
+                res.resolve();
+            } else {
+                Result result;
+                result.reserve(values->values.size());
+                for (auto& v : values->values) {
+                    result.push_back(std::move(*v));
+                }
+                res.resolve(std::move(result));
+            }
+        });
+    }
+    return res;
+}
+
+// settles like the first of promises that settles
+template<class T>
+Promise<T> race(const std::vector<Promise<T>>& promises) {
+    Promise<T> res;
+    for (auto& p : promises) {
+        p.pipe(res);
+    }
+    return res;
+}
+
+} // namespace nodecxx
@@ -0,0 +1,67 @@
+#pragma once
+#include <utility>
+#include <type_traits>
+
+namespace nodecxx {
+
+// Base of objects that are shared by the operations of one loop. The count
+// is not atomic: the object and every Ref to it belong to the thread of
+// that loop.
+class RefCounted {
+    unsigned refs = 0;
+public:
+    RefCounted() = default;
+    RefCounted(const RefCounted&) = delete;
+    RefCounted& operator= (const RefCounted&) = delete;
+    void addRef() { ++refs; }
+    void release() {
+        if (--refs == 0) delete this;
+    }
+protected:
+    virtual ~RefCounted() {}
+};
+
+// An intrusive reference, to any T with addRef() and release()
+template<class T>
+class Ref {
+    T* ptr = nullptr;
+public:
+    Ref() = default;
+    explicit Ref(T* ptr)
+        : ptr(ptr)
+    {
+        if (ptr) ptr->addRef();
+    }
+    Ref(const Ref& other)
+        : Ref(other.ptr)
+    {}
+    Ref(Ref&& other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr))
+    {}
+    Ref& operator= (Ref other) noexcept {
+        std::swap(ptr, other.ptr);
+        return *this;
+    }
+    ~Ref() {
+        if (ptr) ptr->release();
+    }
+    T* get() const { return ptr; }
+    T& operator* () const { return *ptr; }
+    T* operator-> () const { return ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+};
+
+// whether T has addRef() and release(), so a Ref<T> can hold it
+template<class T, class = void>
+struct IsRefCountable : std::false_type {};
+template<class T>
+struct IsRefCountable<T, std::void_t<decltype(std::declval<T&>().addRef()), decltype(std::declval<T&>().release())>>
+    : std::true_type {};
+
+// Ref<T>(&obj) with T deduced
+template<class T>
+Ref<T> makeRef(T& obj) {
+    return Ref<T>(&obj);
+}
+
+} // namespace nodecxx
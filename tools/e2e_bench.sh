@@ -0,0 +1,48 @@
+#!/bin/bash
+# Runs nodecxx_loadgen against the sample server (main.cpp) on loopback and
+# collects the results as JSON, one file per configuration.
+#
+# usage: tools/e2e_bench.sh <build dir> [output dir]
+#   DURATION=<s>  seconds every configuration is measured (10)
+#   RATE=<n>      requests per second of the open loop runs (20000)
+set -e
+
+BUILD=${1:?usage: $0 <build dir> [output dir]}
+OUT=${2:-e2e-results}
+DURATION=${DURATION:-10}
+RATE=${RATE:-20000}
+HERE=$(cd "$(dirname "$0")" && pwd)
+PORT=8713
+
+for bin in node nodecxx_loadgen; do
+    if [ ! -x "$BUILD/$bin" ]; then
+        echo "$BUILD/$bin is missing, build the targets node and nodecxx_loadgen first" >&2
+        exit 1
+    fi
+done
+mkdir -p "$OUT"
+
+"$BUILD/node" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; wait $SERVER 2>/dev/null' EXIT
+
+for i in $(seq 50); do
+    if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then break; fi
+    sleep 0.1
+done
+
+run() {
+    local name=$1
+    shift
+    echo "== $name"
+    "$BUILD/nodecxx_loadgen" --duration="$DURATION" --json="$OUT/$name.json" "$@" http://127.0.0.1:$PORT/
+}
+
+run closed-c1         --connections=1
+run closed-c64        --connections=64
+run pipelined-c64-p16 --connections=64 --pipeline=16
+run no-keepalive-c16  --connections=16 --no-keepalive
+run open-c64          --connections=64 --rate="$RATE"
+run scenario-c64      --connections=64 --scenario="$HERE/scenarios/mixed.json"
+
+echo "results in $OUT"
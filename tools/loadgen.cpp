@@ -0,0 +1,547 @@
+// nodecxx_loadgen: an HTTP/1.1 load generator on the Socket layer of nodecxx.
+//
+// Closed loop (the default), every connection keeps --pipeline requests in
+// flight and sends the next one as soon as a response arrives. Open loop
+// (--rate), requests are due at a fixed rate no matter how fast responses
+// come. Their latency is measured from the time they were due, not from
+// when they could be sent, so a stalled server shows up in the percentiles
+// instead of slowing the load down (coordinated omission).
+#include <core.hpp>
+#include <net/net.hpp>
+#include <http/http_parser.h>
+#include <metrics/metrics.hpp>
+#include <json>
+
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+using namespace boost::asio;
+using namespace nodecxx;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string host = "localhost";
+    std::string port = "8713";
+    std::string path = "/";
+    unsigned connections = 16;
+    unsigned pipeline = 1;
+    // requests per second over all connections, 0 for closed loop
+    double rate = 0;
+    double duration = 10;
+    double warmup = 1;
+    bool keepAlive = true;
+    std::string scenario;
+    std::string jsonOut;
+};
+
+// a kind of request of the scenario, rendered once
+struct Shape {
+    std::string name;
+    unsigned weight = 1;
+    Buffer wire;
+    uint64_t completed = 0;
+};
+
+struct Stats {
+    // nanoseconds from when a request was due (open loop) or sent
+    metrics::Histogram latency;
+    // nanoseconds from when a request was written to the socket
+    metrics::Histogram serviceTime;
+    uint64_t completed = 0;
+    uint64_t statusClass[6] = {};
+    uint64_t bytesRead = 0;
+    uint64_t connects = 0;
+    uint64_t connectErrors = 0;
+    uint64_t socketErrors = 0;
+    uint64_t parseErrors = 0;
+    // in flight when their connection went away
+    uint64_t failed = 0;
+    // due or in flight when the run ended
+    uint64_t unfinished = 0;
+};
+
+std::string render(const Options& options, const std::string& method, const std::string& path,
+                   const std::vector<std::pair<std::string, std::string>>& headers, const std::string& body) {
+    std::ostringstream ss;
+    ss << method << ' ' << path << " HTTP/1.1\r\n"
+       << "Host: " << options.host << ':' << options.port << "\r\n";
+    for (const auto& h : headers) {
+        ss << h.first << ": " << h.second << "\r\n";
+    }
+    if (!body.empty() || method == "POST" || method == "PUT") {
+        ss << "Content-Length: " << body.size() << "\r\n";
+    }
+    if (!options.keepAlive) {
+        ss << "Connection: close\r\n";
+    }
+    ss << "\r\n" << body;
+    return ss.str();
+}
+
+// A scenario file is a JSON object with a list of requests:
+// { "requests": [ { "name": "index", "weight": 4, "method": "GET",
+//   "path": "/", "headers": { "Accept": "*/*" }, "body": "" }, ... ] }
+// Everything but path is optional.
+bool loadScenario(const Options& options, std::vector<Shape>& shapes, std::string& err) {
+    std::ifstream in(options.scenario);
+    if (!in) {
+        err = "cannot read " + options.scenario;
+        return false;
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    auto json = Json::parse(text.str(), err);
+    if (!err.empty()) return false;
+    for (const auto& r : json["requests"].array_items()) {
+        if (!r["path"].is_string()) {
+            err = "every request needs a path";
+            return false;
+        }
+        std::vector<std::pair<std::string, std::string>> headers;
+        for (const auto& h : r["headers"].object_items()) {
+            headers.emplace_back(h.first, h.second.string_value());
+        }
+        Shape shape;
+        auto method = r["method"].is_string() ? r["method"].string_value() : "GET";
+        shape.name = r["name"].is_string() ? r["name"].string_value() : method + " " + r["path"].string_value();
+        shape.weight = r["weight"].is_number() ? unsigned(std::max(1, r["weight"].int_value())) : 1;
+        shape.wire = Buffer(render(options, method, r["path"].string_value(), headers, r["body"].string_value()));
+        shapes.push_back(std::move(shape));
+    }
+    if (shapes.empty()) {
+        err = "no requests in " + options.scenario;
+        return false;
+    }
+    return true;
+}
+
+// The order in which shapes are sent, every shape as often as its weight
+// and spread out evenly (smooth weighted round robin)
+std::vector<unsigned> mixSchedule(const std::vector<Shape>& shapes) {
+    std::vector<unsigned> res;
+    std::vector<long> current(shapes.size(), 0);
+    long total = 0;
+    for (const auto& s : shapes) total += s.weight;
+    for (long n = 0; n < total; ++n) {
+        unsigned best = 0;
+        for (unsigned i = 0; i < shapes.size(); ++i) {
+            current[i] += shapes[i].weight;
+            if (current[i] > current[best]) best = i;
+        }
+        current[best] -= total;
+        res.push_back(best);
+    }
+    return res;
+}
+
+class Loadgen;
+
+class Connection {
+    struct InFlight {
+        unsigned shape;
+        int64_t due;
+        int64_t sent;
+    };
+    Loadgen& gen;
+    Socket<ip::tcp>* socket = nullptr;
+    ::http_parser parser;
+    bool connected = false;
+    // requests sent over the current socket
+    uint64_t requests = 0;
+    steady_timer retry;
+    std::deque<InFlight> inFlight;
+    // open loop: due times of requests not sent yet
+    std::deque<int64_t> backlog;
+public:
+    // open loop: when the next request becomes due
+    int64_t nextDue = 0;
+public:
+    explicit Connection(Loadgen& gen)
+        : gen(gen)
+        , retry(core::service())
+    {}
+    void open();
+    void close();
+    void due(int64_t time) {
+        backlog.push_back(time);
+        pump();
+    }
+    void pump();
+    size_t unfinished() const { return backlog.size() + inFlight.size(); }
+private:
+    void onData(const char* data, size_t size);
+    void onClose();
+    void completed(int status);
+    static const ::http_parser_settings& settings();
+};
+
+class Loadgen {
+public:
+    const Options& options;
+    std::vector<Shape>& shapes;
+    std::vector<unsigned> schedule;
+    uint64_t sent = 0;
+    Stats stats;
+    int64_t start = 0;
+    int64_t measureFrom = 0;
+    int64_t stopAt = 0;
+    bool stopping = false;
+private:
+    std::vector<std::unique_ptr<Connection>> connections;
+    steady_timer timer;
+public:
+    Loadgen(const Options& options, std::vector<Shape>& shapes)
+        : options(options)
+        , shapes(shapes)
+        , schedule(mixSchedule(shapes))
+        , timer(core::service())
+    {}
+    unsigned nextShape() {
+        return schedule[sent++ % schedule.size()];
+    }
+    bool measuring(int64_t time) const {
+        return time >= measureFrom;
+    }
+    void run() {
+        start = now();
+        measureFrom = start + int64_t(options.warmup * 1e9);
+        stopAt = measureFrom + int64_t(options.duration * 1e9);
+        for (unsigned i = 0; i < options.connections; ++i) {
+            connections.emplace_back(new Connection(*this));
+            // open loop connections take turns, together they send at rate
+            if (options.rate > 0) {
+                connections.back()->nextDue = start + int64_t(i * 1e9 / options.rate);
+            }
+            connections.back()->open();
+        }
+        tick();
+        ::nodecxx::run();
+    }
+    double interval() const {
+        return options.connections * 1e9 / options.rate;
+    }
+private:
+    // makes the requests that became due and waits for the next one, or for
+    // the end of the run in closed loop mode
+    void tick() {
+        auto t = now();
+        if (t >= stopAt) {
+            stop();
+            return;
+        }
+        auto next = stopAt;
+        if (options.rate > 0) {
+            for (auto& c : connections) {
+                while (c->nextDue <= t) {
+                    auto due = c->nextDue;
+                    c->nextDue = due + int64_t(interval());
+                    c->due(due);
+                }
+                next = std::min(next, c->nextDue);
+            }
+        }
+        timer.expires_at(Clock::time_point(std::chrono::nanoseconds(next)));
+        timer.async_wait([this](const boost::system::error_code& ec) {
+            if (!ec) tick();
+        });
+    }
+    void stop() {
+        stopping = true;
+        for (auto& c : connections) {
+            stats.unfinished += c->unfinished();
+            c->close();
+        }
+    }
+};
+
+void Connection::open() {
+    socket = new Socket<ip::tcp>();
+    requests = 0;
+    ::http_parser_init(&parser, HTTP_RESPONSE);
+    parser.data = this;
+    socket->on(::nodecxx::connect, [this]() {
+        connected = true;
+        ++gen.stats.connects;
+        pump();
+    });
+    socket->on(::nodecxx::data, [this](const char* data, size_t size) { onData(data, size); });
+    socket->on(::nodecxx::error, [this](const boost::system::error_code& ec) {
+        if (!connected) {
+            ++gen.stats.connectErrors;
+        } else if (ec != error::eof || !inFlight.empty()) {
+            ++gen.stats.socketErrors;
+        }
+    });
+    socket->on(::nodecxx::close, [this](bool) { onClose(); });
+    socket->connect(gen.options.port, gen.options.host);
+}
+
+void Connection::close() {
+    retry.cancel();
+    if (socket) socket->close();
+}
+
+void Connection::pump() {
+    if (!connected || gen.stopping) return;
+    while (inFlight.size() < gen.options.pipeline) {
+        // the server closes the connection after the response
+        if (!gen.options.keepAlive && requests > 0) break;
+        int64_t due;
+        if (gen.options.rate > 0) {
+            if (backlog.empty()) break;
+            due = backlog.front();
+            backlog.pop_front();
+        } else {
+            due = now();
+        }
+        auto shape = gen.nextShape();
+        inFlight.push_back(InFlight{ shape, due, now() });
+        ++requests;
+        // requests sent in one go leave in one gather write
+        socket->write(gen.shapes[shape].wire);
+    }
+}
+
+void Connection::onData(const char* data, size_t size) {
+    gen.stats.bytesRead += size;
+    auto n = ::http_parser_execute(&parser, &settings(), data, size);
+    if (socket && (n != size || HTTP_PARSER_ERRNO(&parser) != HPE_OK)) {
+        ++gen.stats.parseErrors;
+        socket->close();
+    }
+}
+
+const ::http_parser_settings& Connection::settings() {
+    static const ::http_parser_settings res = [] {
+        ::http_parser_settings s;
+        std::memset(&s, 0, sizeof(s));
+        s.on_message_complete = [](::http_parser* p) {
+            static_cast<Connection*>(p->data)->completed(int(p->status_code));
+            return 0;
+        };
+        return s;
+    }();
+    return res;
+}
+
+void Connection::completed(int status) {
+    if (inFlight.empty()) return;
+    auto r = inFlight.front();
+    inFlight.pop_front();
+    auto t = now();
+    if (gen.measuring(r.due) && t < gen.stopAt) {
+        auto& s = gen.stats;
+        s.latency.record(uint64_t(t - r.due));
+        s.serviceTime.record(uint64_t(t - r.sent));
+        ++s.completed;
+        ++s.statusClass[std::min(status / 100, 5)];
+        ++gen.shapes[r.shape].completed;
+    }
+    pump();
+}
+
+void Connection::onClose() {
+    socket = nullptr;
+    auto wasConnected = connected;
+    connected = false;
+    gen.stats.failed += gen.stopping ? 0 : inFlight.size();
+    // open loop requests that were sent are lost, the backlog waits for
+    // the next connection
+    inFlight.clear();
+    if (gen.stopping) return;
+    if (!wasConnected) {
+        // the server is not there (yet), do not hammer it
+        retry.expires_from_now(std::chrono::milliseconds(100));
+        retry.async_wait([this](const boost::system::error_code& ec) {
+            if (!ec && !gen.stopping) open();
+        });
+        return;
+    }
+    // not from within the listeners of the old socket
+    core::service().post([this]() {
+        if (!gen.stopping && !socket) open();
+    });
+}
+
+void printLatency(const char* title, const metrics::HistogramSnapshot& h) {
+    std::printf("%s\n", title);
+    std::printf("  %8s %8s %8s %8s %8s %8s %8s\n", "mean", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    auto ms = [](double ns) { return ns / 1e6; };
+    std::printf("  %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f  ms\n",
+                ms(h.mean()), ms(h.percentile(0.5)), ms(h.percentile(0.9)), ms(h.percentile(0.99)),
+                ms(h.percentile(0.999)), ms(h.percentile(0.9999)), ms(h.max));
+}
+
+Json latencyJson(const metrics::HistogramSnapshot& h) {
+    return Json::object {
+        { "mean_ns", h.mean() },
+        { "p50_ns", double(h.percentile(0.5)) },
+        { "p90_ns", double(h.percentile(0.9)) },
+        { "p99_ns", double(h.percentile(0.99)) },
+        { "p999_ns", double(h.percentile(0.999)) },
+        { "p9999_ns", double(h.percentile(0.9999)) },
+        { "max_ns", double(h.max) },
+    };
+}
+
+bool report(const Loadgen& gen) {
+    const auto& o = gen.options;
+    const auto& s = gen.stats;
+    auto latency = s.latency.snapshot();
+    auto serviceTime = s.serviceTime.snapshot();
+    double rps = s.completed / o.duration;
+    auto mode = o.rate > 0 ? "open loop at " + std::to_string(int64_t(o.rate)) + " req/s" : std::string("closed loop");
+    std::printf("%s:%s, %u connections, pipeline %u, %s, %.1fs after %.1fs warmup\n",
+                o.host.c_str(), o.port.c_str(), o.connections, o.pipeline, mode.c_str(), o.duration, o.warmup);
+    std::printf("  %llu requests, %.1f req/s, %.2f MB/s read\n",
+                static_cast<unsigned long long>(s.completed), rps, s.bytesRead / 1e6 / (o.duration + o.warmup));
+    std::printf("  status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n",
+                static_cast<unsigned long long>(s.statusClass[2]), static_cast<unsigned long long>(s.statusClass[3]),
+                static_cast<unsigned long long>(s.statusClass[4]), static_cast<unsigned long long>(s.statusClass[5]));
+    std::printf("  connects %llu, connect errors %llu, socket errors %llu, parse errors %llu, failed %llu\n",
+                static_cast<unsigned long long>(s.connects), static_cast<unsigned long long>(s.connectErrors),
+                static_cast<unsigned long long>(s.socketErrors), static_cast<unsigned long long>(s.parseErrors),
+                static_cast<unsigned long long>(s.failed));
+    if (s.unfinished > 0) {
+        // an open loop run the server could not keep up with
+        std::printf("  %llu requests not done at the end are missing from the latencies\n",
+                    static_cast<unsigned long long>(s.unfinished));
+    }
+    if (gen.shapes.size() > 1) {
+        for (const auto& shape : gen.shapes) {
+            std::printf("  %-32s %llu\n", shape.name.c_str(), static_cast<unsigned long long>(shape.completed));
+        }
+    }
+    if (o.rate > 0) {
+        printLatency("latency from when requests were due (corrected for coordinated omission)", latency);
+        printLatency("latency from when requests were sent (uncorrected)", serviceTime);
+    } else {
+        printLatency("latency", latency);
+    }
+    if (o.jsonOut.empty()) return true;
+    Json::array shapes;
+    for (const auto& shape : gen.shapes) {
+        shapes.push_back(Json::object { { "name", shape.name }, { "completed", double(shape.completed) } });
+    }
+    auto json = Json(Json::object {
+        { "host", o.host },
+        { "port", o.port },
+        { "connections", int(o.connections) },
+        { "pipeline", int(o.pipeline) },
+        { "keep_alive", o.keepAlive },
+        { "rate", o.rate },
+        { "duration", o.duration },
+        { "requests", double(s.completed) },
+        { "requests_per_second", rps },
+        { "bytes_read", double(s.bytesRead) },
+        { "status_2xx", double(s.statusClass[2]) },
+        { "status_3xx", double(s.statusClass[3]) },
+        { "status_4xx", double(s.statusClass[4]) },
+        { "status_5xx", double(s.statusClass[5]) },
+        { "connects", double(s.connects) },
+        { "errors", double(s.connectErrors + s.socketErrors + s.parseErrors + s.failed) },
+        { "unfinished", double(s.unfinished) },
+        { "latency", latencyJson(latency) },
+        { "service_time", latencyJson(serviceTime) },
+        { "shapes", shapes },
+    });
+    std::ofstream out(o.jsonOut);
+    out << json.dump() << '\n';
+    if (!out) {
+        std::cerr << "cannot write " << o.jsonOut << '\n';
+        return false;
+    }
+    return true;
+}
+
+// http://host[:port][/path]
+bool parseUrl(const std::string& url, Options& options) {
+    const std::string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0) return false;
+    auto rest = url.substr(scheme.size());
+    auto slash = rest.find('/');
+    auto authority = rest.substr(0, slash);
+    options.path = slash == std::string::npos ? "/" : rest.substr(slash);
+    auto colon = authority.rfind(':');
+    if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+        options.port = authority.substr(colon + 1);
+        authority.resize(colon);
+    }
+    if (authority.size() > 1 && authority.front() == '[' && authority.back() == ']') {
+        authority = authority.substr(1, authority.size() - 2);
+    }
+    options.host = authority;
+    return !options.host.empty() && !options.port.empty();
+}
+
+void usage(const char* name) {
+    std::cerr << "usage: " << name << " [options] [http://host:port/path]\n"
+              << "  --connections=<n>   connections to keep open (16)\n"
+              << "  --pipeline=<n>      requests in flight per connection (1)\n"
+              << "  --rate=<n>          open loop with n requests per second over all connections\n"
+              << "  --duration=<s>      seconds to measure (10)\n"
+              << "  --warmup=<s>        seconds to run before measuring (1)\n"
+              << "  --no-keepalive      a new connection for every request\n"
+              << "  --scenario=<file>   the requests to mix, see tools/scenarios/\n"
+              << "  --json=<file>       also write the results as JSON\n";
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&arg](const char* option) -> const char* {
+            auto len = std::strlen(option);
+            return arg.compare(0, len, option) == 0 ? arg.c_str() + len : nullptr;
+        };
+        if (auto v = value("--connections=")) options.connections = unsigned(std::max(1, std::atoi(v)));
+        else if (auto v = value("--pipeline=")) options.pipeline = unsigned(std::max(1, std::atoi(v)));
+        else if (auto v = value("--rate=")) options.rate = std::max(0.0, std::atof(v));
+        else if (auto v = value("--duration=")) options.duration = std::max(0.1, std::atof(v));
+        else if (auto v = value("--warmup=")) options.warmup = std::max(0.0, std::atof(v));
+        else if (auto v = value("--scenario=")) options.scenario = v;
+        else if (auto v = value("--json=")) options.jsonOut = v;
+        else if (arg == "--no-keepalive") options.keepAlive = false;
+        else if (arg.compare(0, 2, "--") != 0 && parseUrl(arg, options)) {}
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!options.keepAlive) options.pipeline = 1;
+    std::vector<Shape> shapes;
+    if (options.scenario.empty()) {
+        Shape shape;
+        shape.name = "GET " + options.path;
+        shape.wire = Buffer(render(options, "GET", options.path, {}, ""));
+        shapes.push_back(std::move(shape));
+    } else {
+        std::string err;
+        if (!loadScenario(options, shapes, err)) {
+            std::cerr << err << '\n';
+            return 1;
+        }
+    }
+    Loadgen gen(options, shapes);
+    gen.run();
+    if (!report(gen)) return 1;
+    return gen.stats.completed > 0 ? 0 : 2;
+}
@@ -0,0 +1,66 @@
+#!/bin/bash
+# Builds nodecxx with profile guided optimization: an instrumented build
+# runs the training workload, then the same build directory is rebuilt
+# with the profile.
+#
+# The workload is nodecxx_pgo_server on loopback, driven by nodecxx_loadgen
+# with tools/scenarios/pgo.json: keep-alive GETs, JSON posts, routes with
+# parameters, small (cached) and large (sendfile) static files, over
+# keep-alive, pipelined and one-request connections.
+#
+# usage: tools/pgo_build.sh <build dir> [cmake options...]
+#   TRAIN_SECONDS=<s>  seconds per workload (5)
+#   CXX=clang++        for a Clang build, needs llvm-profdata
+set -e
+
+BUILD=${1:?usage: $0 <build dir> [cmake options...]}
+shift
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+TRAIN_SECONDS=${TRAIN_SECONDS:-5}
+PORT=8714
+JOBS=$(nproc 2>/dev/null || echo 4)
+
+echo "== instrumented build"
+cmake -S "$SRC" -B "$BUILD" -DCMAKE_BUILD_TYPE=Release -DNODECXX_PGO=GENERATE "$@"
+cmake --build "$BUILD" -j"$JOBS" --target nodecxx_pgo_server nodecxx_loadgen
+PROFILE=$(sed -n 's/^NODECXX_PGO_DIR:PATH=//p' "$BUILD/CMakeCache.txt")
+rm -rf "$PROFILE"
+mkdir -p "$PROFILE"
+
+ROOT=$(mktemp -d)
+DISCARD=$(mktemp -d)
+trap 'rm -rf "$ROOT" "$DISCARD"' EXIT
+head -c 2048 /dev/urandom | base64 > "$ROOT/index.html"
+head -c $((512 * 1024)) /dev/urandom | base64 > "$ROOT/bundle.js"
+
+echo "== training"
+"$BUILD/nodecxx_pgo_server" "$ROOT" $PORT &
+SERVER=$!
+for i in $(seq 50); do
+    if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then break; fi
+    sleep 0.1
+done
+
+# the load generator is instrumented as well, its profile goes elsewhere
+train() {
+    GCOV_PREFIX="$DISCARD" LLVM_PROFILE_FILE="$DISCARD/%m.profraw" \
+        "$BUILD/nodecxx_loadgen" --warmup=0 --duration="$TRAIN_SECONDS" \
+        --scenario="$SRC/tools/scenarios/pgo.json" "$@" http://127.0.0.1:$PORT/
+}
+train --connections=32
+train --connections=32 --pipeline=16
+train --connections=8 --no-keepalive
+
+# a normal exit writes the profile
+kill -TERM $SERVER
+wait $SERVER
+
+if ls "$PROFILE"/*.profraw >/dev/null 2>&1; then
+    PROFDATA=${LLVM_PROFDATA:-llvm-profdata}
+    "$PROFDATA" merge -output="$PROFILE/nodecxx.profdata" "$PROFILE"/*.profraw
+fi
+
+echo "== optimized build"
+cmake -S "$SRC" -B "$BUILD" -DNODECXX_PGO=USE "$@"
+cmake --build "$BUILD" -j"$JOBS"
+echo "profile in $PROFILE, optimized build in $BUILD"
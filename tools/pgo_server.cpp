@@ -0,0 +1,58 @@
+// The server of the PGO training run (tools/pgo_build.sh). It answers the
+// requests of tools/scenarios/pgo.json: JSON documents, routes with
+// parameters, JSON posts and the files below the directory given on the
+// command line. SIGINT and SIGTERM end it normally, so the profile of the
+// instrumented build gets written.
+#include <core.hpp>
+#include <express/express.hpp>
+#include <express/static.hpp>
+
+#include <csignal>
+#include <iostream>
+
+using namespace nodecxx;
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <static root> [port]\n";
+        return 1;
+    }
+    std::string port = argc > 2 ? argv[2] : "8713";
+    express app;
+    app.use("/static", serveStatic(argv[1]));
+    app.get("/", [](IncomingMessage&, HttpServerResponse& resp) {
+        resp.setHeader("Content-Type", "application/json");
+        resp.end(Json(Json::object {
+            { "key1", "value1" },
+            { "key2", "value2" },
+            { "arr", Json::array {12.5, 2.0} }
+        }));
+    });
+    app.get("/api/v1/users/:id", [](IncomingMessage&, HttpServerResponse& resp, const RouteParams& params) {
+        resp.setHeader("Content-Type", "application/json");
+        resp.setHeader("Cache-Control", "no-cache");
+        resp.end(Json(Json::object {
+            { "id", params["id"].to_string() },
+            { "name", "Ada Lovelace" },
+            { "roles", Json::array { "admin", "dev" } }
+        }));
+    });
+    // the body is parsed but not looked at, like most handlers that only
+    // need the headers to answer
+    app.post("/api/v1/orders", [](IncomingMessage& req, HttpServerResponse& resp) {
+        resp.statusCode = 201;
+        resp.setHeader("Content-Type", "application/json");
+        resp.setHeader("Location", "/api/v1/orders/4711");
+        resp.end(Json(Json::object {
+            { "id", 4711 },
+            { "contentType", req.headers().count("Content-Type") ? "json" : "none" }
+        }));
+    });
+    app.listen(port, "127.0.0.1");
+    boost::asio::signal_set signals(core::service(), SIGINT, SIGTERM);
+    signals.async_wait([](const boost::system::error_code&, int) {
+        core::service().stop();
+    });
+    run();
+}
@@ -0,0 +1,171 @@
+#include "trace.hpp"
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <unistd.h>
+
+namespace nodecxx {
+namespace trace {
+
+namespace {
+
+// A slot is written by its thread only. The sequence number tells readers
+// whether the event in it is complete and still the one they expect.
+struct Slot {
+    std::atomic<uint64_t> seq{0};
+    Event event;
+};
+
+struct Ring {
+    unsigned thread;
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    // number of events written so far
+    std::atomic<uint64_t> head{0};
+    Ring(unsigned thread, size_t size)
+        : thread(thread)
+        , mask(size - 1)
+        , slots(new Slot[size])
+    {}
+};
+
+std::mutex mutex;
+// rings live until the process ends, dumps may read them after their
+// thread is gone
+std::vector<std::unique_ptr<Ring>> rings;
+std::atomic<size_t> ringSize{64 * 1024};
+
+thread_local Ring* currentRing = nullptr;
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Ring* registerThread() {
+    // a power of two, so the index is a mask away
+    size_t size = 1;
+    while (size < ringSize.load()) size <<= 1;
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.emplace_back(new Ring(unsigned(rings.size()), size));
+    return rings.back().get();
+}
+
+// the events of ring that were not overwritten
+void collect(const Ring& ring, std::vector<Event>& events) {
+    auto head = ring.head.load(std::memory_order_acquire);
+    auto size = ring.mask + 1;
+    for (auto i = head > size ? head - size : 0; i < head; ++i) {
+        auto& slot = ring.slots[i & ring.mask];
+        auto seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != 2 * i + 2) continue;
+        auto event = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+        events.push_back(event);
+    }
+}
+
+void writeEvent(std::ostream& out, const Event& e, unsigned thread, int pid, int64_t epoch, bool& first) {
+    const char* name;
+    const char* cat;
+    char ph;
+    const char* argName = nullptr;
+    bool async = true;
+    switch (e.point) {
+    case Point::Accept: name = "connection"; cat = "net"; ph = 'b'; break;
+    case Point::Close: name = "connection"; cat = "net"; ph = 'e'; argName = "had_error"; break;
+    case Point::FirstByteRead: name = "request"; cat = "http"; ph = 'b'; argName = "request"; break;
+    case Point::ResponseEnd: name = "request"; cat = "http"; ph = 'e'; argName = "status"; break;
+    case Point::HeadersComplete: name = "headers complete"; cat = "http"; ph = 'n'; argName = "request"; break;
+    case Point::FirstByteWritten: name = "first byte written"; cat = "http"; ph = 'n'; argName = "status"; break;
+    case Point::HandlerStart: name = "request listener"; cat = "http"; ph = 'B'; argName = "request"; async = false; break;
+    case Point::HandlerEnd: name = "request listener"; cat = "http"; ph = 'E'; async = false; break;
+    default: return;
+    }
+    char ts[32];
+    std::snprintf(ts, sizeof(ts), "%.3f", (e.time - epoch) / 1000.0);
+    out << (first ? "\n" : ",\n")
+        << "{\"name\":\"" << name << "\",\"cat\":\"" << cat << "\",\"ph\":\"" << ph
+        << "\",\"ts\":" << ts << ",\"pid\":" << pid << ",\"tid\":" << thread;
+    if (async) {
+        char id[24];
+        std::snprintf(id, sizeof(id), "0x%llx", static_cast<unsigned long long>(e.id));
+        out << ",\"id\":\"" << id << '"';
+    } else {
+        out << ",\"args\":{\"conn\":" << e.id << '}';
+    }
+    if (async && argName) {
+        out << ",\"args\":{\"" << argName << "\":" << e.arg << '}';
+    }
+    out << '}';
+    first = false;
+}
+
+} // anonymous namespace
+
+namespace impl {
+
+void record(Point point, uint64_t id, uint64_t arg) {
+    auto ring = currentRing;
+    if (ring == nullptr) {
+        ring = currentRing = registerThread();
+    }
+    auto n = ring->head.load(std::memory_order_relaxed);
+    auto& slot = ring->slots[n & ring->mask];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event = Event{ now(), id, arg, point };
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+    ring->head.store(n + 1, std::memory_order_release);
+}
+
+} // namespace impl
+
+void enable(size_t eventsPerThread) {
+    ringSize = std::max<size_t>(eventsPerThread, 2);
+    impl::recording = true;
+}
+
+void disable() {
+    impl::recording = false;
+}
+
+void dumpChromeTrace(std::ostream& out) {
+    std::vector<Ring*> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& r : rings) snapshot.push_back(r.get());
+    }
+    std::vector<std::vector<Event>> events(snapshot.size());
+    int64_t epoch = INT64_MAX;
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        collect(*snapshot[i], events[i]);
+        if (!events[i].empty()) epoch = std::min(epoch, events[i].front().time);
+    }
+    auto pid = ::getpid();
+    bool first = true;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        for (const auto& e : events[i]) {
+            writeEvent(out, e, snapshot[i]->thread, pid, epoch, first);
+        }
+    }
+    out << "\n]}\n";
+}
+
+bool dumpChromeTrace(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) return false;
+    dumpChromeTrace(out);
+    out.close();
+    return bool(out);
+}
+
+} // namespace trace
+} // namespace nodecxx
@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <ostream>
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NODECXX_USDT(name, id, arg) DTRACE_PROBE2(nodecxx, name, id, arg)
+#else
+#define NODECXX_USDT(name, id, arg) do {} while (0)
+#endif
+
+namespace nodecxx {
+namespace trace {
+
+// The phases of a connection and its requests. Every point is a USDT probe
+// of provider nodecxx (when built with <sys/sdt.h>) with the connection id
+// and a second argument, and goes to the ring buffer of the thread while
+// recording is enabled.
+enum class Point : uint8_t {
+    Accept,             // accept_conn(conn, 0)
+    FirstByteRead,      // first_byte_read(conn, request number)
+    HeadersComplete,    // headers_complete(conn, request number)
+    HandlerStart,       // handler_start(conn, request number)
+    HandlerEnd,         // handler_end(conn, request number)
+    FirstByteWritten,   // first_byte_written(conn, status code)
+    ResponseEnd,        // response_end(conn, status code)
+    Close               // close_conn(conn, had error)
+};
+
+struct Event {
+    // nanoseconds, steady clock
+    int64_t time;
+    uint64_t id;
+    uint64_t arg;
+    Point point;
+};
+
+namespace impl {
+
+inline std::atomic<bool> recording{false};
+
+void record(Point point, uint64_t id, uint64_t arg);
+
+inline void point(Point p, uint64_t id, uint64_t arg) {
+    if (__builtin_expect(recording.load(std::memory_order_relaxed), 0)) {
+        record(p, id, arg);
+    }
+}
+
+} // namespace impl
+
+// Starts recording into a ring of eventsPerThread events per thread, the
+// oldest events get overwritten. Rings of threads that traced before keep
+// their size.
+void enable(size_t eventsPerThread = 64 * 1024);
+void disable();
+inline bool enabled() { return impl::recording.load(std::memory_order_relaxed); }
+
+// Writes the events in the rings in the Chrome trace event format, for
+// chrome://tracing or Perfetto. Connections and requests become async
+// spans, listener runs become duration events on their thread. Recording
+// may go on meanwhile, events overwritten during the dump are skipped.
+void dumpChromeTrace(std::ostream& out);
+// same, to a file. Returns false if it cannot be written.
+bool dumpChromeTrace(const std::string& path);
+
+inline void acceptConn(uint64_t conn) {
+    NODECXX_USDT(accept_conn, conn, 0);
+    impl::point(Point::Accept, conn, 0);
+}
+inline void firstByteRead(uint64_t conn, uint64_t request) {
+    NODECXX_USDT(first_byte_read, conn, request);
+    impl::point(Point::FirstByteRead, conn, request);
+}
+inline void headersComplete(uint64_t conn, uint64_t request) {
+    NODECXX_USDT(headers_complete, conn, request);
+    impl::point(Point::HeadersComplete, conn, request);
+}
+inline void handlerStart(uint64_t conn, uint64_t request) {
+    NODECXX_USDT(handler_start, conn, request);
+    impl::point(Point::HandlerStart, conn, request);
+}
+inline void handlerEnd(uint64_t conn, uint64_t request) {
+    NODECXX_USDT(handler_end, conn, request);
+    impl::point(Point::HandlerEnd, conn, request);
+}
+inline void firstByteWritten(uint64_t conn, int status) {
+    NODECXX_USDT(first_byte_written, conn, status);
+    impl::point(Point::FirstByteWritten, conn, uint64_t(status));
+}
+inline void responseEnd(uint64_t conn, int status) {
+    NODECXX_USDT(response_end, conn, status);
+    impl::point(Point::ResponseEnd, conn, uint64_t(status));
+}
+inline void closeConn(uint64_t conn, bool hadError) {
+    NODECXX_USDT(close_conn, conn, hadError);
+    impl::point(Point::Close, conn, hadError);
+}
+
+} // namespace trace
+} // namespace nodecxx
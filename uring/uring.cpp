@@ -0,0 +1,332 @@
+#include "uring.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace nodecxx {
+namespace impl {
+
+namespace {
+
+constexpr unsigned ringEntries = 256;
+constexpr unsigned numFixedFiles = 64;
+
+int io_uring_setup(unsigned entries, ::io_uring_params* params) {
+    return int(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return int(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nrArgs) {
+    return int(::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs));
+}
+
+// -1 until decided, then 0 or 1
+std::atomic<int>& enabledSetting() {
+    static std::atomic<int> res([]() {
+        auto env = std::getenv("NODECXX_IO_URING");
+        return env && std::strcmp(env, "1") == 0 ? 1 : 0;
+    }());
+    return res;
+}
+
+template<class T>
+T* offsetPtr(void* base, unsigned offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+} // anonymous namespace
+
+boost::asio::io_service::id UringService::id;
+
+UringService::UringService(boost::asio::io_service& ios)
+    : boost::asio::io_service::service(ios)
+    , loop(ios)
+    , eventDescriptor(ios)
+{
+    if (enabledSetting().load() == 1) {
+        setup();
+    }
+}
+
+UringService::~UringService() {
+    teardown();
+}
+
+bool UringService::available() {
+    static const bool res = []() {
+        ::io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = io_uring_setup(2, &params);
+        if (fd < 0) return false;
+        ::close(fd);
+        // the single mmap layout is assumed, fast poll (5.7) implies the
+        // READ/WRITE/SEND/RECV opcodes
+        return (params.features & IORING_FEAT_SINGLE_MMAP)
+            && (params.features & IORING_FEAT_NODROP)
+            && (params.features & IORING_FEAT_FAST_POLL);
+    }();
+    return res;
+}
+
+void UringService::setEnabled(bool enabled) {
+    enabledSetting() = enabled ? 1 : 0;
+}
+
+UringService* UringService::get(boost::asio::io_service& ios) {
+    if (enabledSetting().load() != 1) return nullptr;
+    auto& res = boost::asio::use_service<UringService>(ios);
+    return res.enabled() ? &res : nullptr;
+}
+
+void UringService::setup() {
+    if (!available()) return;
+    ::io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ringFd = io_uring_setup(ringEntries, &params);
+    if (ringFd < 0) {
+        ringFd = -1;
+        return;
+    }
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(::io_uring_cqe);
+    sqRingSize = std::max(sqRingSize, cqRingSize);
+    sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    sqesSize = params.sq_entries * sizeof(::io_uring_sqe);
+    sqes = static_cast<::io_uring_sqe*>(::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+    eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sqRing == MAP_FAILED || sqes == MAP_FAILED || eventFd < 0
+            || io_uring_register(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0) {
+        teardown();
+        return;
+    }
+    // with IORING_FEAT_SINGLE_MMAP both queues share one mapping
+    cqRing = sqRing;
+    sqHead = offsetPtr<unsigned>(sqRing, params.sq_off.head);
+    sqTail = offsetPtr<unsigned>(sqRing, params.sq_off.tail);
+    sqMask = *offsetPtr<unsigned>(sqRing, params.sq_off.ring_mask);
+    sqEntries = *offsetPtr<unsigned>(sqRing, params.sq_off.ring_entries);
+    sqArray = offsetPtr<unsigned>(sqRing, params.sq_off.array);
+    cqHead = offsetPtr<unsigned>(cqRing, params.cq_off.head);
+    cqTail = offsetPtr<unsigned>(cqRing, params.cq_off.tail);
+    cqMask = *offsetPtr<unsigned>(cqRing, params.cq_off.ring_mask);
+    cqes = offsetPtr<::io_uring_cqe>(cqRing, params.cq_off.cqes);
+    eventDescriptor.assign(eventFd);
+}
+
+void UringService::teardown() {
+    boost::system::error_code ec;
+    if (eventDescriptor.is_open()) {
+        // closes eventFd
+        eventDescriptor.close(ec);
+    } else if (eventFd >= 0) {
+        ::close(eventFd);
+    }
+    eventFd = -1;
+    if (sqes && sqes != MAP_FAILED) ::munmap(sqes, sqesSize);
+    if (sqRing && sqRing != MAP_FAILED) ::munmap(sqRing, sqRingSize);
+    sqes = nullptr;
+    sqRing = cqRing = nullptr;
+    if (ringFd >= 0) ::close(ringFd);
+    ringFd = -1;
+}
+
+void UringService::shutdown_service() {
+    teardown();
+}
+
+::io_uring_sqe* UringService::nextSqe() {
+    auto tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+        // the queue is full, hand everything to the kernel first
+        submitLocked();
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+            return nullptr;
+        }
+    }
+    auto idx = tail & sqMask;
+    auto sqe = &sqes[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqArray[idx] = idx;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++pendingSubmissions;
+    return sqe;
+}
+
+void UringService::prepare(uint8_t opcode, int fd, void* addr, size_t len, uint64_t offset, UringOp* op, int bufferIndex) {
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto sqe = nextSqe();
+        if (sqe == nullptr) {
+            // the kernel did not take anything, fail the operation
+            loop.post([op]() {
+                op->complete(-EAGAIN);
+                delete op;
+            });
+            return;
+        }
+        sqe->opcode = opcode;
+        auto slot = fixedFileSlots.find(fd);
+        if (slot != fixedFileSlots.end()) {
+            sqe->fd = int(slot->second);
+            sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = fd;
+        }
+        sqe->addr = reinterpret_cast<uint64_t>(addr);
+        sqe->len = unsigned(len);
+        sqe->off = offset;
+        if (opcode == IORING_OP_SEND) {
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+        if (bufferIndex >= 0) {
+            sqe->buf_index = uint16_t(bufferIndex);
+        }
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+        if (outstanding++ == 0 && !waiting) {
+            waiting = true;
+            waitForCompletions();
+        }
+        if (!flushScheduled) {
+            flushScheduled = true;
+            schedule = true;
+        }
+    }
+    if (schedule) {
+        loop.post([this]() { flush(); });
+    }
+}
+
+bool UringService::cancel(UringOp* op) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // submits what is queued first if the queue is full
+    auto sqe = nextSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(op);
+    sqe->user_data = 0;
+    submitLocked();
+    return true;
+}
+
+void UringService::submitLocked() {
+    while (pendingSubmissions > 0) {
+        auto res = io_uring_enter(ringFd, pendingSubmissions, 0, 0);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            // EAGAIN/EBUSY: the completion queue is backed up, the entries
+            // stay queued and go out with the next flush
+            break;
+        }
+        pendingSubmissions -= unsigned(res);
+        if (res == 0) break;
+    }
+}
+
+void UringService::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    flushScheduled = false;
+    submitLocked();
+}
+
+void UringService::waitForCompletions() {
+    eventDescriptor.async_read_some(boost::asio::buffer(&eventValue, sizeof(eventValue)),
+            [this](const boost::system::error_code& ec, size_t) {
+        if (ec == boost::asio::error::operation_aborted) return;
+        reap();
+    });
+}
+
+void UringService::reap() {
+    std::vector<std::pair<UringOp*, int>> completed;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto head = *cqHead;
+        auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        completed.reserve(tail - head);
+        for (; head != tail; ++head) {
+            auto& cqe = cqes[head & cqMask];
+            if (cqe.user_data != 0) {
+                completed.emplace_back(reinterpret_cast<UringOp*>(cqe.user_data), cqe.res);
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        // entries that did not fit before
+        submitLocked();
+        outstanding -= unsigned(completed.size());
+        // only wait while there is something to wait for, so the loop can
+        // run out of work
+        if (outstanding > 0) {
+            waitForCompletions();
+        } else {
+            waiting = false;
+        }
+    }
+    for (auto& c : completed) {
+        c.first->complete(c.second);
+        delete c.first;
+    }
+}
+
+bool UringService::registerFile(int fd) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!enabled()) return false;
+    if (fixedFileSlots.count(fd)) return true;
+    if (fixedFiles.empty()) {
+        fixedFiles.assign(numFixedFiles, -1);
+        if (io_uring_register(ringFd, IORING_REGISTER_FILES, fixedFiles.data(), unsigned(fixedFiles.size())) < 0) {
+            fixedFiles.clear();
+            return false;
+        }
+    }
+    auto free = std::find(fixedFiles.begin(), fixedFiles.end(), -1);
+    if (free == fixedFiles.end()) return false;
+    unsigned slot = unsigned(free - fixedFiles.begin());
+    ::io_uring_files_update update;
+    std::memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+    if (io_uring_register(ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) {
+        return false;
+    }
+    fixedFiles[slot] = fd;
+    fixedFileSlots.emplace(fd, slot);
+    return true;
+}
+
+void UringService::unregisterFile(int fd) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto i = fixedFileSlots.find(fd);
+    if (i == fixedFileSlots.end()) return;
+    int none = -1;
+    ::io_uring_files_update update;
+    std::memset(&update, 0, sizeof(update));
+    update.offset = i->second;
+    update.fds = reinterpret_cast<uint64_t>(&none);
+    io_uring_register(ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    fixedFiles[i->second] = -1;
+    fixedFileSlots.erase(i);
+}
+
+int UringService::registerBuffers(const ::iovec* buffers, size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!enabled() || !registeredBuffers.empty()) return -1;
+    if (io_uring_register(ringFd, IORING_REGISTER_BUFFERS, buffers, unsigned(count)) < 0) {
+        return -1;
+    }
+    registeredBuffers.assign(buffers, buffers + count);
+    return 0;
+}
+
+} // namespace impl
+} // namespace nodecxx
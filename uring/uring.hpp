@@ -0,0 +1,191 @@
+#pragma once
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <fs/iovec.hpp>
+
+namespace nodecxx {
+namespace impl {
+
+// An io_uring submission that has not completed yet. The pointer doubles
+// as the user_data of the submission and identifies it for cancel().
+struct UringOp {
+    static constexpr size_t inlineIovecs = 8;
+    ::iovec iov[inlineIovecs];
+    std::vector<::iovec> moreIov;
+    virtual ~UringOp() {}
+    virtual void complete(int res) = 0;
+    // storage for n iovecs that stays valid until the op completes
+    ::iovec* iovecs(size_t n) {
+        if (n <= inlineIovecs) return iov;
+        moreIov.resize(n);
+        return moreIov.data();
+    }
+};
+
+template<class Handler>
+struct UringHandlerOp : UringOp {
+    Handler handler;
+    bool isRead;
+    size_t requested;
+    UringHandlerOp(Handler handler, bool isRead, size_t requested)
+        : handler(std::move(handler))
+        , isRead(isRead)
+        , requested(requested)
+    {}
+    void complete(int res) override {
+        boost::system::error_code ec;
+        if (res < 0) {
+            ec = res == -ECANCELED
+                ? boost::system::error_code(boost::asio::error::operation_aborted)
+                : boost::system::error_code(-res, boost::system::system_category());
+        } else if (res == 0 && isRead && requested > 0) {
+            ec = boost::asio::error::eof;
+        }
+        handler(ec, res < 0 ? 0 : size_t(res));
+    }
+};
+
+// An io_uring instance per io_service. Submissions made while a handler
+// runs are collected and go to the kernel with a single io_uring_enter
+// once the handler returns. Completions are signalled through an eventfd
+// that is registered with the io_service and run on the loop directly,
+// there is no hop through a worker thread.
+class UringService : public boost::asio::io_service::service {
+    boost::asio::io_service& loop;
+    int ringFd = -1;
+    int eventFd = -1;
+    boost::asio::posix::stream_descriptor eventDescriptor;
+    uint64_t eventValue = 0;
+    std::mutex mutex;
+    // submission queue
+    void* sqRing = nullptr;
+    size_t sqRingSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* sqArray = nullptr;
+    ::io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned pendingSubmissions = 0;
+    bool flushScheduled = false;
+    // submitted operations that did not complete yet
+    unsigned outstanding = 0;
+    // whether a read on the eventfd is pending
+    bool waiting = false;
+    // completion queue
+    void* cqRing = nullptr;
+    size_t cqRingSize = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    ::io_uring_cqe* cqes = nullptr;
+    // fixed files
+    std::vector<int> fixedFiles;
+    std::unordered_map<int, unsigned> fixedFileSlots;
+    // registered buffers
+    std::vector<::iovec> registeredBuffers;
+public:
+    static boost::asio::io_service::id id;
+    explicit UringService(boost::asio::io_service& ios);
+    virtual ~UringService();
+    // Whether io_uring can be used on this machine
+    static bool available();
+    // Selects io_uring for io_services whose UringService is created after
+    // the call. Off by default, unless $NODECXX_IO_URING is set to 1.
+    static void setEnabled(bool enabled);
+    // True if this service got a ring, false if the caller should fall
+    // back to the reactor or the file service threads
+    bool enabled() const { return ringFd != -1; }
+    // Returns the service of ios if io_uring is enabled for it, or nullptr
+    static UringService* get(boost::asio::io_service& ios);
+public: // operations, handler(ec, bytes) runs on the loop
+    template<class Buffer, class Handler>
+    UringOp* async_read(int fd, uint64_t offset, const Buffer& buffer, Handler handler) {
+        return submitVectored(IORING_OP_READ, IORING_OP_READV, fd, offset, buffer, true, std::move(handler));
+    }
+    template<class Buffer, class Handler>
+    UringOp* async_write(int fd, uint64_t offset, const Buffer& buffer, Handler handler) {
+        return submitVectored(IORING_OP_WRITE, IORING_OP_WRITEV, fd, offset, buffer, false, std::move(handler));
+    }
+    template<class Handler>
+    UringOp* async_recv(int fd, void* data, size_t size, Handler handler) {
+        auto op = new UringHandlerOp<Handler>(std::move(handler), true, size);
+        prepare(IORING_OP_RECV, fd, data, size, 0, op);
+        return op;
+    }
+    template<class Handler>
+    UringOp* async_send(int fd, const void* data, size_t size, Handler handler) {
+        auto op = new UringHandlerOp<Handler>(std::move(handler), false, size);
+        prepare(IORING_OP_SEND, fd, const_cast<void*>(data), size, 0, op);
+        return op;
+    }
+    // data has to lie within the registered buffer bufferIndex
+    template<class Handler>
+    UringOp* async_read_fixed(int fd, uint64_t offset, unsigned bufferIndex, void* data, size_t size, Handler handler) {
+        auto op = new UringHandlerOp<Handler>(std::move(handler), true, size);
+        prepare(IORING_OP_READ_FIXED, fd, data, size, offset, op, bufferIndex);
+        return op;
+    }
+    template<class Handler>
+    UringOp* async_write_fixed(int fd, uint64_t offset, unsigned bufferIndex, const void* data, size_t size, Handler handler) {
+        auto op = new UringHandlerOp<Handler>(std::move(handler), false, size);
+        prepare(IORING_OP_WRITE_FIXED, fd, const_cast<void*>(data), size, offset, op, bufferIndex);
+        return op;
+    }
+    // The operation completes with operation_aborted if it was still
+    // pending. op must not have completed yet. Returns false if the
+    // cancellation could not be queued, the submission queue stayed full
+    // after handing the kernel what was in it.
+    bool cancel(UringOp* op);
+public: // registration
+    // Registers fd as a fixed file, so submissions on it skip the file
+    // table lookup. Returns false if all slots are taken.
+    bool registerFile(int fd);
+    void unregisterFile(int fd);
+    // Registers memory the kernel maps once for *_fixed operations.
+    // Returns the index of the first buffer or -1. Buffers can be
+    // registered once per ring.
+    int registerBuffers(const ::iovec* buffers, size_t count);
+private:
+    virtual void shutdown_service();
+    void setup();
+    void teardown();
+    // fills a submission queue entry, op is its user data
+    void prepare(uint8_t opcode, int fd, void* addr, size_t len, uint64_t offset, UringOp* op, int bufferIndex = -1);
+    template<class Buffer, class Handler>
+    UringOp* submitVectored(uint8_t single, uint8_t vectored, int fd, uint64_t offset, const Buffer& buffer, bool isRead, Handler handler);
+    ::io_uring_sqe* nextSqe();
+    // io_uring_enter for everything prepared so far, mutex is held
+    void submitLocked();
+    void flush();
+    // arms the read on the eventfd, mutex is held
+    void waitForCompletions();
+    void reap();
+};
+
+template<class Buffer, class Handler>
+UringOp* UringService::submitVectored(uint8_t single, uint8_t vectored, int fd, uint64_t offset, const Buffer& buffer, bool isRead, Handler handler) {
+    Iovecs iov(buffer);
+    auto n = iov.size();
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) total += iov[i].iov_len;
+    auto op = new UringHandlerOp<Handler>(std::move(handler), isRead, total);
+    if (n == 1) {
+        prepare(single, fd, iov[0].iov_base, iov[0].iov_len, offset, op);
+    } else {
+        auto stable = op->iovecs(n);
+        std::copy(iov.data(), iov.data() + n, stable);
+        prepare(vectored, fd, stable, n, offset, op);
+    }
+    return op;
+}
+
+} // namespace impl
+} // namespace nodecxx
@@ -0,0 +1,167 @@
+#include "worker.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace nodecxx {
+namespace worker {
+
+namespace {
+
+// the pool and index of the pool thread running on this thread
+thread_local Pool* currentPool = nullptr;
+thread_local unsigned currentIndex = 0;
+
+// at most this many tasks are moved from the shared queue to a thread's
+// deque at once, the others are left to the other threads
+constexpr size_t maxBatch = 32;
+
+std::atomic<Pool*> sharedPool{nullptr};
+
+unsigned defaultPoolSize() {
+    if (auto env = std::getenv("NODECXX_WORKER_POOL_SIZE")) {
+        auto res = std::atoi(env);
+        if (res > 0) return unsigned(res);
+    }
+    return 0;
+}
+
+uint64_t nanosBetween(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+}
+
+} // anonymous namespace
+
+Pool::Pool(unsigned size) {
+    if (size == 0) size = std::max(1u, std::thread::hardware_concurrency());
+    workers.reserve(size);
+    for (unsigned i = 0; i < size; ++i) {
+        workers.emplace_back(new Worker());
+    }
+    threads.reserve(size);
+    for (unsigned i = 0; i < size; ++i) {
+        threads.emplace_back([this, i]() { runThread(i); });
+    }
+}
+
+Pool::~Pool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+Pool& Pool::shared() {
+    // the completions go to the main loop by default, so it has to outlive
+    // the pool
+    Loop::main();
+    static Pool res(defaultPoolSize());
+    sharedPool.store(&res, std::memory_order_release);
+    return res;
+}
+
+Pool* Pool::sharedIfStarted() {
+    return sharedPool.load(std::memory_order_acquire);
+}
+
+void Pool::push(impl::Task* task) {
+    mMetrics.queued.add();
+    if (currentPool == this) {
+        auto& worker = *workers[currentIndex];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(task);
+    } else {
+        std::lock_guard<std::mutex> lock(injectedMutex);
+        injected.push_back(task);
+    }
+    pending.fetch_add(1);
+    // Pairs with the sleeper that counts itself before it checks pending,
+    // one of the two sees the other. The lock makes sure the sleeper waits
+    // already when it is notified.
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wakeup.notify_one();
+    }
+}
+
+impl::Task* Pool::take(unsigned index) {
+    auto& own = *workers[index];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            auto task = own.tasks.back();
+            own.tasks.pop_back();
+            return task;
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(injectedMutex);
+        if (!injected.empty()) {
+            auto task = injected.front();
+            injected.pop_front();
+            // a share of the rest, so the other threads find some left
+            size_t batch = std::min(maxBatch, injected.size() / workers.size());
+            if (batch) {
+                std::lock_guard<std::mutex> ownLock(own.mutex);
+                for (size_t i = 0; i < batch; ++i) {
+                    own.tasks.push_back(injected.front());
+                    injected.pop_front();
+                }
+            }
+            return task;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+        auto& victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            auto task = victim.tasks.front();
+            victim.tasks.pop_front();
+            mMetrics.steals.add();
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void Pool::runThread(unsigned index) {
+    currentPool = this;
+    currentIndex = index;
+    for (;;) {
+        if (auto task = take(index)) {
+            pending.fetch_sub(1);
+            std::unique_ptr<impl::Task> owner(task);
+            auto start = std::chrono::steady_clock::now();
+            mMetrics.queued.sub();
+            mMetrics.wait.record(nanosBetween(task->posted, start));
+            try {
+                task->run();
+            } catch (...) {
+                // only work without done gets here, it would end the process
+                // on this thread
+                Loop::main().post([e = std::current_exception()]() {
+                    std::rethrow_exception(e);
+                });
+            }
+            mMetrics.duration.record(nanosBetween(start, std::chrono::steady_clock::now()));
+            continue;
+        }
+        if (pending.load() > 0) {
+            // a task is moved between queues right now
+            std::this_thread::yield();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1);
+        wakeup.wait(lock, [this]() { return pending.load() > 0 || stopping; });
+        sleepers.fetch_sub(1);
+        if (stopping && pending.load() == 0) return;
+    }
+}
+
+} // namespace worker
+} // namespace nodecxx
@@ -0,0 +1,163 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <loop.hpp>
+#include <metrics/metrics.hpp>
+
+namespace nodecxx {
+namespace worker {
+
+namespace impl {
+
+// work handed to the pool
+struct Task {
+    std::chrono::steady_clock::time_point posted = std::chrono::steady_clock::now();
+    virtual ~Task() {}
+    virtual void run() = 0;
+};
+
+template<class F>
+struct TaskImpl : Task {
+    F f;
+    template<class G>
+    explicit TaskImpl(G&& g) : f(std::forward<G>(g)) {}
+    void run() override { f(); }
+};
+
+// runs work and posts done(result) to loop, or rethrows what work threw on
+// the loop
+template<class Work, class Done>
+void complete(Loop& loop, Work& work, Done& done) {
+    using Result = typename std::result_of<Work&()>::type;
+    try {
+        if constexpr (std::is_void<Result>::value) {
+            work();
+            loop.post(std::move(done));
+        } else {
+            loop.post([done = std::move(done), result = work()]() mutable {
+                done(std::move(result));
+            });
+        }
+    } catch (...) {
+        loop.post([e = std::current_exception()]() {
+            std::rethrow_exception(e);
+        });
+    }
+}
+
+} // namespace impl
+
+struct PoolMetrics {
+    // tasks submitted that did not start yet
+    metrics::Gauge queued;
+    // nanoseconds from submitting a task until it started
+    metrics::Histogram wait;
+    // nanoseconds a task ran
+    metrics::Histogram duration;
+    // tasks a thread took from the queue of another one
+    metrics::Counter steals;
+};
+
+// A pool of threads for CPU bound work, like image resizing or compression,
+// that would otherwise block the loop and every connection on it. Unlike
+// impl::FileService it is not tied to an io_service: submit() remembers the
+// loop it is called on and posts the completion back to it.
+//
+// Every thread has a deque of its own. Tasks submitted from a pool thread go
+// to the back of its deque and it takes them from there, newest first,
+// while their data is still in the cache. Tasks submitted from other threads
+// go to a shared queue that idle threads take batches from. A thread that
+// runs out of work steals the oldest task of another thread.
+class Pool {
+    struct alignas(64) Worker {
+        std::mutex mutex;
+        std::deque<impl::Task*> tasks;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex injectedMutex;
+    std::deque<impl::Task*> injected;
+    // tasks in all the queues
+    std::atomic<size_t> pending{0};
+    // threads waiting for work
+    std::atomic<unsigned> sleepers{0};
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+    PoolMetrics mMetrics;
+public:
+    // a pool of size threads, as many as there are cores if 0
+    explicit Pool(unsigned size = 0);
+    Pool(const Pool&) = delete;
+    Pool& operator= (const Pool&) = delete;
+    // runs the tasks still queued, then joins the threads
+    ~Pool();
+    // The pool submit() below uses, started on first use. It has
+    // $NODECXX_WORKER_POOL_SIZE threads, or one per core if that is not set.
+    static Pool& shared();
+    // the shared pool if it was started, nullptr otherwise
+    static Pool* sharedIfStarted();
+    unsigned size() const { return unsigned(threads.size()); }
+    const PoolMetrics& metrics() const { return mMetrics; }
+    // Runs work() on the pool, then done(result), or done() if work returns
+    // void, on the loop submit() was called on. Outside of loop threads,
+    // pool threads included, that is Loop::main(). The loop does not run
+    // out of work until done ran. If work throws, the exception is rethrown
+    // on the loop and done is not called.
+    template<class Work, class Done>
+    void submit(Work&& work, Done&& done) {
+        auto current = Loop::current();
+        auto& loop = current ? *current : Loop::main();
+        push(new impl::TaskImpl<Completing<typename std::decay<Work>::type, typename std::decay<Done>::type>>(
+            Completing<typename std::decay<Work>::type, typename std::decay<Done>::type>{
+                loop, boost::asio::make_work_guard(loop.service()),
+                std::forward<Work>(work), std::forward<Done>(done)}));
+    }
+    // Runs work() on the pool, nothing is posted back. If work throws, the
+    // exception is rethrown on Loop::main(), the loop submit() was called
+    // on may not run anymore by then.
+    template<class Work>
+    void submit(Work&& work) {
+        push(new impl::TaskImpl<typename std::decay<Work>::type>(std::forward<Work>(work)));
+    }
+private:
+    template<class Work, class Done>
+    struct Completing {
+        Loop& loop;
+        // given back after done was posted, which keeps the loop busy itself
+        boost::asio::executor_work_guard<boost::asio::io_service::executor_type> busy;
+        Work work;
+        Done done;
+        void operator()() {
+            impl::complete(loop, work, done);
+            busy.reset();
+        }
+    };
+    void push(impl::Task* task);
+    impl::Task* take(unsigned index);
+    void runThread(unsigned index);
+};
+
+// Pool::shared().submit(...)
+template<class Work, class Done>
+void submit(Work&& work, Done&& done) {
+    Pool::shared().submit(std::forward<Work>(work), std::forward<Done>(done));
+}
+
+template<class Work>
+void submit(Work&& work) {
+    Pool::shared().submit(std::forward<Work>(work));
+}
+
+} // namespace worker
+} // namespace nodecxx